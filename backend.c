@@ -0,0 +1,514 @@
+/*
+ * backend.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_SYS_EXTATTR_H) /* FreeBSD */
+#  include <sys/extattr.h>
+#elif defined(HAVE_SYS_XATTR_H) /* Linux & MacOS */
+#  include <sys/xattr.h>
+#endif
+
+#include "metrics.h"
+#include "faults.h"
+#include "backend.h"
+
+/*
+ * The native backend, ie the extended attributes of the filesystem
+ * itself. Symbolic links are never followed.
+ */
+
+#if defined(HAVE_EXTATTR_GET_LINK)
+/* FreeBSD - split "user.NAME" and "security.NAME" into namespace and name */
+static int
+native_ns(const char **np) {
+    if (strncmp(*np, "user.", 5) == 0) {
+	*np += 5;
+	return EXTATTR_NAMESPACE_USER;
+    }
+    if (strncmp(*np, "security.", 9) == 0) {
+	*np += 9;
+	return EXTATTR_NAMESPACE_SYSTEM;
+    }
+    if (strncmp(*np, "system.", 7) == 0) {
+	*np += 7;
+	return EXTATTR_NAMESPACE_SYSTEM;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/* Append the names of one namespace to buf, converted to NUL terminated prefixed names */
+static ssize_t
+native_list_ns(const char *path,
+	       int ns,
+	       const char *prefix,
+	       char *buf,
+	       size_t size) {
+    unsigned char *tbuf;
+    ssize_t tlen, i, len = 0;
+    size_t plen = strlen(prefix);
+
+    tlen = extattr_list_link(path, ns, NULL, 0);
+    if (tlen <= 0)
+	return tlen;
+
+    tbuf = malloc(tlen);
+    if (!tbuf)
+	return -1;
+
+    tlen = extattr_list_link(path, ns, tbuf, tlen);
+    for (i = 0; i < tlen; i += 1+tbuf[i]) {
+	if (buf) {
+	    if (len+plen+tbuf[i]+1 > size) {
+		free(tbuf);
+		errno = ERANGE;
+		return -1;
+	    }
+	    memcpy(buf+len, prefix, plen);
+	    memcpy(buf+len+plen, tbuf+i+1, tbuf[i]);
+	    buf[len+plen+tbuf[i]] = '\0';
+	}
+	len += plen+tbuf[i]+1;
+    }
+
+    free(tbuf);
+    return tlen < 0 ? -1 : len;
+}
+#endif
+
+
+static ssize_t
+native_get(const char *path,
+	   const char *name,
+	   void *buf,
+	   size_t size) {
+#if defined(HAVE_EXTATTR_GET_LINK)
+    /* FreeBSD */
+    int ns = native_ns(&name);
+
+    if (ns < 0)
+	return -1;
+    return extattr_get_link(path, ns, name, buf, size);
+#elif defined(HAVE_LGETXATTR)
+    /* Linux */
+    return lgetxattr(path, name, buf, size);
+#elif defined(HAVE_GETXATTR)
+    /* MacOS */
+    return getxattr(path, name, buf, size, 0, XATTR_NOFOLLOW);
+#elif defined(HAVE_ATTROPEN)
+    /* Solaris */
+    struct stat sb;
+    ssize_t len;
+    int fd;
+
+    fd = attropen(path, name, O_RDONLY);
+    if (fd < 0)
+	return -1;
+    if (!buf) {
+	len = fstat(fd, &sb) < 0 ? -1 : sb.st_size;
+	close(fd);
+	return len;
+    }
+    len = read(fd, buf, size);
+    close(fd);
+    return len;
+#else
+    /* No way to read xattrs/extended attributes */
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int
+native_set(const char *path,
+	   const char *name,
+	   const void *buf,
+	   size_t size,
+	   int flags) {
+#if defined(HAVE_EXTATTR_SET_LINK)
+    /* FreeBSD - no atomic create/replace, so check first */
+    int ns = native_ns(&name);
+    ssize_t rc;
+
+    if (ns < 0)
+	return -1;
+    if (flags & (BACKEND_CREATE|BACKEND_REPLACE)) {
+	rc = extattr_get_link(path, ns, name, NULL, 0);
+	if ((flags & BACKEND_CREATE) && rc >= 0) {
+	    errno = EEXIST;
+	    return -1;
+	}
+	if ((flags & BACKEND_REPLACE) && rc < 0)
+	    return -1;
+    }
+    rc = extattr_set_link(path, ns, name, buf, size);
+    if (rc >= 0 && (size_t) rc != size) {
+	errno = EIO;
+	return -1;
+    }
+    return rc < 0 ? -1 : 0;
+#elif defined(HAVE_LGETXATTR)
+    /* Linux */
+    return lsetxattr(path, name, buf, size,
+		     ((flags & BACKEND_CREATE) ? XATTR_CREATE : 0) |
+		     ((flags & BACKEND_REPLACE) ? XATTR_REPLACE : 0));
+#elif defined(HAVE_GETXATTR)
+    /* MacOS */
+    return setxattr(path, name, buf, size, 0, XATTR_NOFOLLOW |
+		    ((flags & BACKEND_CREATE) ? XATTR_CREATE : 0) |
+		    ((flags & BACKEND_REPLACE) ? XATTR_REPLACE : 0));
+#elif defined(HAVE_ATTROPEN)
+    /* Solaris */
+    ssize_t len;
+    int fd;
+
+    fd = attropen(path, name, O_WRONLY|O_TRUNC|
+		  ((flags & BACKEND_REPLACE) ? 0 : O_CREAT) |
+		  ((flags & BACKEND_CREATE) ? O_EXCL : 0), 0666);
+    if (fd < 0)
+	return -1;
+    len = write(fd, buf, size);
+    if (close(fd) < 0)
+	len = -1;
+    if (len >= 0 && (size_t) len != size) {
+	errno = EIO;
+	return -1;
+    }
+    return len < 0 ? -1 : 0;
+#else
+    /* No way to write attribute */
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int
+native_del(const char *path,
+	   const char *name) {
+#if defined(HAVE_EXTATTR_DELETE_LINK)
+    /* FreeBSD */
+    int ns = native_ns(&name);
+
+    if (ns < 0)
+	return -1;
+    return extattr_delete_link(path, ns, name);
+#elif defined(HAVE_LGETXATTR) && defined(HAVE_REMOVEXATTR)
+    /* Linux */
+    return lremovexattr(path, name);
+#elif defined(HAVE_REMOVEXATTR)
+    /* MacOS */
+    return removexattr(path, name, XATTR_NOFOLLOW);
+#elif defined(HAVE_ATTROPEN)
+    /* Solaris */
+    int fd, rc;
+
+    fd = attropen(path, ".", O_RDONLY);
+    if (fd < 0)
+	return -1;
+    rc = unlinkat(fd, name, 0);
+    close(fd);
+    return rc;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static ssize_t
+native_list(const char *path,
+	    char *buf,
+	    size_t size) {
+#if defined(HAVE_EXTATTR_LIST_LINK)
+    /* FreeBSD - the system namespace needs privileges, so just skip it if not permitted */
+    ssize_t len, slen;
+
+    len = native_list_ns(path, EXTATTR_NAMESPACE_USER, "user.", buf, size);
+    if (len < 0)
+	return -1;
+    slen = native_list_ns(path, EXTATTR_NAMESPACE_SYSTEM, "security.",
+			  buf ? buf+len : NULL, buf ? size-len : 0);
+    if (slen < 0)
+	return errno == ERANGE ? -1 : len;
+    return len+slen;
+#elif defined(HAVE_LLISTXATTR)
+    /* Linux */
+    return llistxattr(path, buf, size);
+#elif defined(HAVE_LISTXATTR)
+    /* MacOS */
+    return listxattr(path, buf, size, XATTR_NOFOLLOW);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * No batch functions: there is no batched xattr system call, so the
+ * batches (--all-xattrs) are done one by one here. Only the memory and
+ * sidecar backends gain from them, by taking their lock once.
+ */
+static BACKEND backend_native = {
+    "native",
+    1,
+    NULL,
+    NULL,
+    native_get,
+    native_set,
+    native_del,
+    native_list,
+    NULL,
+    NULL,
+};
+
+
+extern BACKEND backend_memory;
+extern BACKEND backend_sidecar;
+
+static BACKEND *backends[] = {
+    &backend_native,
+    &backend_memory,
+    &backend_sidecar,
+    NULL
+};
+
+BACKEND *backend = &backend_native;
+
+
+/* Select a backend by "name" or "name:argument" */
+int
+backend_select(const char *spec) {
+    const char *arg = strchr(spec, ':');
+    size_t len = arg ? (size_t) (arg-spec) : strlen(spec);
+    int i;
+
+    for (i = 0; backends[i]; i++)
+	if (strlen(backends[i]->name) == len &&
+	    strncmp(backends[i]->name, spec, len) == 0)
+	    break;
+
+    if (!backends[i]) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    if (backends[i]->open && backends[i]->open(arg ? arg+1 : NULL) < 0)
+	return -1;
+
+    backend = backends[i];
+    return 0;
+}
+
+int
+backend_close(void) {
+    int rc = 0;
+
+    if (backend->close)
+	rc = backend->close();
+    backend = &backend_native;
+    return rc;
+}
+
+
+/* Injected ERANGE only makes sense when there is a buffer */
+static int
+fault(METRIC_OP op,
+      const void *buf) {
+    return FAULT(op) && (buf || errno != ERANGE);
+}
+
+
+ssize_t
+backend_get(const char *path,
+	    const char *name,
+	    void *buf,
+	    size_t size) {
+    ssize_t rc;
+    uint64_t t0;
+
+    METRICS_START(t0);
+    do {
+	rc = fault(METRIC_GETXATTR, buf) ? -1 : backend->get(path, name, buf, size);
+    } while (rc < 0 && errno == EINTR);
+    METRICS_STOP(METRIC_GETXATTR, t0);
+    return rc;
+}
+
+int
+backend_set(const char *path,
+	    const char *name,
+	    const void *buf,
+	    size_t size,
+	    int flags) {
+    int rc;
+    uint64_t t0;
+
+    METRICS_START(t0);
+    do {
+	rc = FAULT(METRIC_SETXATTR) ? -1 : backend->set(path, name, buf, size, flags);
+    } while (rc < 0 && errno == EINTR);
+    METRICS_STOP(METRIC_SETXATTR, t0);
+    return rc;
+}
+
+int
+backend_del(const char *path,
+	    const char *name) {
+    int rc;
+    uint64_t t0;
+
+    METRICS_START(t0);
+    do {
+	rc = FAULT(METRIC_SETXATTR) ? -1 : backend->del(path, name);
+    } while (rc < 0 && errno == EINTR);
+    METRICS_STOP(METRIC_SETXATTR, t0);
+    return rc;
+}
+
+ssize_t
+backend_list(const char *path,
+	     char *buf,
+	     size_t size) {
+    ssize_t rc;
+    uint64_t t0;
+
+    METRICS_START(t0);
+    do {
+	rc = fault(METRIC_LISTXATTR, buf) ? -1 : backend->list(path, buf, size);
+    } while (rc < 0 && errno == EINTR);
+    METRICS_STOP(METRIC_LISTXATTR, t0);
+    return rc;
+}
+
+
+/* Batches are timed as a whole and each request gets an equal share */
+static void
+batch_record(METRIC_OP op,
+	     uint64_t t0,
+	     size_t n) {
+    uint64_t ns;
+
+    if (!metrics_enabled || n == 0)
+	return;
+
+    ns = (metrics_now()-t0)/n;
+    while (n-- > 0)
+	metrics_record(op, ns);
+}
+
+/* An injected fault fails the whole batch */
+static int
+batch_fault(METRIC_OP op,
+	    BACKEND_OP *ops,
+	    size_t n) {
+    size_t i;
+
+    while (FAULT(op)) {
+	if (errno == EINTR)
+	    continue;
+	for (i = 0; i < n; i++) {
+	    ops[i].rc = -1;
+	    ops[i].error = errno;
+	}
+	return n;
+    }
+    return 0;
+}
+
+/* Returns the number of failed requests */
+int
+backend_get_batch(BACKEND_OP *ops,
+		  size_t n) {
+    size_t i;
+    int nf = 0;
+    uint64_t t0;
+
+    METRICS_START(t0);
+    if ((nf = batch_fault(METRIC_GETXATTR, ops, n)) > 0)
+	;
+    else if (backend->get_batch)
+	nf = backend->get_batch(ops, n);
+    else {
+	for (i = 0; i < n; i++) {
+	    do {
+		ops[i].rc = backend->get(ops[i].path, ops[i].name, ops[i].buf, ops[i].size);
+	    } while (ops[i].rc < 0 && errno == EINTR);
+	    ops[i].error = ops[i].rc < 0 ? errno : 0;
+	    if (ops[i].rc < 0)
+		nf++;
+	}
+    }
+    batch_record(METRIC_GETXATTR, t0, n);
+    return nf;
+}
+
+int
+backend_set_batch(BACKEND_OP *ops,
+		  size_t n) {
+    size_t i;
+    int nf = 0;
+    uint64_t t0;
+
+    METRICS_START(t0);
+    if ((nf = batch_fault(METRIC_SETXATTR, ops, n)) > 0)
+	;
+    else if (backend->set_batch)
+	nf = backend->set_batch(ops, n);
+    else {
+	for (i = 0; i < n; i++) {
+	    do {
+		ops[i].rc = backend->set(ops[i].path, ops[i].name, ops[i].buf, ops[i].size, ops[i].flags);
+	    } while (ops[i].rc < 0 && errno == EINTR);
+	    ops[i].error = ops[i].rc < 0 ? errno : 0;
+	    if (ops[i].rc < 0)
+		nf++;
+	}
+    }
+    batch_record(METRIC_SETXATTR, t0, n);
+    return nf;
+}
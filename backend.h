@@ -0,0 +1,139 @@
+/*
+ * backend.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef BACKEND_H
+#define BACKEND_H 1
+
+#include <errno.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Attribute storage backends. Attribute names are always given in the
+ * Linux form ("user.DOSATTRIB", "security.NTACL") and mapped as needed.
+ *
+ * get() and list() follow the getxattr() conventions: a NULL buffer
+ * returns the size needed, a too small buffer fails with ERANGE and a
+ * missing attribute with ENOATTR. list() returns NUL terminated names.
+ */
+
+/* set() flags */
+#define BACKEND_CREATE	0x01	/* Fail with EEXIST if present */
+#define BACKEND_REPLACE	0x02	/* Fail with ENOATTR if missing */
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+/* One request in a batch, rc and error are filled in */
+typedef struct {
+    const char *path;
+    const char *name;
+    void *buf;
+    size_t size;
+    int flags;
+    ssize_t rc;
+    int error;
+} BACKEND_OP;
+
+typedef struct backend {
+    const char *name;
+    int ctime_changes;		/* Attribute changes update the ctime */
+
+    int (*open)(const char *arg);
+    int (*close)(void);
+
+    ssize_t (*get)(const char *path,
+		   const char *name,
+		   void *buf,
+		   size_t size);
+    int (*set)(const char *path,
+	       const char *name,
+	       const void *buf,
+	       size_t size,
+	       int flags);
+    int (*del)(const char *path,
+	       const char *name);
+    ssize_t (*list)(const char *path,
+		    char *buf,
+		    size_t size);
+
+    /* Optional, done one by one if NULL */
+    int (*get_batch)(BACKEND_OP *ops,
+		     size_t n);
+    int (*set_batch)(BACKEND_OP *ops,
+		     size_t n);
+} BACKEND;
+
+
+extern BACKEND *backend;
+
+
+extern int
+backend_select(const char *spec);
+
+extern int
+backend_close(void);
+
+extern ssize_t
+backend_get(const char *path,
+	    const char *name,
+	    void *buf,
+	    size_t size);
+
+extern int
+backend_set(const char *path,
+	    const char *name,
+	    const void *buf,
+	    size_t size,
+	    int flags);
+
+extern int
+backend_del(const char *path,
+	    const char *name);
+
+extern ssize_t
+backend_list(const char *path,
+	     char *buf,
+	     size_t size);
+
+extern int
+backend_get_batch(BACKEND_OP *ops,
+		  size_t n);
+
+extern int
+backend_set_batch(BACKEND_OP *ops,
+		  size_t n);
+
+#endif
@@ -0,0 +1,698 @@
+/*
+ * digest.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "digest.h"
+
+/*
+ * Merkle style digest of the DOSATTRIBs of a tree, for verifying
+ * replicas. Every entry is hashed (128 bits) from its name and raw
+ * DOSATTRIB (or the lack of one), and the hash is added to the "local"
+ * sum of the directory it is in. Sums commute, so the worker threads
+ * may add entries in any order and without locks. After the traversal
+ * the "total" of every directory is computed, deepest first, by hashing
+ * its local sum, its number of entries and the sum of the hashes of the
+ * names and totals of its subdirectories.
+ *
+ * Two digests are compared from the top, only descending into
+ * subdirectories whose totals differ, and the directories whose local
+ * sums differ are reported.
+ *
+ * File format, integers little endian, records sorted by path:
+ *
+ *   "DOSATTRIB-DG\n" u32 version u64 directories
+ *   records: u16 path length, path (relative to the top, "" for it),
+ *            u64 entries, 16 byte local sum, 16 byte total
+ */
+
+#define DG_MAGIC	"DOSATTRIB-DG\n"
+#define DG_VERSION	1
+#define DG_RECSIZE	(8+16+16)
+
+typedef struct dnode {
+    struct dnode *next;		/* Hash chain */
+    struct dnode *child;	/* Subdirectories, after digest_finish() */
+    struct dnode *sibling;
+    uint64_t hash;
+    uint64_t entries;
+    uint64_t local[2];
+    uint64_t sub[2];
+    uint64_t total[2];
+    size_t plen;
+    char path[];
+} DNODE;
+
+struct digest {
+    pthread_mutex_t mtx;
+    uint64_t gen;
+    DNODE **tab;
+    size_t size;
+    size_t nodes;
+    DNODE *top;
+};
+
+static uint64_t d_gen = 0;
+
+/* The directory last added to by this thread, usually the next one too */
+typedef struct {
+    uint64_t gen;
+    DNODE *np;
+} DCACHE;
+
+static pthread_key_t d_cache_key;
+static pthread_once_t d_cache_once = PTHREAD_ONCE_INIT;
+static int d_cache_error = 0;
+
+static void
+d_cache_init(void) {
+    d_cache_error = pthread_key_create(&d_cache_key, free);
+}
+
+/* NULL if we can't have one, it is just a shortcut */
+static DCACHE *
+d_cache(void) {
+    DCACHE *cp;
+
+    pthread_once(&d_cache_once, d_cache_init);
+    if (d_cache_error)
+	return NULL;
+
+    cp = pthread_getspecific(d_cache_key);
+    if (!cp) {
+	cp = calloc(1, sizeof(*cp));
+	if (cp && pthread_setspecific(d_cache_key, cp) != 0) {
+	    free(cp);
+	    cp = NULL;
+	}
+    }
+    return cp;
+}
+
+
+
+static uint64_t
+mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void
+hash_init(uint64_t h[2]) {
+    h[0] = 0xcbf29ce484222325ULL;
+    h[1] = 0x84222325cbf29ce4ULL;
+}
+
+/* Two FNV-1a style lanes with different multipliers */
+static void
+hash_bytes(uint64_t h[2],
+	   const void *p,
+	   size_t len) {
+    const unsigned char *s = p;
+
+    while (len-- > 0) {
+	h[0] = (h[0] ^ *s) * 0x100000001b3ULL;
+	h[1] = (h[1] ^ *s++) * 0x9e3779b97f4a7c15ULL;
+    }
+}
+
+/* Little endian, so digests match between architectures */
+static void
+hash_u64(uint64_t h[2],
+	 uint64_t v) {
+    unsigned char b[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+	b[i] = v & 0xFF;
+	v >>= 8;
+    }
+    hash_bytes(h, b, 8);
+}
+
+static void
+hash_final(uint64_t h[2]) {
+    h[0] = mix64(h[0]);
+    h[1] = mix64(h[1] ^ h[0]);
+}
+
+
+static uint64_t
+path_hash(const char *path,
+	  size_t plen) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (plen-- > 0) {
+	h ^= (unsigned char) *path++;
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int
+d_rehash(DIGEST *dp) {
+    size_t nsize = dp->size ? dp->size*2 : 1024;
+    DNODE **ntab, *np, *next;
+    size_t i;
+
+    ntab = calloc(nsize, sizeof(*ntab));
+    if (!ntab)
+	return -1;
+
+    for (i = 0; i < dp->size; i++)
+	for (np = dp->tab[i]; np; np = next) {
+	    next = np->next;
+	    np->next = ntab[np->hash & (nsize-1)];
+	    ntab[np->hash & (nsize-1)] = np;
+	}
+
+    free(dp->tab);
+    dp->tab = ntab;
+    dp->size = nsize;
+    return 0;
+}
+
+/* Find (or create) the node of a directory, by the first plen chars of path */
+static DNODE *
+d_node(DIGEST *dp,
+       const char *path,
+       size_t plen,
+       int create) {
+    uint64_t h = path_hash(path, plen);
+    DNODE *np;
+
+    if (dp->size)
+	for (np = dp->tab[h & (dp->size-1)]; np; np = np->next)
+	    if (np->hash == h && np->plen == plen && memcmp(np->path, path, plen) == 0)
+		return np;
+    if (!create)
+	return NULL;
+
+    if (dp->nodes >= dp->size/2 && d_rehash(dp) < 0)
+	return NULL;
+
+    np = calloc(1, sizeof(*np)+plen+1);
+    if (!np)
+	return NULL;
+    np->hash = h;
+    np->plen = plen;
+    memcpy(np->path, path, plen);
+    np->path[plen] = '\0';
+    np->next = dp->tab[h & (dp->size-1)];
+    dp->tab[h & (dp->size-1)] = np;
+    dp->nodes++;
+    return np;
+}
+
+static DNODE *
+d_lookup(DIGEST *dp,
+	 const char *path,
+	 size_t plen) {
+    DCACHE *cp = d_cache();
+    DNODE *np = cp ? cp->np : NULL;
+
+    if (np && cp->gen == dp->gen &&
+	np->plen == plen && memcmp(np->path, path, plen) == 0)
+	return np;
+
+    pthread_mutex_lock(&dp->mtx);
+    np = d_node(dp, path, plen, 1);
+    pthread_mutex_unlock(&dp->mtx);
+
+    if (cp) {
+	cp->np = np;
+	cp->gen = dp->gen;
+    }
+    return np;
+}
+
+/* Length of the parent directory part of a relative path */
+static size_t
+parent_len(const char *path,
+	   size_t plen) {
+    while (plen > 0 && path[plen-1] != '/')
+	--plen;
+    return plen > 0 ? plen-1 : 0;
+}
+
+
+DIGEST *
+digest_new(void) {
+    DIGEST *dp;
+
+    dp = calloc(1, sizeof(*dp));
+    if (!dp)
+	return NULL;
+    pthread_mutex_init(&dp->mtx, NULL);
+    dp->gen = __atomic_add_fetch(&d_gen, 1, __ATOMIC_RELAXED);
+    return dp;
+}
+
+/*
+ * Add an entry, by its path relative to the top ("" for the top
+ * itself) and name (the last component). The blob length is -1 if it
+ * has no DOSATTRIB. May be called from several threads.
+ */
+int
+digest_add(DIGEST *dp,
+	   const char *relpath,
+	   const char *name,
+	   int isdir,
+	   const unsigned char *blob,
+	   ssize_t len) {
+    size_t rlen = strlen(relpath), nlen = strlen(name);
+    uint64_t h[2];
+    DNODE *np;
+
+    hash_init(h);
+    hash_u64(h, nlen);
+    hash_bytes(h, name, nlen);
+    hash_u64(h, (uint64_t) len);
+    if (len > 0)
+	hash_bytes(h, blob, len);
+    hash_final(h);
+
+    /* The top is counted in its own node */
+    np = d_lookup(dp, relpath, rlen > 0 ? parent_len(relpath, rlen) : 0);
+    if (!np)
+	return -1;
+    __atomic_fetch_add(&np->local[0], h[0], __ATOMIC_RELAXED);
+    __atomic_fetch_add(&np->local[1], h[1], __ATOMIC_RELAXED);
+    __atomic_fetch_add(&np->entries, 1, __ATOMIC_RELAXED);
+
+    /* Empty directories need a node too */
+    if (isdir && rlen > 0 && !d_lookup(dp, relpath, rlen))
+	return -1;
+    return 0;
+}
+
+
+static int
+depth_cmp(const void *a,
+	  const void *b) {
+    const DNODE *x = *(DNODE * const *) a, *y = *(DNODE * const *) b;
+    size_t i, dx = 0, dy = 0;
+
+    for (i = 0; i < x->plen; i++)
+	dx += (x->path[i] == '/');
+    for (i = 0; i < y->plen; i++)
+	dy += (y->path[i] == '/');
+    dx += (x->plen > 0);
+    dy += (y->plen > 0);
+    return dx < dy ? 1 : dx > dy ? -1 : 0;
+}
+
+static int
+path_cmp(const void *a,
+	 const void *b) {
+    return strcmp((*(DNODE * const *) a)->path, (*(DNODE * const *) b)->path);
+}
+
+/* All the nodes, in an array */
+static DNODE **
+d_nodes(DIGEST *dp) {
+    DNODE **nv, *np;
+    size_t i, n = 0;
+
+    nv = malloc((dp->nodes+1)*sizeof(*nv));
+    if (!nv)
+	return NULL;
+    for (i = 0; i < dp->size; i++)
+	for (np = dp->tab[i]; np; np = np->next)
+	    nv[n++] = np;
+    return nv;
+}
+
+/* Link the subdirectories to their parents */
+static int
+d_link(DIGEST *dp,
+       DNODE **nv,
+       size_t n) {
+    DNODE *np, *pp;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	np = nv[i];
+	if (np->plen == 0)
+	    continue;
+	pp = d_node(dp, np->path, parent_len(np->path, np->plen), 0);
+	if (!pp) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	np->sibling = pp->child;
+	pp->child = np;
+    }
+
+    dp->top = d_node(dp, "", 0, 0);
+    if (!dp->top) {
+	errno = EINVAL;
+	return -1;
+    }
+    return 0;
+}
+
+/* Compute the totals, when all entries have been added */
+int
+digest_finish(DIGEST *dp) {
+    DNODE **nv, *np, *pp;
+    uint64_t h[2];
+    size_t i, n, nsize;
+    const char *name;
+
+    if (!d_node(dp, "", 0, 1))
+	return -1;
+
+    nv = d_nodes(dp);
+    if (!nv)
+	return -1;
+    n = dp->nodes;
+
+    /* Directories we got entries for but not the directory itself */
+    nsize = n+1;
+    for (i = 0; i < n; i++) {
+	np = nv[i];
+	if (np->plen == 0 || d_node(dp, np->path, parent_len(np->path, np->plen), 0))
+	    continue;
+	pp = d_node(dp, np->path, parent_len(np->path, np->plen), 1);
+	if (!pp)
+	    goto Fail;
+	if (n >= nsize) {
+	    DNODE **nnv = realloc(nv, (nsize *= 2)*sizeof(*nv));
+	    if (!nnv)
+		goto Fail;
+	    nv = nnv;
+	}
+	nv[n++] = pp;
+    }
+
+    qsort(nv, n, sizeof(*nv), depth_cmp);
+    for (i = 0; i < n; i++) {
+	np = nv[i];
+	hash_init(h);
+	hash_u64(h, np->entries);
+	hash_u64(h, np->local[0]);
+	hash_u64(h, np->local[1]);
+	hash_u64(h, np->sub[0]);
+	hash_u64(h, np->sub[1]);
+	hash_final(h);
+	np->total[0] = h[0];
+	np->total[1] = h[1];
+
+	if (np->plen == 0)
+	    continue;
+	pp = d_node(dp, np->path, parent_len(np->path, np->plen), 0);
+	name = np->path+np->plen;
+	while (name > np->path && name[-1] != '/')
+	    --name;
+	hash_init(h);
+	hash_u64(h, strlen(name));
+	hash_bytes(h, name, strlen(name));
+	hash_u64(h, np->total[0]);
+	hash_u64(h, np->total[1]);
+	hash_final(h);
+	pp->sub[0] += h[0];
+	pp->sub[1] += h[1];
+    }
+
+    if (d_link(dp, nv, n) < 0)
+	goto Fail;
+    free(nv);
+    return 0;
+
+ Fail:
+    free(nv);
+    return -1;
+}
+
+uint64_t
+digest_dirs(DIGEST *dp) {
+    return dp->nodes;
+}
+
+
+static void
+put_le(unsigned char *p,
+       uint64_t v,
+       int n) {
+    while (n-- > 0) {
+	*p++ = v & 0xFF;
+	v >>= 8;
+    }
+}
+
+static uint64_t
+get_le(const unsigned char *p,
+       int n) {
+    uint64_t v = 0;
+
+    while (n-- > 0)
+	v = (v << 8) | p[n];
+    return v;
+}
+
+/* Write to a new file and rename it into place */
+int
+digest_save(DIGEST *dp,
+	    const char *path) {
+    unsigned char hdr[sizeof(DG_MAGIC)-1+4+8], rec[2+DG_RECSIZE];
+    DNODE **nv, *np;
+    FILE *fp = NULL;
+    char *tmp;
+    size_t i;
+
+    nv = d_nodes(dp);
+    tmp = malloc(strlen(path)+5);
+    if (!nv || !tmp)
+	goto Fail;
+    qsort(nv, dp->nodes, sizeof(*nv), path_cmp);
+
+    sprintf(tmp, "%s.tmp", path);
+    fp = fopen(tmp, "w");
+    if (!fp)
+	goto Fail;
+
+    memcpy(hdr, DG_MAGIC, sizeof(DG_MAGIC)-1);
+    put_le(hdr+sizeof(DG_MAGIC)-1, DG_VERSION, 4);
+    put_le(hdr+sizeof(DG_MAGIC)-1+4, dp->nodes, 8);
+    if (fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr))
+	goto Fail;
+
+    for (i = 0; i < dp->nodes; i++) {
+	np = nv[i];
+	if (np->plen > 0xFFFF) {
+	    errno = ENAMETOOLONG;
+	    goto Fail;
+	}
+	put_le(rec, np->plen, 2);
+	put_le(rec+2, np->entries, 8);
+	put_le(rec+10, np->local[0], 8);
+	put_le(rec+18, np->local[1], 8);
+	put_le(rec+26, np->total[0], 8);
+	put_le(rec+34, np->total[1], 8);
+	if (fwrite(rec, 1, 2, fp) != 2 ||
+	    fwrite(np->path, 1, np->plen, fp) != np->plen ||
+	    fwrite(rec+2, 1, DG_RECSIZE, fp) != DG_RECSIZE)
+	    goto Fail;
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+	goto Fail;
+    if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+	fp = NULL;
+	goto Fail;
+    }
+    free(tmp);
+    free(nv);
+    return 0;
+
+ Fail:
+    if (fp)
+	fclose(fp);
+    if (tmp) {
+	unlink(tmp);
+	free(tmp);
+    }
+    free(nv);
+    return -1;
+}
+
+/* Returns NULL with errno EINVAL if not a digest file */
+DIGEST *
+digest_load(const char *path) {
+    unsigned char hdr[sizeof(DG_MAGIC)-1+4+8], rec[DG_RECSIZE], lb[2];
+    char pbuf[0x10000];
+    DIGEST *dp = NULL;
+    DNODE **nv = NULL, *np;
+    uint64_t i, n;
+    size_t plen;
+    FILE *fp;
+    int e;
+
+    fp = fopen(path, "r");
+    if (!fp)
+	return NULL;
+
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+	memcmp(hdr, DG_MAGIC, sizeof(DG_MAGIC)-1) != 0 ||
+	get_le(hdr+sizeof(DG_MAGIC)-1, 4) != DG_VERSION) {
+	errno = EINVAL;
+	goto Fail;
+    }
+    n = get_le(hdr+sizeof(DG_MAGIC)-1+4, 8);
+
+    dp = digest_new();
+    if (!dp)
+	goto Fail;
+
+    for (i = 0; i < n; i++) {
+	if (fread(lb, 1, 2, fp) != 2) {
+	    errno = EINVAL;
+	    goto Fail;
+	}
+	plen = get_le(lb, 2);
+	if (fread(pbuf, 1, plen, fp) != plen ||
+	    fread(rec, 1, DG_RECSIZE, fp) != DG_RECSIZE) {
+	    errno = EINVAL;
+	    goto Fail;
+	}
+	np = d_node(dp, pbuf, plen, 1);
+	if (!np)
+	    goto Fail;
+	np->entries = get_le(rec, 8);
+	np->local[0] = get_le(rec+8, 8);
+	np->local[1] = get_le(rec+16, 8);
+	np->total[0] = get_le(rec+24, 8);
+	np->total[1] = get_le(rec+32, 8);
+    }
+
+    nv = d_nodes(dp);
+    if (!nv || d_link(dp, nv, dp->nodes) < 0)
+	goto Fail;
+    free(nv);
+    fclose(fp);
+    return dp;
+
+ Fail:
+    e = errno;
+    free(nv);
+    digest_free(dp);
+    fclose(fp);
+    errno = e;
+    return NULL;
+}
+
+
+static int
+d_compare(DIGEST *a,
+	  DNODE *an,
+	  DIGEST *b,
+	  DNODE *bn,
+	  DIGEST_FN fn,
+	  uint64_t *visited) {
+    DNODE *cp, *cq;
+    int n = 0;
+
+    ++*visited;
+    if (an->entries == bn->entries &&
+	an->total[0] == bn->total[0] && an->total[1] == bn->total[1])
+	return 0;
+
+    if (an->entries != bn->entries ||
+	an->local[0] != bn->local[0] || an->local[1] != bn->local[1]) {
+	fn(an->path, DIGEST_DIFFERS);
+	n++;
+    }
+
+    for (cp = an->child; cp; cp = cp->sibling) {
+	cq = d_node(b, cp->path, cp->plen, 0);
+	if (!cq) {
+	    fn(cp->path, DIGEST_ONLY_A);
+	    n++;
+	} else
+	    n += d_compare(a, cp, b, cq, fn, visited);
+    }
+    for (cq = bn->child; cq; cq = cq->sibling)
+	if (!d_node(a, cq->path, cq->plen, 0)) {
+	    fn(cq->path, DIGEST_ONLY_B);
+	    n++;
+	}
+
+    return n;
+}
+
+/*
+ * Compare two finished (or loaded) digests from the top down, calling
+ * fn for every difference found. Returns the number of differences.
+ */
+int
+digest_compare(DIGEST *a,
+	       DIGEST *b,
+	       DIGEST_FN fn,
+	       uint64_t *visited) {
+    *visited = 0;
+    return d_compare(a, a->top, b, b->top, fn, visited);
+}
+
+
+void
+digest_free(DIGEST *dp) {
+    DNODE *np;
+    size_t i;
+
+    if (!dp)
+	return;
+
+    for (i = 0; i < dp->size; i++)
+	while ((np = dp->tab[i]) != NULL) {
+	    dp->tab[i] = np->next;
+	    free(np);
+	}
+    free(dp->tab);
+    pthread_mutex_destroy(&dp->mtx);
+    free(dp);
+}
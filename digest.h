@@ -0,0 +1,84 @@
+/*
+ * digest.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef DIGEST_H
+#define DIGEST_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct digest DIGEST;
+
+/* What digest_compare() found for a directory */
+#define DIGEST_DIFFERS	1	/* Some entries in it differ */
+#define DIGEST_ONLY_A	2	/* Missing in the second digest */
+#define DIGEST_ONLY_B	3	/* Missing in the first digest */
+
+typedef void (*DIGEST_FN)(const char *relpath,
+			  int what);
+
+extern DIGEST *
+digest_new(void);
+
+extern int
+digest_add(DIGEST *dp,
+	   const char *relpath,
+	   const char *name,
+	   int isdir,
+	   const unsigned char *blob,
+	   ssize_t len);
+
+extern int
+digest_finish(DIGEST *dp);
+
+extern int
+digest_save(DIGEST *dp,
+	    const char *path);
+
+extern DIGEST *
+digest_load(const char *path);
+
+extern uint64_t
+digest_dirs(DIGEST *dp);
+
+extern int
+digest_compare(DIGEST *a,
+	       DIGEST *b,
+	       DIGEST_FN fn,
+	       uint64_t *visited);
+
+extern void
+digest_free(DIGEST *dp);
+
+#endif
@@ -51,15 +51,34 @@
 #include <fcntl.h>
 #include <dirent.h>
 
-#if defined(HAVE_SYS_EXTATTR_H) /* FreeBSD */
-#  include <sys/extattr.h>
-#  define DOSATTRIBNAME "DOSATTRIB"
-#elif defined(HAVE_SYS_XATTR_H) /* Linux & MacOS */
-#  include <sys/xattr.h>
-#  define DOSATTRIBNAME "user.DOSATTRIB"
-#elif define(HAVE_ATTROPEN)     /* Solaris */
-#  define DOSATTRIBNAME "user.DOSATTRIB"
-#endif
+#include "metrics.h"
+#include "sample.h"
+#include "walk.h"
+#include "output.h"
+#include "pool.h"
+#include "xscan.h"
+#include "backend.h"
+#include "faults.h"
+#include "rules.h"
+#include "digest.h"
+#include "shard.h"
+#include "server.h"
+#include "index.h"
+#include "since.h"
+#include "prefetch.h"
+#include "sort.h"
+
+#define DOSATTRIBNAME "user.DOSATTRIB"
+
+#define FORMAT_TEXT	0
+#define FORMAT_JSON	1
+#define FORMAT_CSV	2
+#define FORMAT_BIN	3
+
+#define SORTBY_NONE	0
+#define SORTBY_PATH	1
+#define SORTBY_CTIME	2
+#define SORTBY_ATTRIBS	3
 
 int f_update = 1;
 int f_debug = 0;
@@ -76,9 +95,90 @@ int f_repair = 0;
 uint16_t f_andattribs = 0xFFFF;
 uint16_t f_orattribs = 0;
 
+/* The command line operations, and those of the matching rules from --rules */
+ATTROPS f_ops;
+char *f_rules_file = NULL;
+RULES *f_rules = NULL;
+
 uint16_t f_match_set = 0;
 uint16_t f_match_clr = 0;
 
+char *f_metrics = NULL;
+int f_metrics_format = METRICS_FORMAT_PROM;
+int f_metrics_interval = 0;
+int f_metrics_top = 10;
+
+int f_summary = 0;
+int f_sample = 0;
+double f_sample_rate = 0.01;
+uint64_t f_sample_budget = 10000;
+uint64_t f_sample_seed = 0;
+
+WALK f_walk;
+
+int f_format = FORMAT_TEXT;
+
+int f_xattrs = 0;
+
+int f_sort_by = SORTBY_NONE;
+size_t f_sort_mem = 256*1024*1024;
+SORTER *f_sorter = NULL;
+
+char *f_faults = NULL;
+
+char *f_copy_from = NULL;
+
+char *f_digest_file = NULL;
+char *f_compare_file = NULL;
+DIGEST *f_digest = NULL;
+
+char *f_index_file = NULL;
+char *f_query = NULL;
+INDEX *f_index = NULL;
+
+/* --transcode: bit n of f_transcode_from is set to convert version n */
+int f_transcode_from = 0;
+int f_transcode_to = 0;
+uint64_t tc_blobs = 0;
+uint64_t tc_current = 0;
+uint64_t tc_other = 0;
+uint64_t tc_old_bytes = 0;
+uint64_t tc_new_bytes = 0;
+
+/* --optimistic: only write over what was read, retry on conflicts */
+int f_optimistic = 0;
+int f_optimistic_retries = 3;
+uint64_t oc_conflicts = 0;
+uint64_t oc_retries = 0;
+uint64_t oc_skipped = 0;
+
+uint64_t n_failed = 0;		/* Failed updates */
+uint64_t n_ignored = 0;		/* Other errors ignored with -i */
+
+char *f_since_spec = NULL;
+SINCE *f_since = NULL;
+
+/* The single path given with --copy-from, --digest, --index and --since */
+char *f_top = NULL;
+
+int f_threads = 1;
+int f_ordered = 1;
+int f_adaptive = 0;
+int f_adapt_interval = 500;
+
+int f_prefetch = 0;		/* Lookahead depth */
+int f_prefetch_threads = 4;
+
+char *f_server = NULL;
+unsigned int f_server_mode = 0600;
+char *f_client = NULL;
+
+int f_shards = 0;
+SHARD *f_shard = NULL;		/* Set in the shard processes */
+
+/* Times a crashed shard is restarted */
+#define SHARD_RETRIES 2
+
 char *argv0;
 
 
@@ -149,8 +249,9 @@ str2attrib(uint16_t *ap,
 }
 
 char *
-attrib2str(uint16_t a) {
-    static char buf[64], *bp;
+attrib2str(uint16_t a,
+	   char *buf) {
+    char *bp;
     int i;
 
     bp = buf;
@@ -181,6 +282,9 @@ attrib2str(uint16_t a) {
 
 #define DOSATTRIB_VALID_V5 (DOSATTRIB_VALID_ATTRIB|DOSATTRIB_VALID_CREATE_TIME)
 
+/* Room for the largest blob, v2 with the hex prefix (68 bytes) */
+#define DOSATTRIB_MAXSIZE 80
+
 
 typedef struct {
     uint32_t version;
@@ -196,6 +300,62 @@ typedef struct {
 } DOSATTRIB;
 
 
+/*
+ * Categories counted by --summary and estimated by --sample
+ */
+typedef enum {
+    CAT_ENTRIES = 0,
+    CAT_PRESENT,
+    CAT_MISSING,
+    CAT_INVALID,
+    CAT_V1,
+    CAT_V2,
+    CAT_V3,
+    CAT_V4,
+    CAT_V5,
+    CAT_BADDIR,
+    CAT_CHANGED,
+    CAT_NTACL,			/* Only with --all-xattrs */
+    CAT_PAI,
+    CAT_STREAMS,
+    CAT_MAX
+} CATEGORY;
+
+char *cat_names[CAT_MAX] = {
+    "Entries",
+    "DOSATTRIB present",
+    "DOSATTRIB missing",
+    "DOSATTRIB invalid",
+    "Version 1",
+    "Version 2",
+    "Version 3",
+    "Version 4",
+    "Version 5",
+    "Wrong DIRECTORY bit",
+    "Needs update",
+    "NTACL present",
+    "SAMBA_PAI present",
+    "Has DosStreams",
+};
+
+uint64_t stats[CAT_MAX];
+
+/* May be updated from several worker threads */
+#define STAT_INC(c) __atomic_fetch_add(&stats[(c)], 1, __ATOMIC_RELAXED)
+
+/* Attribute bytes, for the --all-xattrs categories */
+uint64_t stat_bytes[CAT_MAX];
+
+#define STAT_ADD(c, n)							\
+    do {								\
+	STAT_INC(c);							\
+	__atomic_fetch_add(&stat_bytes[(c)], (n), __ATOMIC_RELAXED);	\
+    } while (0)
+
+/* Number of categories in use */
+#define NCATS (f_xattrs ? CAT_MAX : CAT_NTACL)
+
+
 void
 spin(void) {
     static time_t last;
@@ -203,6 +363,12 @@ spin(void) {
     char dials[] = "|/-\\";
     static int p = 0;
 
+    /* The coordinator reports the progress of the shards */
+    if (f_shard) {
+	__atomic_fetch_add(f_shard->progress, 1, __ATOMIC_RELAXED);
+	return;
+    }
+
     time(&now);
     if (now != last) {
 	fputc(dials[p++%4], stderr);
@@ -465,7 +631,7 @@ put_hex(unsigned char **bp,
 	size_t vs) {
     int i;
 
-    if (*bs < 5)
+    if (*bs < 3+vs)
 	return -1;
 
     *(*bp)++ = '0';
@@ -474,11 +640,12 @@ put_hex(unsigned char **bp,
     for (i = vs-1; i >= 0; i--) {
 	unsigned char c = (v&0xF);
 
-	(*bp)[i] = (c > 0xA ? c-0xA+'A' : c+'0');
+	(*bp)[i] = (c >= 0xA ? c-0xA+'A' : c+'0');
+	v >>= 4;
     }
     (*bp) += vs;
     *(*bp) = '\0';
-    *bs -= 3+vs;
+    *bs -= 2+vs;
 
     return 0;
 }
@@ -632,6 +799,171 @@ create_dosattrib(DOSATTRIB *da,
     return bp-buf;
 }
 
+
+/*
+ * The fields of each DOSATTRIB version in blob order (after the 16 bit
+ * version), so blobs can be transcoded without a DOSATTRIB in between
+ */
+#define TF_VERSION	0	/* 32 bit copy of the version */
+#define TF_VALID	1
+#define TF_ATTRIB	2
+#define TF_EA_SIZE	3
+#define TF_SIZE		4
+#define TF_ALLOC_SIZE	5
+#define TF_CREATE_TIME	6
+#define TF_CHANGE_TIME	7
+#define TF_WRITE_TIME	8
+#define TF_ITIME	9
+#define TF_MAX		10
+
+typedef struct {
+    int hex;			/* Starts with the attributes in hex */
+    uint32_t valid;		/* The valid flags it can hold */
+    int nfields;
+    struct {
+	uint8_t field;
+	uint8_t size;
+    } f[9];
+} FIELDMAP;
+
+static const FIELDMAP field_maps[] = {
+    { 0, 0, 0, { { 0, 0 } } },
+    { 0, DOSATTRIB_VALID_V1, 7,
+      { { TF_VERSION, 4 }, { TF_ATTRIB, 4 }, { TF_EA_SIZE, 4 }, { TF_SIZE, 8 },
+	{ TF_ALLOC_SIZE, 8 }, { TF_CREATE_TIME, 8 }, { TF_CHANGE_TIME, 8 } } },
+    { 1, DOSATTRIB_VALID_V3, 9,
+      { { TF_VERSION, 4 }, { TF_VALID, 4 }, { TF_ATTRIB, 4 }, { TF_EA_SIZE, 4 },
+	{ TF_SIZE, 8 }, { TF_ALLOC_SIZE, 8 }, { TF_CREATE_TIME, 8 },
+	{ TF_CHANGE_TIME, 8 }, { TF_WRITE_TIME, 8 } } },
+    { 1, DOSATTRIB_VALID_V3, 8,
+      { { TF_VERSION, 4 }, { TF_VALID, 4 }, { TF_ATTRIB, 4 }, { TF_EA_SIZE, 4 },
+	{ TF_SIZE, 8 }, { TF_ALLOC_SIZE, 8 }, { TF_CREATE_TIME, 8 },
+	{ TF_CHANGE_TIME, 8 } } },
+    { 0, DOSATTRIB_VALID_V4, 5,
+      { { TF_VERSION, 4 }, { TF_VALID, 4 }, { TF_ATTRIB, 4 }, { TF_ITIME, 8 },
+	{ TF_CREATE_TIME, 8 } } },
+    { 0, DOSATTRIB_VALID_V5, 4,
+      { { TF_VERSION, 4 }, { TF_VALID, 4 }, { TF_ATTRIB, 4 }, { TF_CREATE_TIME, 8 } } },
+};
+
+/* Version 1 has no valid flags, a field is valid if set */
+static const uint32_t field_valid[TF_MAX] = {
+    0,
+    0,
+    DOSATTRIB_VALID_ATTRIB,
+    DOSATTRIB_VALID_EA_SIZE,
+    DOSATTRIB_VALID_SIZE,
+    DOSATTRIB_VALID_ALLOC_SIZE,
+    DOSATTRIB_VALID_CREATE_TIME,
+    DOSATTRIB_VALID_CHANGE_TIME,
+    0,
+    DOSATTRIB_VALID_ITIME,
+};
+
+
+/*
+ * The offset of the 16 bit version in a blob, after the optional hex
+ * attributes and NULs (as in parse_dosattrib()), or -1
+ */
+static ssize_t
+blob_header(const unsigned char *bp,
+	    ssize_t bs) {
+    ssize_t off = 0;
+
+    if (bs > 2 && bp[0] == '0' && bp[1] == 'x' && isxdigit(bp[2]))
+	for (off = 2; off < bs && isxdigit(bp[off]); off++)
+	    ;
+    if (off < bs && bp[off] == '\0')
+	++off;
+    if (off < bs && bp[off] == '\0')
+	++off;
+    return bs-off >= 2 ? off : -1;
+}
+
+/* The version of a blob from its header alone, -1 if none */
+int
+blob_version(const unsigned char *bp,
+	     ssize_t bs) {
+    ssize_t off = blob_header(bp, bs);
+
+    return off < 0 ? -1 : bp[off] | (bp[off+1] << 8);
+}
+
+
+/*
+ * Rewrite a blob as another version, field by field. Valid flags for
+ * fields the target can't hold are dropped. Returns the new length, or
+ * -1 if the blob is invalid.
+ */
+ssize_t
+transcode_dosattrib(const unsigned char *bp,
+		    ssize_t bs,
+		    int to,
+		    unsigned char *buf,
+		    size_t size) {
+    const FIELDMAP *sm, *tm;
+    uint64_t v[TF_MAX];
+    unsigned char *op = buf;
+    ssize_t off;
+    int from, i, k;
+
+
+    off = blob_header(bp, bs);
+    if (off < 0 || to < 1 || to > 5)
+	return -1;
+    from = bp[off] | (bp[off+1] << 8);
+    if (from < 1 || from > 5)
+	return -1;
+    bp += off+2;
+    bs -= off+2;
+
+    sm = &field_maps[from];
+    tm = &field_maps[to];
+
+    memset(v, 0, sizeof(v));
+    if (from == 1)
+	v[TF_VALID] = DOSATTRIB_VALID_ATTRIB;
+    for (i = 0; i < sm->nfields; i++) {
+	if (bs < sm->f[i].size)
+	    return -1;
+	for (k = sm->f[i].size-1; k >= 0; k--)
+	    v[sm->f[i].field] = (v[sm->f[i].field] << 8) | bp[k];
+	if (from == 1 && v[sm->f[i].field] != 0)
+	    v[TF_VALID] |= field_valid[sm->f[i].field];
+	bp += sm->f[i].size;
+	bs -= sm->f[i].size;
+    }
+    v[TF_VERSION] = to;
+    v[TF_VALID] &= tm->valid;
+
+    if (tm->hex && put_hex(&op, &size, v[TF_ATTRIB], sizeof(uint32_t)) < 0)
+	return -1;
+    if (size < 4)
+	return -1;
+    *op++ = '\0';
+    *op++ = '\0';
+    size -= 2;
+    put_uint16(to, &op, &size);
+
+    for (i = 0; i < tm->nfields; i++) {
+	if (size < tm->f[i].size)
+	    return -1;
+	for (k = 0; k < tm->f[i].size; k++)
+	    op[k] = v[tm->f[i].field] >> (8*k);
+	op += tm->f[i].size;
+	size -= tm->f[i].size;
+    }
+
+    while ((op-buf) & 3) {
+	if (size < 1)
+	    return -1;
+	*op++ = '\0';
+	size--;
+    }
+    return op-buf;
+}
+
+
 time_t
 nttime2time(uint64_t nt) {
     time_t bt;
@@ -672,10 +1004,11 @@ timespec2nttime(const struct timespec *ts) {
 
 
 char *
-nttime2str(uint64_t nt) {
+nttime2str(uint64_t nt,
+	   char *buf,
+	   size_t bufsize) {
     time_t bt;
-    struct tm *tp;
-    static char buf[256];
+    struct tm tm;
 
     if (nt == 0x7fffffffffffffff) {
 	strcpy(buf, "+∞");
@@ -687,155 +1020,570 @@ nttime2str(uint64_t nt) {
     }
 
     bt = nttime2time(nt);
-    tp = localtime(&bt);
+    localtime_r(&bt, &tm);
 
-    strftime(buf, sizeof(buf), "%Y-%m-%d %T %z", tp);
+    strftime(buf, bufsize, "%Y-%m-%d %T %z", &tm);
     return buf;
 }
 
 
 void
-print_dosattrib(DOSATTRIB *da) {
-    printf("%s", attrib2str(da->attribs));
+print_dosattrib(OBUF *bp,
+		DOSATTRIB *da) {
+    char buf[256];
+
+    obuf_puts(bp, attrib2str(da->attribs, buf));
     if (f_verbose > 0)
-	printf(" (0x%02x)", da->attribs);
+	obuf_printf(bp, " (0x%02x)", da->attribs);
     if (f_verbose > 1) {
-	printf(", version=%u", da->version);
+	obuf_printf(bp, ", version=%u", da->version);
 	if (da->version > 1)
-	    printf(", valid_flags=0x%02x", da->valid_flags);
+	    obuf_printf(bp, ", valid_flags=0x%02x", da->valid_flags);
 	if (da->valid_flags & DOSATTRIB_VALID_EA_SIZE)
-	    printf(", ea_size=%u", da->ea_size);
+	    obuf_printf(bp, ", ea_size=%u", da->ea_size);
 	if (da->valid_flags & DOSATTRIB_VALID_SIZE)
-	    printf(", size=%llu", (long long unsigned int) da->size);
+	    obuf_printf(bp, ", size=%llu", (long long unsigned int) da->size);
 	if (da->valid_flags & DOSATTRIB_VALID_ALLOC_SIZE)
-	    printf(", alloc_size=%llu", (long long unsigned int) da->alloc_size);
+	    obuf_printf(bp, ", alloc_size=%llu", (long long unsigned int) da->alloc_size);
 	if (da->valid_flags & DOSATTRIB_VALID_CREATE_TIME)
-	    printf(", create_time=%s", nttime2str(da->create_time));
+	    obuf_printf(bp, ", create_time=%s", nttime2str(da->create_time, buf, sizeof(buf)));
 	if (da->valid_flags & DOSATTRIB_VALID_CHANGE_TIME)
-	    printf(", change_time=%s", nttime2str(da->change_time));
+	    obuf_printf(bp, ", change_time=%s", nttime2str(da->change_time, buf, sizeof(buf)));
 	if (da->valid_flags & DOSATTRIB_VALID_ITIME)
-	    printf(", itime=%s", nttime2str(da->itime));
+	    obuf_printf(bp, ", itime=%s", nttime2str(da->itime, buf, sizeof(buf)));
     }
 }
 
+/*
+ * The outcome of processing one entry, as passed to the formatters
+ */
+#define RESULT_UNCHANGED	0
+#define RESULT_UPDATED		1
+#define RESULT_FAILED		2
+#define RESULT_DRYRUN		3
+#define RESULT_CONFLICT		4	/* Changed by someone else (--optimistic) */
+
+char *result_names[] = {
+    "unchanged",
+    "updated",
+    "failed",
+    "dryrun",
+    "conflict",
+};
 
-int
-walker(const char *path,
-       const struct stat *sp,
-       int type,
-       struct FTW *fp) {
-    ssize_t len, nlen = 0;
-    size_t rlen;
-    DOSATTRIB od, nd;
-    unsigned char oblob[64], nblob[64];
-    int d;
-#if defined(HAVE_ATTROPEN)
-    int fd;
-#endif
-
+typedef struct {
+    const char *path;
+    int type;
+    int version;		/* 0 = missing, -1 = invalid */
+    int changed;
+    int status;
+    int error;
+    DOSATTRIB *od;
+    DOSATTRIB *nd;
+    unsigned char *oblob;
+    ssize_t olen;
+    unsigned char *nblob;
+    ssize_t nlen;
+    XSCAN *xs;			/* NULL unless --all-xattrs */
+} RESULT;
+
+
+static int
+type2char(int type) {
     switch (type) {
+    case FTW_D:
+    case FTW_DP:
     case FTW_DNR:
-    case FTW_NS:
-        if (f_ignore) {
-            if (f_verbose)
-                fprintf(stderr, "%s: Notice: %s: Unable to access [ignored]\n",
-                        argv0, path);
-            return 0;
-        }
-	fprintf(stderr, "%s: Error: %s: Unable to access\n",
-		argv0, path);
-	return -1;
+	return 'd';
+    case FTW_SL:
+    case FTW_SLN:
+	return 'l';
+    case FTW_F:
+	return 'f';
     }
+    return '?';
+}
 
-    if (f_files || f_dirs) {
-        if (type == FTW_F && !f_files)
-            return 0;
-        if ((type == FTW_D || type == FTW_DP) && !f_dirs)
-            return 0;
+void
+format_text(OBUF *bp,
+	    RESULT *rp) {
+    ssize_t i;
+
+    obuf_printf(bp, "%s: ", rp->path);
+    print_dosattrib(bp, rp->od);
+
+    if (f_force || rp->changed) {
+	obuf_puts(bp, " -> ");
+	print_dosattrib(bp, rp->nd);
+
+	switch (rp->status) {
+	case RESULT_UPDATED:
+	    obuf_puts(bp, ": Updated");
+	    break;
+	case RESULT_FAILED:
+	    obuf_printf(bp, ": Update Failed: %s", strerror(rp->error));
+	    break;
+	case RESULT_DRYRUN:
+	    obuf_puts(bp, ": (NOT) Updated");
+	    break;
+	case RESULT_CONFLICT:
+	    obuf_puts(bp, ": (NOT) Updated: Changed by someone else");
+	    break;
+	}
     }
 
-    spin();
+    if (rp->xs) {
+	obuf_printf(bp, " [%u xattrs", rp->xs->nattrs);
+	if (rp->xs->ntacl_len >= 0)
+	    obuf_printf(bp, ", NTACL v%d %zd bytes", rp->xs->ntacl_version, rp->xs->ntacl_len);
+	if (rp->xs->pai_len >= 0)
+	    obuf_printf(bp, ", SAMBA_PAI %zd bytes", rp->xs->pai_len);
+	if (rp->xs->streams > 0)
+	    obuf_printf(bp, ", %u streams %llu bytes", rp->xs->streams,
+			(long long unsigned int) rp->xs->stream_bytes);
+	if (rp->xs->errors > 0)
+	    obuf_printf(bp, ", %u unreadable", rp->xs->errors);
+	obuf_putc(bp, ']');
+    }
 
-    memset(oblob, 0, sizeof(oblob));
+    obuf_putc(bp, '\n');
+    if (f_print) {
+	obuf_puts(bp, "  Old:\t");
+	for (i = 0; i < rp->olen; i++) {
+	    if (i > 0)
+		obuf_putc(bp, ' ');
+	    obuf_puthex(bp, rp->oblob[i], 2);
+	}
+	obuf_putc(bp, '\n');
+	if (rp->nlen > 0) {
+	    obuf_puts(bp, "  New:\t");
+	    for (i = 0; i < rp->nlen; i++) {
+		if (i > 0)
+		    obuf_putc(bp, ' ');
+		obuf_puthex(bp, rp->nblob[i], 2);
+	    }
+	    obuf_putc(bp, '\n');
+	}
+    }
+}
 
-    memset(&od, 0, sizeof(od));
-#if defined(HAVE_EXTATTR_GET_LINK)
-    /* FreeBSD */
-    len = extattr_get_link(path, EXTATTR_NAMESPACE_USER, DOSATTRIBNAME,
-			   oblob, sizeof(oblob));
-#elif defined(HAVE_LGETXATTR)
-    /* Linux */
-    len = lgetxattr(path, DOSATTRIBNAME, oblob, sizeof(oblob));
-#elif defined(HAVE_GETXATTR)
-    /* MacOS */
-    len = getxattr(path, DOSATTRIBNAME, oblob, sizeof(oblob), 0, XATTR_NOFOLLOW);
-#elif defined(HAVE_ATTROPEN)
-    /* Solaris */
-    fd = attropen(path, DOSATTRIBNAME, O_RDONLY);
-    if (fd >= 0) {
-        len = read(fd, oblob, sizeof(oblob));
-        close(fd);
-    } else
-        len = -1;
-#else
-    /* No way to read xattrs/extended attributes */
-    errno = ENOSYS;
-    len = -1;
-#endif
 
-    if (len >= 0) {
-	rlen = 0;
-        if (parse_dosattrib(&od, oblob, len, &rlen) <= 0) {
-            fprintf(stderr, "%s: Error: %s: Invalid DOSATTRIB\n",
-                    argv0, path);
+static void
+json_dosattrib(OBUF *bp,
+	       DOSATTRIB *da) {
+    char buf[64];
+
+    obuf_puts(bp, "{\"version\":");
+    obuf_putu64(bp, da->version);
+    obuf_puts(bp, ",\"valid_flags\":");
+    obuf_putu64(bp, da->valid_flags);
+    obuf_puts(bp, ",\"attribs\":");
+    obuf_putu64(bp, da->attribs);
+    obuf_puts(bp, ",\"attrib_str\":\"");
+    obuf_puts(bp, attrib2str(da->attribs, buf));
+    obuf_puts(bp, "\",\"ea_size\":");
+    obuf_putu64(bp, da->ea_size);
+    obuf_puts(bp, ",\"size\":");
+    obuf_putu64(bp, da->size);
+    obuf_puts(bp, ",\"alloc_size\":");
+    obuf_putu64(bp, da->alloc_size);
+    obuf_puts(bp, ",\"create_time\":");
+    obuf_putu64(bp, da->create_time);
+    obuf_puts(bp, ",\"change_time\":");
+    obuf_putu64(bp, da->change_time);
+    obuf_puts(bp, ",\"write_time\":");
+    obuf_putu64(bp, da->write_time);
+    obuf_puts(bp, ",\"itime\":");
+    obuf_putu64(bp, da->itime);
+    obuf_putc(bp, '}');
+}
+
+/* One JSON object per line (NDJSON), times are raw NT time */
+void
+format_json(OBUF *bp,
+	    RESULT *rp) {
+    obuf_puts(bp, "{\"path\":");
+    obuf_putjson(bp, rp->path);
+    obuf_puts(bp, ",\"type\":\"");
+    obuf_putc(bp, type2char(rp->type));
+    obuf_puts(bp, "\",\"status\":\"");
+    obuf_puts(bp, result_names[rp->status]);
+    obuf_putc(bp, '"');
+    if (rp->status == RESULT_FAILED) {
+	obuf_puts(bp, ",\"error\":");
+	obuf_putjson(bp, strerror(rp->error));
+    }
+    obuf_puts(bp, ",\"old\":");
+    if (rp->version > 0)
+	json_dosattrib(bp, rp->od);
+    else
+	obuf_puts(bp, rp->version < 0 ? "\"invalid\"" : "null");
+    if (rp->status != RESULT_UNCHANGED) {
+	obuf_puts(bp, ",\"new\":");
+	json_dosattrib(bp, rp->nd);
+    }
+    if (rp->xs) {
+	obuf_puts(bp, ",\"xattrs\":{\"count\":");
+	obuf_putu64(bp, rp->xs->nattrs);
+	obuf_puts(bp, ",\"ntacl\":");
+	if (rp->xs->ntacl_len >= 0) {
+	    obuf_putu64(bp, rp->xs->ntacl_len);
+	    obuf_puts(bp, ",\"ntacl_version\":");
+	    obuf_putu64(bp, rp->xs->ntacl_version);
+	} else
+	    obuf_puts(bp, "null");
+	obuf_puts(bp, ",\"samba_pai\":");
+	if (rp->xs->pai_len >= 0)
+	    obuf_putu64(bp, rp->xs->pai_len);
+	else
+	    obuf_puts(bp, "null");
+	obuf_puts(bp, ",\"streams\":");
+	obuf_putu64(bp, rp->xs->streams);
+	obuf_puts(bp, ",\"stream_bytes\":");
+	obuf_putu64(bp, rp->xs->stream_bytes);
+	obuf_puts(bp, ",\"errors\":");
+	obuf_putu64(bp, rp->xs->errors);
+	obuf_putc(bp, '}');
+    }
+    if (rp->olen > 0) {
+	obuf_puts(bp, ",\"old_blob\":\"");
+	obuf_puthexbytes(bp, rp->oblob, rp->olen);
+	obuf_putc(bp, '"');
+    }
+    if (rp->nlen > 0) {
+	obuf_puts(bp, ",\"new_blob\":\"");
+	obuf_puthexbytes(bp, rp->nblob, rp->nlen);
+	obuf_putc(bp, '"');
+    }
+    obuf_puts(bp, "}\n");
+}
 
-            if (!f_ignore)
-                exit(1);
 
-            len = -1;
-        }
+static void
+csv_dosattrib(OBUF *bp,
+	      DOSATTRIB *da,
+	      int present) {
+    if (!present) {
+	obuf_puts(bp, ",,,,,");
+	return;
     }
 
-    if (len < 0) {
-        /* No such attribute */
+    obuf_putc(bp, ',');
+    obuf_putu64(bp, da->version);
+    obuf_puts(bp, ",0x");
+    obuf_puthex(bp, da->valid_flags, 2);
+    obuf_puts(bp, ",0x");
+    obuf_puthex(bp, da->attribs, 4);
+    obuf_putc(bp, ',');
+    obuf_putu64(bp, da->create_time);
+    obuf_putc(bp, ',');
+    obuf_putu64(bp, da->itime);
+}
 
-        /* Generate a synthetic attribute */
-        memset(&od, 0, sizeof(od));
+void
+format_csv_header(OBUF *bp) {
+    obuf_puts(bp, "path,type,status,error,"
+	      "old_version,old_valid_flags,old_attribs,old_create_time,old_itime,"
+	      "new_version,new_valid_flags,new_attribs,new_create_time,new_itime,"
+	      "old_blob,new_blob");
+    if (f_xattrs)
+	obuf_puts(bp, ",xattrs,ntacl,ntacl_version,samba_pai,streams,stream_bytes");
+    obuf_putc(bp, '\n');
+}
+
+void
+format_csv(OBUF *bp,
+	   RESULT *rp) {
+    obuf_putcsv(bp, rp->path);
+    obuf_putc(bp, ',');
+    obuf_putc(bp, type2char(rp->type));
+    obuf_putc(bp, ',');
+    obuf_puts(bp, rp->version < 0 ? "invalid" : result_names[rp->status]);
+    obuf_putc(bp, ',');
+    if (rp->status == RESULT_FAILED)
+	obuf_putcsv(bp, strerror(rp->error));
+    csv_dosattrib(bp, rp->od, rp->version > 0);
+    csv_dosattrib(bp, rp->nd, rp->status != RESULT_UNCHANGED);
+    obuf_putc(bp, ',');
+    if (rp->olen > 0)
+	obuf_puthexbytes(bp, rp->oblob, rp->olen);
+    obuf_putc(bp, ',');
+    if (rp->nlen > 0)
+	obuf_puthexbytes(bp, rp->nblob, rp->nlen);
+    if (rp->xs) {
+	obuf_putc(bp, ',');
+	obuf_putu64(bp, rp->xs->nattrs);
+	obuf_putc(bp, ',');
+	if (rp->xs->ntacl_len >= 0) {
+	    obuf_putu64(bp, rp->xs->ntacl_len);
+	    obuf_putc(bp, ',');
+	    obuf_putu64(bp, rp->xs->ntacl_version);
+	} else
+	    obuf_putc(bp, ',');
+	obuf_putc(bp, ',');
+	if (rp->xs->pai_len >= 0)
+	    obuf_putu64(bp, rp->xs->pai_len);
+	obuf_putc(bp, ',');
+	obuf_putu64(bp, rp->xs->streams);
+	obuf_putc(bp, ',');
+	obuf_putu64(bp, rp->xs->stream_bytes);
     }
+    obuf_putc(bp, '\n');
+}
 
-    if ((f_match_set && (f_match_set & od.attribs) == 0) ||
-        (f_match_clr && (f_match_clr & od.attribs) != 0)) {
-        if (f_debug)
-            fprintf(stderr, "%s: No match\n", path);
-        return 0;
+
+/*
+ * Binary records, all integers little endian:
+ *
+ *   u32 record length (including this field)
+ *   u8  type ('f', 'd', 'l' or '?')
+ *   u8  status (RESULT_*)
+ *   u8  flags (1 = old present, 2 = old invalid, 4 = changed)
+ *   u8  reserved
+ *   u32 errno
+ *   old DOSATTRIB (64 bytes, see bin_dosattrib())
+ *   new DOSATTRIB (64 bytes)
+ *   u16 path length, u16 old blob length, u16 new blob length, u16 reserved
+ *   path, old blob, new blob
+ */
+#define BIN_DOSATTRIB_SIZE	64
+#define BIN_HEADER_SIZE		(12+2*BIN_DOSATTRIB_SIZE+8)
+
+static void
+bin_dosattrib(unsigned char **bpp,
+	      size_t *bsp,
+	      DOSATTRIB *da) {
+    put_uint32(da->version, bpp, bsp);
+    put_uint32(da->valid_flags, bpp, bsp);
+    put_uint32(da->attribs, bpp, bsp);
+    put_uint32(da->ea_size, bpp, bsp);
+    put_uint64(da->size, bpp, bsp);
+    put_uint64(da->alloc_size, bpp, bsp);
+    put_uint64(da->create_time, bpp, bsp);
+    put_uint64(da->change_time, bpp, bsp);
+    put_uint64(da->write_time, bpp, bsp);
+    put_uint64(da->itime, bpp, bsp);
+}
+
+void
+format_bin_header(OBUF *bp) {
+    /* Magic and format version */
+    obuf_write(bp, "DOSATTRB\1\0\0\0", 12);
+}
+
+void
+format_bin(OBUF *bp,
+	   RESULT *rp) {
+    DOSATTRIB zd;
+    size_t plen = strlen(rp->path);
+    size_t olen = rp->olen > 0 ? rp->olen : 0;
+    size_t nlen = rp->nlen > 0 ? rp->nlen : 0;
+    size_t rlen = BIN_HEADER_SIZE+plen+olen+nlen;
+    size_t bs = rlen;
+    unsigned char *p;
+
+    if (plen > 0xFFFF || obuf_grow(bp, rlen) < 0)
+	return;
+
+    memset(&zd, 0, sizeof(zd));
+    p = (unsigned char *) bp->buf+bp->len;
+    put_uint32(rlen, &p, &bs);
+    *p++ = type2char(rp->type);
+    *p++ = rp->status;
+    *p++ = (rp->version > 0 ? 1 : 0) | (rp->version < 0 ? 2 : 0) | (rp->changed ? 4 : 0);
+    *p++ = 0;
+    bs -= 4;
+    put_uint32(rp->error, &p, &bs);
+    bin_dosattrib(&p, &bs, rp->version > 0 ? rp->od : &zd);
+    bin_dosattrib(&p, &bs, rp->status != RESULT_UNCHANGED ? rp->nd : &zd);
+    put_uint16(plen, &p, &bs);
+    put_uint16(olen, &p, &bs);
+    put_uint16(nlen, &p, &bs);
+    put_uint16(0, &p, &bs);
+    memcpy(p, rp->path, plen);
+    p += plen;
+    if (olen)
+	memcpy(p, rp->oblob, olen);
+    p += olen;
+    if (nlen)
+	memcpy(p, rp->nblob, nlen);
+
+    bp->len += rlen;
+}
+
+void
+format_result(OBUF *bp,
+	      RESULT *rp) {
+    switch (f_format) {
+    case FORMAT_JSON:
+	format_json(bp, rp);
+	break;
+    case FORMAT_CSV:
+	format_csv(bp, rp);
+	break;
+    case FORMAT_BIN:
+	format_bin(bp, rp);
+	break;
+    default:
+	if (f_verbose || f_force || rp->changed)
+	    format_text(bp, rp);
     }
+}
 
-    nd = od;
-    if (f_version)
-	nd.version = f_version;
 
-    if (f_orattribs != 0) {
-	nd.attribs |= f_orattribs;
-	nd.valid_flags |= DOSATTRIB_VALID_ATTRIB;
+/*
+ * What --sort-by keeps of a result until it is formatted after the
+ * traversal, followed by the old and the new blob
+ */
+typedef struct {
+    int32_t type;
+    int32_t version;
+    int32_t changed;
+    int32_t status;
+    int32_t error;
+    int16_t olen;
+    int16_t nlen;
+    DOSATTRIB od;
+    DOSATTRIB nd;
+} SORTED;
+
+static int
+sort_result(RESULT *rp) {
+    unsigned char buf[sizeof(SORTED)+2*DOSATTRIB_MAXSIZE];
+    size_t olen = rp->olen > 0 ? rp->olen : 0;
+    size_t nlen = rp->nlen > 0 ? rp->nlen : 0;
+    uint64_t key = 0;
+    SORTED s;
+
+    if (f_format == FORMAT_TEXT && !f_verbose && !f_force && !rp->changed)
+	return 0;
+
+    /* Zeroed padding and unset fields compress well when spilled */
+    memset(&s, 0, sizeof(s));
+    s.type = rp->type;
+    s.version = rp->version;
+    s.changed = rp->changed;
+    s.status = rp->status;
+    s.error = rp->error;
+    s.olen = rp->olen;
+    s.nlen = rp->nlen;
+    s.od = *rp->od;
+    s.nd = *rp->nd;
+    memcpy(buf, &s, sizeof(s));
+    memcpy(buf+sizeof(s), rp->oblob, olen);
+    memcpy(buf+sizeof(s)+olen, rp->nblob, nlen);
+
+    /* Keyed on the attribute as found, missing ones first */
+    switch (f_sort_by) {
+    case SORTBY_CTIME:
+	if (rp->version > 0 && (rp->od->valid_flags & DOSATTRIB_VALID_CREATE_TIME))
+	    key = rp->od->create_time;
+	break;
+    case SORTBY_ATTRIBS:
+	if (rp->version > 0)
+	    key = rp->od->attribs;
+	break;
     }
-    
-    if (f_andattribs != 0xFFFF) {
-	nd.attribs &= f_andattribs;
-	nd.valid_flags |= DOSATTRIB_VALID_ATTRIB;
+
+    if (sort_add(f_sorter, key, rp->path, buf, sizeof(s)+olen+nlen) < 0) {
+	fprintf(stderr, "%s: Error: %s: Unable to sort: %s\n",
+		argv0, rp->path, strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Read the DOSATTRIB of the entry in the --copy-from tree at the same
+ * relative path as path. Returns the version (the raw blob is in buf
+ * and its length in *lenp), 0 if the entry or attribute is missing
+ * there or -1 on errors.
+ */
+static int
+copy_source(const char *path,
+	    DOSATTRIB *da,
+	    unsigned char *buf,
+	    size_t size,
+	    ssize_t *lenp) {
+    const char *rel = path+strlen(f_top);
+    size_t slen = strlen(f_copy_from), rlen;
+    char *spath;
+    ssize_t len;
+    int version;
+
+    while (slen > 1 && f_copy_from[slen-1] == '/')
+	--slen;
+    spath = malloc(slen+strlen(rel)+2);
+    if (!spath) {
+	fprintf(stderr, "%s: Error: %s: Unable to copy DOSATTRIB: %s\n",
+		argv0, path, strerror(errno));
+	return -1;
     }
+    memcpy(spath, f_copy_from, slen);
+    spath[slen] = '\0';
+    if (*rel && *rel != '/' && spath[slen-1] != '/')
+	strcat(spath, "/");
+    strcat(spath, rel);
 
-    if (f_repair) {
+    len = backend_get(spath, DOSATTRIBNAME, buf, size);
+    if (len < 0) {
+	if (errno == ENOENT) {
+	    if (f_verbose)
+		fprintf(stderr, "%s: Notice: %s: Missing in source [ignored]\n",
+			argv0, spath);
+	    version = 0;
+	} else if (errno == ENOATTR || errno == ENOTSUP)
+	    version = 0;
+	else {
+	    fprintf(stderr, "%s: Error: %s: Unable to read DOSATTRIB: %s\n",
+		    argv0, spath, strerror(errno));
+	    version = -1;
+	}
+    } else {
+	version = parse_dosattrib(da, buf, len, &rlen);
+	if (version <= 0) {
+	    fprintf(stderr, "%s: Error: %s: Invalid DOSATTRIB\n",
+		    argv0, spath);
+	    version = -1;
+	}
+    }
+
+    free(spath);
+    *lenp = len;
+    return version;
+}
+
+
+/*
+ * Apply the attribute operations (and repairs) to an attribute
+ */
+static void
+apply_ops(DOSATTRIB *dp,
+	  const ATTROPS *ops,
+	  const char *path,
+	  const struct stat *sp,
+	  int type) {
+    if (ops->version)
+	dp->version = ops->version;
+
+    if (ops->orattribs != 0 || ops->andattribs != 0xFFFF) {
+	dp->attribs = (dp->attribs & ops->andattribs) | ops->orattribs;
+	dp->valid_flags |= DOSATTRIB_VALID_ATTRIB;
+    }
+
+    if (ops->repair) {
 #if defined(st_birthtime)
 	uint64_t nct = timespec2nttime(&sp->st_birthtimespec);
 
-	if ((nd.valid_flags & DOSATTRIB_VALID_CREATE_TIME) == 0) {
-	    nd.create_time = nct;
-	    nd.valid_flags |= DOSATTRIB_VALID_CREATE_TIME;
+	if ((dp->valid_flags & DOSATTRIB_VALID_CREATE_TIME) == 0) {
+	    dp->create_time = nct;
+	    dp->valid_flags |= DOSATTRIB_VALID_CREATE_TIME;
 	    fprintf(stderr, "%s: Info: %s: Adding CreateTime\n",
 		    argv0, path);
 	} else {
-	    if (nct < nd.create_time) {
-		nd.create_time = nct;
+	    if (nct < dp->create_time) {
+		dp->create_time = nct;
 		fprintf(stderr, "%s: Info: %s: Updating CreateTime\n",
 			argv0, path);
 	    }
@@ -844,107 +1592,1388 @@ walker(const char *path,
 
         /* Sanity check real type vs attribute type */
         if ((type == FTW_D || type == FTW_DP) &&
-            (nd.attribs & FILE_ATTRIBUTE_DIRECTORY) == 0) {
-            nd.attribs |= FILE_ATTRIBUTE_DIRECTORY;
+            (dp->attribs & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+            dp->attribs |= FILE_ATTRIBUTE_DIRECTORY;
         } else if (type == FTW_F &&
-                   (nd.attribs & FILE_ATTRIBUTE_DIRECTORY) != 0) {
-            nd.attribs &= ~FILE_ATTRIBUTE_DIRECTORY;
+                   (dp->attribs & FILE_ATTRIBUTE_DIRECTORY) != 0) {
+            dp->attribs &= ~FILE_ATTRIBUTE_DIRECTORY;
         }
     }
+}
 
-    d = !equal_dosattrib(&od, &nd);
-    
-    if (f_verbose || f_force || d) {
-	printf("%s: ", path);
-	print_dosattrib(&od);
-
-	if (f_force || d) {
-	    printf(" -> ");
-	    print_dosattrib(&nd);
-
-	    nlen = create_dosattrib(&nd, nblob, sizeof(nblob));
 
-	    if (f_update) {
-#if defined(HAVE_EXTATTR_SET_LINK) /* FreeBSD */
-		len = extattr_set_link(path, EXTATTR_NAMESPACE_USER, DOSATTRIBNAME, nblob, nlen);
-#elif defined(HAVE_LGETXATTR) /* Linux */
-		len = lsetxattr(path, DOSATTRIBNAME, nblob, nlen, 0) < 0 ? -1 : nlen;
-#elif defined(HAVE_GETXATTR) /* MacOS */
-		len = setxattr(path, DOSATTRIBNAME, nblob, nlen, 0, XATTR_NOFOLLOW) < 0 ? -1 : nlen;
-#elif defined(HAVE_ATTROPEN) /* Solaris */
-		fd = attropen(path, DOSATTRIBNAME, O_WRONLY);
-		if (fd >= 0) {
-		    len = write(fd, nblob, nlen);
-		    close(fd);
-		} else
-		    len = -1;
+#if defined(__APPLE__)
+#define ST_CTIME_NSEC(sp) ((sp)->st_ctimespec.tv_nsec)
 #else
-		/* No way to write attribute */
-		errno = ENOSYS;
-		len = -1;
+#define ST_CTIME_NSEC(sp) ((sp)->st_ctim.tv_nsec)
 #endif
-		if (len == nlen)
-		    printf(": Updated");
-		else
-		    printf(": Update Failed: %s", strerror(errno));
-	    } else {
-		printf(": (NOT) Updated");
-	    }
-	}
 
-	putchar('\n');
-	if (f_print) {
-	    int i;
-
-	    printf("  Old:\t");
-	    for (i = 0; i < len; i++)
-		printf("%s%02x", (i > 0 ? " " : ""), oblob[i]);
-	    putchar('\n');
-	    if (nlen > 0) {
-		printf("  New:\t");
-		for (i = 0; i < nlen; i++)
-		    printf("%s%02x", (i > 0 ? " " : ""), nblob[i]);
-		putchar('\n');
-	    }
-	}
+/*
+ * --optimistic: check if the DOSATTRIB has changed since it was read
+ * (as olen, -1 if missing and -2 if too large). If the backend moves
+ * the ctime and it has not moved since *sp nothing can have, else the attribute is read again
+ * and compared. *sp is updated for the next attempt.
+ */
+static int
+guard_changed(const char *path,
+	      struct stat *sp,
+	      const unsigned char *obp,
+	      ssize_t olen) {
+    unsigned char buf[DOSATTRIB_MAXSIZE];
+    struct stat sb;
+    ssize_t len;
+
+
+    if (sp && backend->ctime_changes && lstat(path, &sb) == 0) {
+	if (sb.st_ctime == sp->st_ctime && ST_CTIME_NSEC(&sb) == ST_CTIME_NSEC(sp))
+	    return 0;
+	*sp = sb;
     }
-    return 0;
-}
 
-void
-usage(void) {
-    int i;
+    len = backend_get(path, DOSATTRIBNAME, buf, sizeof(buf));
+    if (len < 0) {
+	if (errno == ERANGE)
+	    len = -2;
+	else if (errno != ENOATTR && errno != ENOTSUP)
+	    return 1;
+    }
+    return len != olen || (len > 0 && memcmp(buf, obp, len) != 0);
+}
 
-    printf("Usage:\n  %s [<options>] [+|-|=]<flags>]* <path-1> [.. <path-N>]\n",
-	   argv0);
-    printf("\nOptions:\n");
-    printf("  -h          Display this information\n");
-    printf("  -n          No update (dry-run)\n");
-    printf("  -v          Increase verbosity\n");
-    printf("  -f          Increase verbosity\n");
-    printf("  -d          Increase debug level\n");
-    printf("  -i          Ignore errors and continue\n");
-    printf("  -c          Correct errors (where possible)\n");
-    printf("  -r          Recurse and operate on directories\n");
-    printf("  -s          Recurse and operate on files\n");
-    printf("  -m <flags>  Match files/dirs with flags\n");
-    printf("  -<1-5>      Override DOSATTRIB version\n");
-    printf("  -           Stop parsing options/flags\n");
-    printf("\nFlags:\n");
-    for (i = 0; attribs[i].a; i++)
-	printf("  %c           %s\n", attribs[i].c, attribs[i].d);
+/*
+ * Write a new DOSATTRIB, with --optimistic only if there still is (or
+ * isn't) one as when we read it. Returns the RESULT_* status.
+ */
+static int
+update_entry(const char *path,
+	     const unsigned char *nbp,
+	     ssize_t nlen,
+	     int present,
+	     int *errp) {
+    int flags = 0;
+
+
+    if (!f_update)
+	return RESULT_DRYRUN;
+    if (nlen < 0) {
+	/* No blob, e.g. a missing attribute without a version given */
+	*errp = EINVAL;
+	return RESULT_FAILED;
+    }
+    if (f_optimistic)
+	flags = present ? BACKEND_REPLACE : BACKEND_CREATE;
+    if (backend_set(path, DOSATTRIBNAME, nbp, nlen, flags) >= 0)
+	return RESULT_UPDATED;
+
+    *errp = errno;
+    if (f_optimistic && (errno == EEXIST || errno == ENOATTR)) {
+	__atomic_fetch_add(&oc_conflicts, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&oc_skipped, 1, __ATOMIC_RELAXED);
+	return RESULT_CONFLICT;
+    }
+    __atomic_fetch_add(&n_failed, 1, __ATOMIC_RELAXED);
+    return RESULT_FAILED;
 }
 
 
-int
-main(int argc,
-     char *argv[]) {
-    int i, j, rc = 0;
-    uint16_t a;
-    char *s;
+/* An error with the entry, only -1 without -i (--since needs to know) */
+static int
+ignore_error(void) {
+    if (!f_ignore)
+	return -1;
+    __atomic_fetch_add(&n_ignored, 1, __ATOMIC_RELAXED);
+    return 0;
+}
 
 
-    argv0 = argv[0];
+/*
+ * Process one entry, writing any output to bp. Called from the
+ * traversal thread, or from the worker threads when running in
+ * parallel. The attribute operations (arg) default to the ones from
+ * the command line.
+ */
+int
+process_entry(OBUF *bp,
+	      const char *path,
+	      const struct stat *sp,
+	      int type,
+	      struct FTW *fp,
+	      const void *arg) {
+    const ATTROPS *ops = arg ? arg : &f_ops;
+    ssize_t len, olen, nlen, slen;
+    size_t rlen;
+    DOSATTRIB od, nd, sd;
+    unsigned char oblob[DOSATTRIB_MAXSIZE], nblob[DOSATTRIB_MAXSIZE], sblob[DOSATTRIB_MAXSIZE], *obp;
+    int d, version, sversion, tries = 0, conflict = 0;
+    struct stat gs, *gsp = NULL;
+    RESULT r;
+    XSCAN xs;
+
+    switch (type) {
+    case FTW_DNR:
+    case FTW_NS:
+        if (f_ignore) {
+            if (f_verbose)
+                fprintf(stderr, "%s: Notice: %s: Unable to access [ignored]\n",
+                        argv0, path);
+            return ignore_error();
+        }
+	fprintf(stderr, "%s: Error: %s: Unable to access\n",
+		argv0, path);
+	return -1;
+    }
+
+    if (f_files || f_dirs) {
+        if (type == FTW_F && !f_files)
+            return 0;
+        if ((type == FTW_D || type == FTW_DP) && !f_dirs)
+            return 0;
+    }
+
+    if (f_optimistic && sp) {
+	gs = *sp;
+	gsp = &gs;
+    }
+
+ Retry:
+    obp = oblob;
+    nlen = 0;
+    slen = -1;
+    version = 0;
+    sversion = 0;
+    memset(oblob, 0, sizeof(oblob));
+
+    memset(&od, 0, sizeof(od));
+
+    if (f_xattrs) {
+	/* One list call and all the Samba attributes, DOSATTRIB included */
+	if (xscan_entry(path, &xs) < 0)
+	    len = -1;
+	else if ((len = xs.dosattrib_len) >= 0)
+	    obp = xs.dosattrib;
+	else
+	    errno = xs.dosattrib_error ? xs.dosattrib_error : ENOATTR;
+    } else
+	len = backend_get(path, DOSATTRIBNAME, oblob, sizeof(oblob));
+    olen = len >= 0 ? len : errno == ERANGE ? -2 : -1;
+
+    /* Just add the raw DOSATTRIB (-1 if missing, -2 if too large) to the digest */
+    if (f_digest && (len >= 0 || errno == ENOATTR || errno == ENOTSUP || errno == ERANGE)) {
+	const char *rel = path+strlen(f_top);
+
+	while (*rel == '/')
+	    ++rel;
+	if (digest_add(f_digest, rel, fp->level > 0 ? path+fp->base : "",
+		       type == FTW_D || type == FTW_DP, obp,
+		       len >= 0 ? len : errno == ERANGE ? -2 : -1) < 0) {
+	    fprintf(stderr, "%s: Error: %s: Unable to add to digest: %s\n",
+		    argv0, path, strerror(errno));
+	    return -1;
+	}
+	STAT_INC(CAT_ENTRIES);
+	return 0;
+    }
+
+    /* Transcoding only needs the version in the header to skip a blob */
+    if (f_transcode_to && (len >= 0 || errno == ENOATTR || errno == ENOTSUP)) {
+	if (len < 0) {
+	    /* No attributes, so no match for -m +ATTRS */
+	    if (f_match_set)
+		return 0;
+	    STAT_INC(CAT_ENTRIES);
+	    STAT_INC(CAT_MISSING);
+	    return 0;
+	}
+
+	d = 0;
+	version = blob_version(obp, len);
+	if (version >= 1 && version <= 5 && version != f_transcode_to &&
+	    (f_transcode_from & (1 << version)) != 0) {
+	    nlen = transcode_dosattrib(obp, len, f_transcode_to, nblob, sizeof(nblob));
+	    d = 1;
+	}
+
+	/* But -m needs the attributes */
+	rlen = 0;
+	if ((f_match_set || f_match_clr) && parse_dosattrib(&od, obp, len, &rlen) <= 0)
+	    version = -1;
+
+	if (version < 1 || version > 5 || nlen < 0) {
+	    STAT_INC(CAT_ENTRIES);
+	    STAT_INC(CAT_INVALID);
+	    fprintf(stderr, "%s: Error: %s: Invalid DOSATTRIB\n",
+		    argv0, path);
+	    return ignore_error();
+	}
+
+	if ((f_match_set && (f_match_set & od.attribs) == 0) ||
+	    (f_match_clr && (f_match_clr & od.attribs) != 0)) {
+	    if (f_debug)
+		fprintf(stderr, "%s: No match\n", path);
+	    return 0;
+	}
+
+	if (d && f_optimistic && f_update && guard_changed(path, gsp, obp, olen)) {
+	    __atomic_fetch_add(&oc_conflicts, 1, __ATOMIC_RELAXED);
+	    if (tries++ < f_optimistic_retries) {
+		__atomic_fetch_add(&oc_retries, 1, __ATOMIC_RELAXED);
+		goto Retry;
+	    }
+	    __atomic_fetch_add(&oc_skipped, 1, __ATOMIC_RELAXED);
+	    conflict = 1;
+	}
+
+	STAT_INC(CAT_ENTRIES);
+	STAT_INC(CAT_PRESENT);
+	STAT_INC(CAT_V1+version-1);
+	if (!d)
+	    __atomic_fetch_add(version == f_transcode_to ? &tc_current : &tc_other, 1,
+			       __ATOMIC_RELAXED);
+	else {
+	    STAT_INC(CAT_CHANGED);
+	    __atomic_fetch_add(&tc_blobs, 1, __ATOMIC_RELAXED);
+	    __atomic_fetch_add(&tc_old_bytes, len, __ATOMIC_RELAXED);
+	    __atomic_fetch_add(&tc_new_bytes, nlen, __ATOMIC_RELAXED);
+	}
+
+	r.status = RESULT_UNCHANGED;
+	r.error = 0;
+	if (d)
+	    r.status = conflict ? RESULT_CONFLICT : update_entry(path, nblob, nlen, 1, &r.error);
+
+	/* Only decode the blobs if they are to be printed */
+	if (f_format == FORMAT_TEXT && !f_verbose && !f_force && !d)
+	    return 0;
+	rlen = 0;
+	if (parse_dosattrib(&od, obp, len, &rlen) <= 0)
+	    memset(&od, 0, sizeof(od));
+	nd = od;
+	rlen = 0;
+	if (d && parse_dosattrib(&nd, nblob, nlen, &rlen) <= 0)
+	    memset(&nd, 0, sizeof(nd));
+
+	r.path = path;
+	r.type = type;
+	r.version = version;
+	r.changed = d;
+	r.od = &od;
+	r.nd = &nd;
+	r.oblob = obp;
+	r.olen = len;
+	r.nblob = nblob;
+	r.nlen = d ? nlen : 0;
+	r.xs = f_xattrs ? &xs : NULL;
+	goto Format;
+    }
+
+    if (len < 0) {
+	if (errno == ERANGE) {
+	    /* Larger than any DOSATTRIB version */
+	    version = -1;
+	} else if (errno != ENOATTR && errno != ENOTSUP) {
+	    /* Don't mistake a failed read for a missing attribute and overwrite it */
+	    if (!f_sample)
+		fprintf(stderr, "%s: Error: %s: Unable to read DOSATTRIB: %s\n",
+			argv0, path, strerror(errno));
+	    return ignore_error();
+	}
+    } else {
+	rlen = 0;
+	version = parse_dosattrib(&od, obp, len, &rlen);
+	if (version <= 0)
+	    version = -1;
+    }
+
+    /* Just add the decoded attribute (invalid ones too) to the index */
+    if (f_index) {
+	const char *rel = path+strlen(f_top);
+	IXROW ir;
+
+	while (*rel == '/')
+	    ++rel;
+	ir.type = (type == FTW_D || type == FTW_DP) ? INDEX_DIR :
+	    type == FTW_SL ? INDEX_LINK : INDEX_FILE;
+	ir.version = version < 0 ? INDEX_INVALID : version;
+	ir.attribs = version > 0 ? od.attribs : 0;
+	ir.valid_flags = version > 0 ? od.valid_flags : 0;
+	ir.create_time = version > 0 && (od.valid_flags & DOSATTRIB_VALID_CREATE_TIME) ?
+	    od.create_time : 0;
+	if (index_add(f_index, rel, &ir) < 0) {
+	    fprintf(stderr, "%s: Error: %s: Unable to add to index: %s\n",
+		    argv0, path, strerror(errno));
+	    return -1;
+	}
+	STAT_INC(CAT_ENTRIES);
+	return 0;
+    }
+
+    if (version < 0) {
+	if (!f_sample) {
+	    fprintf(stderr, "%s: Error: %s: Invalid DOSATTRIB\n",
+		    argv0, path);
+
+	    if (ignore_error() < 0)
+		return -1;
+	}
+	len = -1;
+    }
+
+    if (len < 0) {
+        /* No such attribute */
+
+        /* Generate a synthetic attribute */
+        memset(&od, 0, sizeof(od));
+    }
+
+    if ((f_match_set && (f_match_set & od.attribs) == 0) ||
+        (f_match_clr && (f_match_clr & od.attribs) != 0)) {
+        if (f_debug)
+            fprintf(stderr, "%s: No match\n", path);
+        return 0;
+    }
+
+    nd = od;
+
+    /* Copying - start from the source attribute, if there is one */
+    if (f_copy_from) {
+	sversion = copy_source(path, &sd, sblob, sizeof(sblob), &slen);
+	if (sversion < 0)
+	    return ignore_error();
+	if (sversion > 0)
+	    nd = sd;
+    }
+
+    apply_ops(&nd, ops, path, sp, type);
+
+    /* Converting a present attribute to another version is a change too */
+    d = !equal_dosattrib(&od, &nd) || (version > 0 && nd.version != od.version);
+
+    if (sversion > 0) {
+	if (nd.version == sd.version && equal_dosattrib(&sd, &nd) &&
+	    nd.write_time == sd.write_time) {
+	    /* Nothing else changed it, so copy the source blob as is (if different) */
+	    d = (len != slen || memcmp(obp, sblob, slen) != 0);
+	    nlen = slen;
+	} else if (nd.version != od.version)
+	    d = 1;
+    }
+
+    /* Make sure it's still what we read, else start over with the new one */
+    if (f_optimistic && f_update && !f_sample && (f_force || d) &&
+	guard_changed(path, gsp, obp, olen)) {
+	__atomic_fetch_add(&oc_conflicts, 1, __ATOMIC_RELAXED);
+	if (tries++ < f_optimistic_retries) {
+	    __atomic_fetch_add(&oc_retries, 1, __ATOMIC_RELAXED);
+	    goto Retry;
+	}
+	__atomic_fetch_add(&oc_skipped, 1, __ATOMIC_RELAXED);
+	conflict = 1;
+    }
+
+    STAT_INC(CAT_ENTRIES);
+    if (version > 0) {
+	STAT_INC(CAT_PRESENT);
+	if (version <= 5)
+	    STAT_INC(CAT_V1+version-1);
+	if (((type == FTW_D || type == FTW_DP) &&
+	     (od.attribs & FILE_ATTRIBUTE_DIRECTORY) == 0) ||
+	    (type == FTW_F && (od.attribs & FILE_ATTRIBUTE_DIRECTORY) != 0))
+	    STAT_INC(CAT_BADDIR);
+    } else
+	STAT_INC(version < 0 ? CAT_INVALID : CAT_MISSING);
+    if (d)
+	STAT_INC(CAT_CHANGED);
+    if (f_xattrs) {
+	if (xs.ntacl_len >= 0)
+	    STAT_ADD(CAT_NTACL, xs.ntacl_len);
+	if (xs.pai_len >= 0)
+	    STAT_ADD(CAT_PAI, xs.pai_len);
+	if (xs.streams > 0)
+	    STAT_ADD(CAT_STREAMS, xs.stream_bytes);
+    }
+
+    /* Sampling is read-only, we just want the categories */
+    if (f_sample)
+	return 0;
+
+    r.path = path;
+    r.type = type;
+    r.version = version;
+    r.changed = d;
+    r.status = RESULT_UNCHANGED;
+    r.error = 0;
+    r.od = &od;
+    r.nd = &nd;
+    r.oblob = obp;
+    r.olen = len;
+    r.nblob = nblob;
+    r.nlen = 0;
+    r.xs = f_xattrs ? &xs : NULL;
+
+    if (f_force || d) {
+	if (nlen > 0)
+	    memcpy(nblob, sblob, nlen);
+	else
+	    nlen = create_dosattrib(&nd, nblob, sizeof(nblob));
+	r.nlen = nlen;
+	r.status = conflict ? RESULT_CONFLICT : update_entry(path, nblob, nlen, olen != -1, &r.error);
+    }
+
+ Format:
+    if (f_sorter)
+	return sort_result(&r);
+    format_result(bp, &r);
+    return 0;
+}
+
+
+/*
+ * Handle a --server request, with the same logic as process_entry()
+ */
+static void
+serve_request(const SREQUEST *rq,
+	      SREPLY *rp) {
+    struct stat sb;
+    DOSATTRIB od, nd;
+    unsigned char oblob[DOSATTRIB_MAXSIZE], nblob[DOSATTRIB_MAXSIZE];
+    ssize_t len, nlen;
+    size_t rlen;
+    int type, version, tries = 0;
+
+
+    if (lstat(rq->path, &sb) < 0) {
+	rp->error = errno;
+	return;
+    }
+    type = S_ISDIR(sb.st_mode) ? FTW_D : S_ISLNK(sb.st_mode) ? FTW_SL : FTW_F;
+
+ Retry:
+    memset(&od, 0, sizeof(od));
+    version = 0;
+    rlen = 0;
+    len = backend_get(rq->path, DOSATTRIBNAME, oblob, sizeof(oblob));
+    if (len < 0) {
+	if (errno != ENOATTR && errno != ENOTSUP) {
+	    rp->error = errno == ERANGE ? EINVAL : errno;
+	    return;
+	}
+    } else {
+	version = parse_dosattrib(&od, oblob, len, &rlen);
+	if (version <= 0) {
+	    rp->error = EINVAL;
+	    return;
+	}
+    }
+
+    rp->oattribs = od.attribs;
+    rp->oversion = version;
+
+    nd = od;
+    if (rq->op != SERVER_GET)
+	apply_ops(&nd, &rq->ops, rq->path, &sb, type);
+
+    rp->nattribs = nd.attribs;
+    rp->nversion = nd.version;
+    rp->status = SERVER_UNCHANGED;
+
+    /* A version conversion is a change too */
+    if (equal_dosattrib(&od, &nd) && nd.version == od.version)
+	return;
+
+    if (!f_update || (rq->flags & SERVER_NOUPDATE)) {
+	rp->status = SERVER_DRYRUN;
+	return;
+    }
+
+    if (f_optimistic && guard_changed(rq->path, &sb, oblob, len >= 0 ? len : -1)) {
+	__atomic_fetch_add(&oc_conflicts, 1, __ATOMIC_RELAXED);
+	if (tries++ < f_optimistic_retries) {
+	    __atomic_fetch_add(&oc_retries, 1, __ATOMIC_RELAXED);
+	    goto Retry;
+	}
+	__atomic_fetch_add(&oc_skipped, 1, __ATOMIC_RELAXED);
+	rp->status = SERVER_CONFLICT;
+	return;
+    }
+
+    nlen = create_dosattrib(&nd, nblob, sizeof(nblob));
+    rp->status = update_entry(rq->path, nblob, nlen, len >= 0, &rp->error);
+    if (rp->status == SERVER_CONFLICT)
+	rp->error = 0;
+}
+
+
+static OBUF w_buf;
+
+/*
+ * Output one --sort-by result, in order after the traversal
+ */
+static int
+sorted_entry(const char *path,
+	     const void *data,
+	     size_t len,
+	     void *arg) {
+    const unsigned char *p = data;
+    SORTED s;
+    RESULT r;
+
+    memcpy(&s, p, sizeof(s));
+    r.path = path;
+    r.type = s.type;
+    r.version = s.version;
+    r.changed = s.changed;
+    r.status = s.status;
+    r.error = s.error;
+    r.od = &s.od;
+    r.nd = &s.nd;
+    r.oblob = (unsigned char *) p+sizeof(s);
+    r.olen = s.olen;
+    r.nblob = r.oblob+(s.olen > 0 ? s.olen : 0);
+    r.nlen = s.nlen;
+    r.xs = NULL;
+
+    format_result(&w_buf, &r);
+    return output_submit(output_seq(), &w_buf);
+}
+
+/*
+ * The operations of the matching rules for the entry the traversal is
+ * at (its state is in f_walk), NULL to use the command line ones
+ */
+static int
+entry_ops(const char *path,
+	  int type,
+	  const ATTROPS **opp) {
+    *opp = NULL;
+    if (!f_rules)
+	return 0;
+
+    *opp = rules_ops(f_walk.state, type);
+    if (!*opp) {
+	fprintf(stderr, "%s: Error: %s: Unable to match rules: %s\n",
+		argv0, path, strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Traversal callback - process the entry directly
+ */
+int
+walker(const char *path,
+       const struct stat *sp,
+       int type,
+       struct FTW *fp) {
+    uint64_t seq = output_seq();
+    const ATTROPS *ops;
+    int rc;
+
+    spin();
+    rc = entry_ops(path, type, &ops);
+    if (rc == 0)
+	rc = process_entry(&w_buf, path, sp, type, fp, ops);
+    output_submit(seq, &w_buf);
+    return rc;
+}
+
+/*
+ * Traversal callback - queue the entry for the worker threads
+ */
+int
+dispatcher(const char *path,
+	   const struct stat *sp,
+	   int type,
+	   struct FTW *fp) {
+    uint64_t seq = output_seq();
+    const ATTROPS *ops;
+    int rc;
+
+    spin();
+
+    /* Errors may stop the traversal so handle them right here */
+    rc = entry_ops(path, type, &ops);
+    if (rc < 0 || type == FTW_DNR || type == FTW_NS) {
+	if (rc == 0)
+	    rc = process_entry(&w_buf, path, sp, type, fp, ops);
+	output_submit(seq, &w_buf);
+	return rc;
+    }
+
+    return pool_submit(seq, path, sp, type, fp, ops);
+}
+
+
+static void
+metrics_done(void) {
+    if (metrics_write() < 0)
+	fprintf(stderr, "%s: Error: %s: Unable to write metrics: %s\n",
+		argv0, f_metrics, strerror(errno));
+}
+
+
+static const char *sample_root = "";
+
+/*
+ * Examine a sampled entry with the normal walker() logic and return
+ * the categories it was counted in
+ */
+int
+sample_walker(const char *path,
+	      const struct stat *sp,
+	      int type,
+	      uint64_t *yv) {
+    uint64_t before[CAT_MAX];
+    struct FTW ftw;
+    const ATTROPS *ops = NULL;
+    int c, rc;
+
+    memcpy(before, stats, sizeof(before));
+
+    /* Sampled entries are not visited in order, so match the whole path */
+    if (f_rules) {
+	ops = rules_ops(rules_match(f_rules, path+strlen(sample_root)), type);
+	if (!ops) {
+	    fprintf(stderr, "%s: Error: %s: Unable to match rules: %s\n",
+		    argv0, path, strerror(errno));
+	    return -1;
+	}
+    }
+
+    ftw.base = 0;
+    ftw.level = 0;
+    rc = process_entry(&w_buf, path, sp, type, &ftw, ops);
+    w_buf.len = 0;
+
+    for (c = 0; c < NCATS; c++)
+	yv[c] = stats[c]-before[c];
+    return rc;
+}
+
+void
+print_summary(void) {
+    int c;
+
+    printf("Summary:\n");
+    for (c = 0; c < NCATS; c++) {
+	printf("  %-20s %12llu", cat_names[c], (long long unsigned int) stats[c]);
+	if (c > 0 && stats[CAT_ENTRIES] > 0)
+	    printf("  %6.2f%%", 100.0*stats[c]/stats[CAT_ENTRIES]);
+	if (c >= CAT_NTACL)
+	    printf("  %llu bytes", (long long unsigned int) stat_bytes[c]);
+	putchar('\n');
+    }
+}
+
+int
+print_sample(const char *path) {
+    SAMPLE sa;
+    double est[CAT_MAX], est_ci[CAT_MAX], frac[CAT_MAX], frac_ci[CAT_MAX];
+    int c;
+
+
+    sample_root = path;
+    memset(&sa, 0, sizeof(sa));
+    sa.rate = f_sample_rate;
+    sa.budget = f_sample_budget;
+    sa.seed = f_sample_seed;
+
+    if (sample_tree(path, &sa, NCATS, sample_walker, est, est_ci, frac, frac_ci) < 0)
+	return -1;
+
+    printf("%s: Estimated from %llu entries in %llu directories (%llu probes):\n",
+	   path,
+	   (long long unsigned int) sa.examined,
+	   (long long unsigned int) sa.dirs,
+	   (long long unsigned int) sa.probes);
+    for (c = 0; c < NCATS; c++) {
+	printf("  %-20s %14.0f ± ", cat_names[c], est[c]);
+	if (c > 0)
+	    printf("%-12.0f  %6.2f%% ± %.2f%%", est_ci[c], 100*frac[c], 100*frac_ci[c]);
+	else
+	    printf("%.0f", est_ci[c]);
+	putchar('\n');
+    }
+    return 0;
+}
+
+
+static const char *cmp_a;
+static const char *cmp_b;
+
+static void
+print_difference(const char *relpath,
+		 int what) {
+    printf("%s: %s%s\n", *relpath ? relpath : ".",
+	   what == DIGEST_DIFFERS ? "DOSATTRIBs differ" : "Only in ",
+	   what == DIGEST_ONLY_A ? cmp_a : what == DIGEST_ONLY_B ? cmp_b : "");
+}
+
+/*
+ * Compare the digest in a file with another (from a file or a tree)
+ * and print the directories that differ. Returns 1 if there are
+ * differences, -1 on errors.
+ */
+static int
+compare_digest(const char *file,
+	       const char *name,
+	       DIGEST *dp) {
+    DIGEST *old;
+    uint64_t visited;
+    int n;
+
+    old = digest_load(file);
+    if (!old) {
+	fprintf(stderr, "%s: Error: %s: Unable to load digest: %s\n",
+		argv0, file, errno == EINVAL ? "Invalid digest file" : strerror(errno));
+	return -1;
+    }
+
+    cmp_a = file;
+    cmp_b = name;
+    n = digest_compare(old, dp, print_difference, &visited);
+    if (f_verbose)
+	fprintf(stderr, "%s: Info: %d differences (%llu of %llu directories compared)\n",
+		argv0, n, (long long unsigned int) visited,
+		(long long unsigned int) digest_dirs(old));
+    digest_free(old);
+    return n > 0 ? 1 : 0;
+}
+
+
+/*
+ * Parse an operation from a rule file, with the same syntax as on the
+ * command line: +ATTRS, -ATTRS, -1..-5 (version) and -c (repair), except
+ * that =ATTRS sets exactly those attributes.
+ */
+static int
+rule_op(ATTROPS *op,
+	char *s) {
+    uint16_t a = 0;
+
+    switch (*s) {
+    case '+':
+	if (str2attrib(&a, s+1) < 1)
+	    return -1;
+	op->orattribs |= a;
+	return 0;
+
+    case '=':
+	if (str2attrib(&a, s+1) < 1)
+	    return -1;
+	op->andattribs = 0;
+	op->orattribs = a;
+	return 0;
+
+    case '-':
+	if (!s[1])
+	    return -1;
+	if (str2attrib(&a, s+1) > 0) {
+	    op->andattribs &= ~a;
+	    op->orattribs &= ~a;
+	    return 0;
+	}
+	for (++s; *s; s++)
+	    if (*s >= '1' && *s <= '5')
+		op->version = *s-'0';
+	    else if (*s == 'c')
+		op->repair = 1;
+	    else
+		return -1;
+	return 0;
+    }
+
+    return -1;
+}
+
+
+/* The tree the --index was made of */
+static const char *query_root;
+
+static int
+print_match(const char *relpath,
+	    const IXROW *rp) {
+    static OBUF ob;
+    DOSATTRIB da;
+    size_t len = strlen(query_root);
+
+    ob.len = 0;
+    obuf_puts(&ob, query_root);
+    if (*relpath) {
+	if (len == 0 || query_root[len-1] != '/')
+	    obuf_putc(&ob, '/');
+	obuf_puts(&ob, relpath);
+    }
+    if (f_verbose) {
+	memset(&da, 0, sizeof(da));
+	da.version = rp->version;
+	da.attribs = rp->attribs;
+	da.valid_flags = rp->valid_flags;
+	da.create_time = rp->create_time;
+	obuf_puts(&ob, ": ");
+	print_dosattrib(&ob, &da);
+    }
+    obuf_putc(&ob, '\n');
+    return fwrite(ob.buf, 1, ob.len, stdout) == ob.len ? 0 : -1;
+}
+
+/*
+ * Print the entries in the index file matching the query
+ */
+static int
+query_index(const char *file,
+	    char *query) {
+    INDEX *ip;
+    IXQUERY q;
+    IXSTATS st;
+    uint64_t t0 = metrics_now();
+    int rc;
+
+    if (index_parse_query(&q, query, rule_op) < 0) {
+	fprintf(stderr, "%s: Error: %s: Invalid query\n", argv0, query);
+	return -1;
+    }
+
+    ip = index_load(file);
+    if (!ip) {
+	fprintf(stderr, "%s: Error: %s: Unable to load index: %s\n",
+		argv0, file, errno == EINVAL ? "Invalid index file" : strerror(errno));
+	return -1;
+    }
+
+    query_root = index_root(ip);
+    rc = index_query(ip, &q, print_match, &st);
+    if (rc < 0)
+	fprintf(stderr, "%s: Error: %s: Query failed: %s\n",
+		argv0, file, errno == EINVAL ? "Invalid index file" : strerror(errno));
+    else if (f_verbose)
+	fprintf(stderr, "%s: Info: %s: %llu matches, %llu of %llu blocks skipped, %llu rows scanned in %.3f s\n",
+		argv0, file,
+		(long long unsigned int) st.matches,
+		(long long unsigned int) st.skipped,
+		(long long unsigned int) st.blocks,
+		(long long unsigned int) st.rows,
+		(metrics_now()-t0)/1e9);
+    index_free(ip);
+    return rc;
+}
+
+/* Walk state function - the rule state of an entry */
+static const void *
+rules_enter(const void *parent,
+	    const char *name) {
+    return rules_step(parent, name);
+}
+
+
+/* What a shard process reports back */
+typedef struct {
+    uint64_t stats[CAT_MAX];
+    uint64_t stat_bytes[CAT_MAX];
+    uint64_t conflicts, retries, skipped;
+    WALK walk;
+} SHARD_RESULT;
+
+/*
+ * Runs in a shard process - walk the top level entries assigned to it
+ * with the usual threads, and report the statistics back
+ */
+static int
+shard_main(SHARD *sp,
+	   const char *root) {
+    SHARD_RESULT *res = sp->data;
+    const void *top = f_rules ? rules_start(f_rules) : NULL;
+    size_t i, len = strlen(root);
+    char *path;
+    int rc = 0;
+
+
+    f_shard = sp;
+    memset(stats, 0, sizeof(stats));
+    memset(stat_bytes, 0, sizeof(stat_bytes));
+    oc_conflicts = oc_retries = oc_skipped = 0;
+
+    if (output_start(f_threads > 1, f_ordered, 0) < 0 ||
+	(f_threads > 1 && pool_start(f_threads, process_entry) < 0) ||
+	(f_prefetch && prefetch_start(f_prefetch_threads, f_prefetch, DOSATTRIBNAME) < 0) ||
+	(f_adaptive && pool_adapt(2, f_adapt_interval, NULL) < 0)) {
+	fprintf(stderr, "%s: Error: Shard %d: Unable to start threads: %s\n",
+		argv0, sp->id, strerror(errno));
+	return -1;
+    }
+
+    for (i = 0; i < sp->nnames && rc == 0; i++) {
+	path = malloc(len+strlen(sp->names[i])+2);
+	if (!path) {
+	    rc = -1;
+	    break;
+	}
+	sprintf(path, "%s%s%s", root, len > 0 && root[len-1] == '/' ? "" : "/", sp->names[i]);
+
+	f_walk.state = top ? rules_enter(top, sp->names[i]) : NULL;
+	rc = walk_tree(path, &f_walk, f_threads > 1 ? dispatcher : walker);
+	free(path);
+
+	res->walk.dirs += f_walk.dirs;
+	res->walk.entries += f_walk.entries;
+	res->walk.deferred += f_walk.deferred;
+	res->walk.spilled += f_walk.spilled;
+	if (f_walk.fds_peak > res->walk.fds_peak)
+	    res->walk.fds_peak = f_walk.fds_peak;
+	if (f_walk.mem_peak > res->walk.mem_peak)
+	    res->walk.mem_peak = f_walk.mem_peak;
+    }
+
+    if (pool_stop() < 0)
+	rc = -1;
+    if (f_prefetch)
+	prefetch_stop(NULL, NULL);
+    if (output_stop() < 0) {
+	fprintf(stderr, "%s: Error: Shard %d: Writing output: %s\n",
+		argv0, sp->id, strerror(errno));
+	rc = -1;
+    }
+
+    memcpy(res->stats, stats, sizeof(stats));
+    memcpy(res->stat_bytes, stat_bytes, sizeof(stat_bytes));
+    res->conflicts = oc_conflicts;
+    res->retries = oc_retries;
+    res->skipped = oc_skipped;
+    return rc;
+}
+
+/*
+ * Process the top of the tree here and everything below it in
+ * f_shards processes, then merge their statistics into ours
+ */
+static int
+shards_walk(const char *path) {
+    SHARDS *shp;
+    SHARD_RESULT *res;
+    struct stat sb;
+    struct FTW ftw;
+    int i, c, rc;
+
+
+    if (lstat(path, &sb) < 0 || !S_ISDIR(sb.st_mode))
+	return walk_tree(path, &f_walk, walker);
+
+    shp = shards_split(path, f_shards, sizeof(SHARD_RESULT));
+    if (!shp) {
+	fprintf(stderr, "%s: Error: %s: Unable to split in shards: %s\n",
+		argv0, path, strerror(errno));
+	return -1;
+    }
+
+    ftw.base = 0;
+    ftw.level = 0;
+    f_walk.state = f_rules ? rules_start(f_rules) : NULL;
+    rc = walker(path, &sb, FTW_D, &ftw);
+    if (rc == 0 && output_flush() < 0) {
+	fprintf(stderr, "%s: Error: Writing output: %s\n",
+		argv0, strerror(errno));
+	rc = -1;
+    }
+    if (rc == 0)
+	rc = shards_run(shp, path, shard_main, SHARD_RETRIES, argv0, f_verbose);
+
+    f_walk.fds_peak = 0;
+    f_walk.mem_peak = 0;
+    f_walk.dirs = f_walk.entries = 1;
+    f_walk.deferred = f_walk.spilled = 0;
+    for (i = 0; i < shp->n; i++) {
+	res = shp->v[i].data;
+	for (c = 0; c < CAT_MAX; c++) {
+	    stats[c] += res->stats[c];
+	    stat_bytes[c] += res->stat_bytes[c];
+	}
+	oc_conflicts += res->conflicts;
+	oc_retries += res->retries;
+	oc_skipped += res->skipped;
+	f_walk.dirs += res->walk.dirs;
+	f_walk.entries += res->walk.entries;
+	f_walk.deferred += res->walk.deferred;
+	f_walk.spilled += res->walk.spilled;
+	if (res->walk.fds_peak > f_walk.fds_peak)
+	    f_walk.fds_peak = res->walk.fds_peak;
+	if (res->walk.mem_peak > f_walk.mem_peak)
+	    f_walk.mem_peak = res->walk.mem_peak;
+    }
+
+    shards_free(shp);
+    return rc;
+}
+
+
+/* Walk pruning for --since */
+static int
+since_skip_fn(const char *path,
+	      const struct stat *sp) {
+    return since_skip(f_since, path, sp);
+}
+
+static const char *
+since_subdirs_fn(const char *path,
+		 const struct stat *sp) {
+    return since_subdirs(f_since, path, sp);
+}
+
+
+void
+usage(void) {
+    int i;
+
+    printf("Usage:\n  %s [<options>] [+|-|=]<flags>]* <path-1> [.. <path-N>]\n",
+	   argv0);
+    printf("\nOptions:\n");
+    printf("  -h          Display this information\n");
+    printf("  -n          No update (dry-run)\n");
+    printf("  -v          Increase verbosity\n");
+    printf("  -f          Increase verbosity\n");
+    printf("  -d          Increase debug level\n");
+    printf("  -i          Ignore errors and continue\n");
+    printf("  -c          Correct errors (where possible)\n");
+    printf("  -r          Recurse and operate on directories\n");
+    printf("  -s          Recurse and operate on files\n");
+    printf("  -m <flags>  Match files/dirs with flags\n");
+    printf("  -<1-5>      Override DOSATTRIB version\n");
+    printf("  -           Stop parsing options/flags\n");
+    printf("\nLong options:\n");
+    printf("  --metrics=<file>            Write latency metrics to file\n");
+    printf("  --metrics-format=prom|json  Metrics file format [prom]\n");
+    printf("  --metrics-interval=<secs>   Also rewrite metrics periodically\n");
+    printf("  --metrics-top=<n>           Number of slowest directories to report [10]\n");
+    printf("  --fd-budget=<n>             Max number of directories open at once\n");
+    printf("  --mem-limit=<size>          Max memory for directory traversal [64M]\n");
+    printf("  --sort-by=<key>             Sort the output by path, create_time or attribs\n");
+    printf("  --sort-mem=<size>           Max memory for sorting, spill to $TMPDIR [256M]\n");
+    printf("  --dirbuf=<size>             Directory read buffer size [32K]\n");
+    printf("  --format=text|json|csv|bin  Output format [text]\n");
+    printf("  --backend=<name>[:<arg>]    Attribute storage: native, memory[:file] or sidecar:file [native]\n");
+    printf("  --rules=<file>              Attribute operations by path pattern\n");
+    printf("  --copy-from=<src>           Copy DOSATTRIBs from src to the (one) path given\n");
+    printf("  --digest=<file>             Save a digest of the DOSATTRIBs in the (one) path given\n");
+    printf("  --digest-compare=<file>     Compare a digest with the path given (a tree or digest)\n");
+    printf("  --index=<file>              Save a columnar index of the (one) path given\n");
+    printf("  --query=<expr>              Print the entries in an index matching expr\n");
+    printf("  --transcode=<from>:<to>     Convert DOSATTRIBs of versions from (e.g. 13 or *) to version to\n");
+    printf("  --since=<file>|<time>       Skip what is unchanged since the last run (or time)\n");
+    printf("  --optimistic                Only update DOSATTRIBs not changed since read, for live shares\n");
+    printf("  --optimistic-retries=<n>    Number of retries after a conflict [3]\n");
+    printf("  --all-xattrs                Also scan NTACL, SAMBA_PAI and DosStreams\n");
+#if defined(ENABLE_FAULT_INJECTION)
+    printf("  --faults=<spec>             Inject latency and errors (see the man page)\n");
+#endif
+    printf("  --threads=<n>               Process entries with n worker threads [1]\n");
+    printf("  --threads=auto[:<max>]      Adjust the number of working threads as we go [64]\n");
+    printf("  --adapt-interval=<ms>       How often to adjust the number of threads [500]\n");
+    printf("  --prefetch=<n>[:<threads>]  Warm the metadata of the next n entries with threads [4]\n");
+    printf("  --unordered                 Output in completion order when using threads\n");
+    printf("  --shards=<n>                Split the top level between n processes\n");
+    printf("  --server=<socket>           Serve get/set/repair requests on a UNIX socket\n");
+    printf("  --server-mode=<mode>        Mode of the server socket [0600]\n");
+    printf("  --client=<socket>           Send the flags for the paths to a server\n");
+    printf("  --summary                   Print category counts at the end\n");
+    printf("  --sample=<rate>             Estimate categories by sampling a fraction of each directory\n");
+    printf("  --sample-budget=<n>         Max number of entries to sample [10000]\n");
+    printf("  --sample-seed=<n>           Random seed for sampling\n");
+    printf("\nFlags:\n");
+    for (i = 0; attribs[i].a; i++)
+	printf("  %c           %s\n", attribs[i].c, attribs[i].d);
+}
+
+
+/*
+ * Sizes may have a K, M or G suffix
+ */
+static int
+str2size(const char *s,
+	 size_t *vp) {
+    unsigned long long v;
+    char c = '\0';
+
+    switch (sscanf(s, "%llu%c", &v, &c)) {
+    case 1:
+	break;
+    case 2:
+	switch (toupper(c)) {
+	case 'K':
+	    v *= 1024;
+	    break;
+	case 'M':
+	    v *= 1024*1024;
+	    break;
+	case 'G':
+	    v *= 1024*1024*1024;
+	    break;
+	default:
+	    return -1;
+	}
+	break;
+    default:
+	return -1;
+    }
+
+    *vp = v;
+    return 0;
+}
+
+/*
+ * Long options may be given as --name=value or --name value
+ */
+static int
+longopt_is(const char *opt,
+	   const char *name) {
+    size_t len = strlen(name);
+
+    return strncmp(opt, name, len) == 0 && (opt[len] == '\0' || opt[len] == '=');
+}
+
+static char *
+longopt_arg(const char *opt,
+	    int argc,
+	    char *argv[],
+	    int *ip) {
+    char *v = strchr(opt, '=');
+
+    if (v)
+	return v+1;
+    if (*ip+1 < argc)
+	return argv[++*ip];
+    return NULL;
+}
+
+int
+longopt(int argc,
+	char *argv[],
+	int *ip) {
+    char *opt = argv[*ip]+2;
+    char *v = NULL;
+
+
+    if (longopt_is(opt, "metrics")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_metrics = v;
+    } else if (longopt_is(opt, "metrics-format")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (strcmp(v, "prom") == 0)
+	    f_metrics_format = METRICS_FORMAT_PROM;
+	else if (strcmp(v, "json") == 0)
+	    f_metrics_format = METRICS_FORMAT_JSON;
+	else
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "metrics-interval")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%d", &f_metrics_interval) != 1 || f_metrics_interval < 0)
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "metrics-top")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%d", &f_metrics_top) != 1 || f_metrics_top < 0)
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "fd-budget")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%d", &f_walk.fd_budget) != 1 || f_walk.fd_budget < 1)
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "mem-limit")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (str2size(v, &f_walk.mem_limit) < 0)
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "sort-by")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (strcmp(v, "path") == 0)
+	    f_sort_by = SORTBY_PATH;
+	else if (strcmp(v, "create_time") == 0)
+	    f_sort_by = SORTBY_CTIME;
+	else if (strcmp(v, "attribs") == 0)
+	    f_sort_by = SORTBY_ATTRIBS;
+	else
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "sort-mem")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (str2size(v, &f_sort_mem) < 0 || f_sort_mem < 64*1024)
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "dirbuf")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (str2size(v, &f_walk.bufsize) < 0 || f_walk.bufsize < 1024)
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "format")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (strcmp(v, "text") == 0)
+	    f_format = FORMAT_TEXT;
+	else if (strcmp(v, "json") == 0)
+	    f_format = FORMAT_JSON;
+	else if (strcmp(v, "csv") == 0)
+	    f_format = FORMAT_CSV;
+	else if (strcmp(v, "bin") == 0)
+	    f_format = FORMAT_BIN;
+	else
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "backend")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (backend_select(v) < 0) {
+	    fprintf(stderr, "%s: Error: %s: Unable to open backend: %s\n",
+		    argv0, v, strerror(errno));
+	    exit(1);
+	}
+    } else if (longopt_is(opt, "faults")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_faults = v;
+    } else if (longopt_is(opt, "rules")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_rules_file = v;
+    } else if (longopt_is(opt, "copy-from")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_copy_from = v;
+    } else if (longopt_is(opt, "digest")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_digest_file = v;
+    } else if (longopt_is(opt, "digest-compare")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_compare_file = v;
+    } else if (longopt_is(opt, "index")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_index_file = v;
+    } else if (longopt_is(opt, "query")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_query = v;
+    } else if (longopt_is(opt, "transcode")) {
+	/* FROM:TO, FROM a set of versions (1-5) or '*' */
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_transcode_from = 0;
+	if (*v == '*') {
+	    f_transcode_from = 0x3E;
+	    ++v;
+	} else
+	    for (; *v >= '1' && *v <= '5'; v++)
+		f_transcode_from |= 1 << (*v-'0');
+	if (!f_transcode_from || v[0] != ':' || v[1] < '1' || v[1] > '5' || v[2])
+	    goto InvalidArg;
+	f_transcode_to = v[1]-'0';
+    } else if (longopt_is(opt, "since")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_since_spec = v;
+    } else if (longopt_is(opt, "optimistic-retries")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%d", &f_optimistic_retries) != 1 || f_optimistic_retries < 0)
+	    goto InvalidArg;
+	f_optimistic = 1;
+    } else if (longopt_is(opt, "optimistic")) {
+	f_optimistic = 1;
+    } else if (longopt_is(opt, "all-xattrs")) {
+	f_xattrs = 1;
+    } else if (longopt_is(opt, "threads")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (strncmp(v, "auto", 4) == 0) {
+	    /* auto[:max] */
+	    f_adaptive = 1;
+	    f_threads = 64;
+	    if (v[4] == ':' ? sscanf(v+5, "%d", &f_threads) != 1 || f_threads < 2 : v[4] != '\0')
+		goto InvalidArg;
+	} else if (sscanf(v, "%d", &f_threads) != 1 || f_threads < 1)
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "prefetch")) {
+	/* depth[:threads] */
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%d", &f_prefetch) != 1 || f_prefetch < 1)
+	    goto InvalidArg;
+	if ((v = strchr(v, ':')) != NULL &&
+	    (sscanf(v+1, "%d", &f_prefetch_threads) != 1 || f_prefetch_threads < 1))
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "adapt-interval")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%d", &f_adapt_interval) != 1 || f_adapt_interval < 10)
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "unordered")) {
+	f_ordered = 0;
+    } else if (longopt_is(opt, "server-mode")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%o", &f_server_mode) != 1 || f_server_mode > 0777)
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "server")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_server = v;
+    } else if (longopt_is(opt, "client")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	f_client = v;
+    } else if (longopt_is(opt, "shards")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%d", &f_shards) != 1 || f_shards < 1)
+	    goto InvalidArg;
+    } else if (longopt_is(opt, "summary")) {
+	f_summary++;
+    } else if (longopt_is(opt, "sample")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%lf", &f_sample_rate) != 1 || f_sample_rate <= 0 || f_sample_rate > 1)
+	    goto InvalidArg;
+	f_sample++;
+    } else if (longopt_is(opt, "sample-budget")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%llu", (long long unsigned int *) &f_sample_budget) != 1 || f_sample_budget < 1)
+	    goto InvalidArg;
+	f_sample++;
+    } else if (longopt_is(opt, "sample-seed")) {
+	if ((v = longopt_arg(opt, argc, argv, ip)) == NULL)
+	    goto MissingArg;
+	if (sscanf(v, "%llu", (long long unsigned int *) &f_sample_seed) != 1)
+	    goto InvalidArg;
+    } else {
+	fprintf(stderr, "%s: Error: --%s: Invalid option\n", argv0, opt);
+	return -1;
+    }
+
+    return 0;
+
+ MissingArg:
+    fprintf(stderr, "%s: Error: Missing argument for '--%s'\n", argv0, opt);
+    return -1;
+
+ InvalidArg:
+    fprintf(stderr, "%s: Error: %s: Invalid argument for '--%s'\n", argv0, v, opt);
+    return -1;
+}
+
+
+int
+main(int argc,
+     char *argv[]) {
+    int i, j, rc = 0, line;
+    uint16_t a;
+    char *s;
+    uint64_t t_start;
+
+
+    argv0 = argv[0];
+    walk_init(&f_walk);
 
     for (i = 1; i < argc && (argv[i][0] == '-' || argv[i][0] == '+' || argv[i][0] == '='); i++) {
 	switch (argv[i][0]) {
@@ -969,6 +2998,12 @@ main(int argc,
 	    break;
 
 	case '-':
+	    if (argv[i][1] == '-' && argv[i][2]) {
+		if (longopt(argc, argv, &i) < 0)
+		    exit(1);
+		break;
+	    }
+
 	    a = 0;
 	    rc = str2attrib(&a, argv[i]+1);
 	    if (rc > 0) {
@@ -1100,26 +3135,428 @@ main(int argc,
     }
  EndArg:;
 
+    /* attribs = (attribs | or) & and, the way the flags are applied */
+    f_ops.andattribs = f_andattribs;
+    f_ops.orattribs = f_orattribs & f_andattribs;
+    f_ops.version = f_version;
+    f_ops.repair = f_repair;
+
+    if (f_server) {
+	if (server_run(f_server, f_server_mode, serve_request, rule_op, argv[0], f_verbose) < 0) {
+	    fprintf(stderr, "%s: Error: %s: Unable to listen: %s\n",
+		    argv[0], f_server, strerror(errno));
+	    exit(1);
+	}
+	exit(0);
+    }
+
+    if (f_client) {
+	SREQUEST rq;
+
+	rq.op = f_ops.repair ? SERVER_REPAIR :
+	    f_ops.version || f_ops.orattribs || f_ops.andattribs != 0xFFFF ? SERVER_SET : SERVER_GET;
+	rq.flags = f_update ? 0 : SERVER_NOUPDATE;
+	rq.ops = f_ops;
+	rq.path = NULL;
+	exit(client_run(f_client, &rq, argv+i, argc-i, argv[0]));
+    }
+
+    if (!f_recurse)
+	f_shards = 0;
+    if (f_query) {
+	if (!f_index_file || argc-i != 0) {
+	    fprintf(stderr, "%s: Error: --query needs --index and no paths\n",
+		    argv[0]);
+	    exit(1);
+	}
+	exit(query_index(f_index_file, f_query) == 0 ? 0 : 1);
+    }
+
+    if (f_index_file && (f_digest_file || f_compare_file)) {
+	fprintf(stderr, "%s: Error: --index can not be combined with --digest\n",
+		argv[0]);
+	exit(1);
+    }
+
+    if ((f_digest_file || f_compare_file) &&
+	(f_ops.version || f_ops.repair || f_ops.orattribs || f_ops.andattribs != 0xFFFF ||
+	 f_match_set || f_match_clr || f_rules_file || f_copy_from || f_sample)) {
+	fprintf(stderr, "%s: Error: --digest can not be combined with flags, -c, -m, --rules, --copy-from or --sample\n",
+		argv[0]);
+	exit(1);
+    }
+
+    if (f_index_file &&
+	(f_ops.version || f_ops.repair || f_ops.orattribs || f_ops.andattribs != 0xFFFF ||
+	 f_match_set || f_match_clr || f_rules_file || f_copy_from || f_sample)) {
+	fprintf(stderr, "%s: Error: --index can not be combined with flags, -c, -m, --rules, --copy-from or --sample\n",
+		argv[0]);
+	exit(1);
+    }
+
+    if (f_transcode_to &&
+	(f_ops.version || f_ops.repair || f_ops.orattribs || f_ops.andattribs != 0xFFFF ||
+	 f_rules_file || f_copy_from || f_sample ||
+	 f_digest_file || f_compare_file || f_index_file)) {
+	fprintf(stderr, "%s: Error: --transcode can not be combined with flags, --rules, --copy-from, --sample, --digest or --index\n",
+		argv[0]);
+	exit(1);
+    }
+
+    if (f_shards > 1 &&
+	(f_sample || f_digest_file || f_compare_file || f_index_file || f_transcode_to ||
+	 f_since_spec || f_metrics || strcmp(backend->name, "native") != 0)) {
+	fprintf(stderr, "%s: Error: --shards can not be used with --sample, --digest, --index, --transcode, --since, --metrics or other backends\n",
+		argv[0]);
+	exit(1);
+    }
+
+    if (f_since_spec &&
+	(!f_recurse || f_sample || f_copy_from || f_digest_file || f_compare_file || f_index_file)) {
+	fprintf(stderr, "%s: Error: --since needs -r or -s and can not be combined with --sample, --copy-from, --digest or --index\n",
+		argv[0]);
+	exit(1);
+    }
+
+    if (f_sort_by &&
+	(f_shards > 1 || f_xattrs || f_sample || f_digest_file || f_compare_file || f_index_file)) {
+	fprintf(stderr, "%s: Error: --sort-by can not be combined with --shards, --all-xattrs, --sample, --digest or --index\n",
+		argv[0]);
+	exit(1);
+    }
+
+    if (f_copy_from || f_digest_file || f_compare_file || f_index_file || f_since_spec) {
+	if (argc-i != 1) {
+	    fprintf(stderr, "%s: Error: --copy-from, --digest, --index and --since need exactly one path\n",
+		    argv[0]);
+	    exit(1);
+	}
+	f_top = argv[i];
+    }
+
+    if (f_copy_from) {
+	struct stat sb;
+
+	if (lstat(f_copy_from, &sb) < 0) {
+	    fprintf(stderr, "%s: Error: %s: Unable to access: %s\n",
+		    argv[0], f_copy_from, strerror(errno));
+	    exit(1);
+	}
+    }
+
+    if (f_digest_file || f_compare_file) {
+	struct stat sb;
+
+	/* Comparing two digest files, no need for a traversal */
+	if (f_compare_file && stat(f_top, &sb) == 0 && S_ISREG(sb.st_mode)) {
+	    f_digest = digest_load(f_top);
+	    if (!f_digest) {
+		fprintf(stderr, "%s: Error: %s: Unable to load digest: %s\n",
+			argv[0], f_top, errno == EINVAL ? "Invalid digest file" : strerror(errno));
+		exit(1);
+	    }
+	    rc = compare_digest(f_compare_file, f_top, f_digest);
+	    digest_free(f_digest);
+	    exit(rc == 0 ? 0 : 1);
+	}
+
+	f_digest = digest_new();
+	if (!f_digest) {
+	    fprintf(stderr, "%s: Error: Unable to create digest: %s\n",
+		    argv[0], strerror(errno));
+	    exit(1);
+	}
+	f_recurse = f_files = f_dirs = 1;
+    }
+
+    if (f_index_file) {
+	f_index = index_new(f_top);
+	if (!f_index) {
+	    fprintf(stderr, "%s: Error: Unable to create index: %s\n",
+		    argv[0], strerror(errno));
+	    exit(1);
+	}
+	f_recurse = f_files = f_dirs = 1;
+    }
+
+    if (f_sort_by) {
+	const char *tmpdir = getenv("TMPDIR");
+
+	f_sorter = sort_open(f_sort_mem, tmpdir && *tmpdir ? tmpdir : "/tmp");
+	if (!f_sorter) {
+	    fprintf(stderr, "%s: Error: Unable to setup sorting: %s\n",
+		    argv[0], strerror(errno));
+	    exit(1);
+	}
+    }
+
+    if (f_prefetch) {
+	if (!f_recurse || strcmp(backend->name, "native") != 0) {
+	    fprintf(stderr, "%s: Error: --prefetch needs -r or -s and the native backend\n",
+		    argv[0]);
+	    exit(1);
+	}
+	f_walk.ahead_fn = prefetch_add;
+    }
+
+    if (f_since_spec) {
+	f_since = since_open(f_since_spec, f_top);
+	if (!f_since) {
+	    fprintf(stderr, "%s: Error: %s: Unable to load: %s\n",
+		    argv[0], f_since_spec,
+		    errno == EINVAL ? "Not a --since file for this path" : strerror(errno));
+	    exit(1);
+	}
+	f_walk.skip_fn = since_skip_fn;
+	f_walk.subdirs_fn = since_subdirs_fn;
+    }
+
+    if (f_rules_file) {
+	f_rules = rules_load(f_rules_file, &f_ops, rule_op, &line);
+	if (!f_rules) {
+	    if (line > 0)
+		fprintf(stderr, "%s: Error: %s: Invalid rule at line %d\n",
+			argv[0], f_rules_file, line);
+	    else
+		fprintf(stderr, "%s: Error: %s: Unable to load rules: %s\n",
+			argv[0], f_rules_file, strerror(errno));
+	    exit(1);
+	}
+	f_walk.state_fn = rules_enter;
+    }
+
+    if (!f_faults)
+	f_faults = getenv("DOSATTRIB_FAULTS");
+    if (f_faults) {
+#if defined(ENABLE_FAULT_INJECTION)
+	if (faults_parse(f_faults) < 0) {
+	    fprintf(stderr, "%s: Error: %s: Invalid fault specification\n",
+		    argv[0], f_faults);
+	    exit(1);
+	}
+#else
+	fprintf(stderr, "%s: Error: Fault injection not enabled (configure --enable-fault-injection)\n",
+		argv[0]);
+	exit(1);
+#endif
+    }
+
+    t_start = metrics_now();
+
+    if (f_metrics) {
+	if (metrics_open(f_metrics, f_metrics_format, f_metrics_interval, f_metrics_top) < 0) {
+	    fprintf(stderr, "%s: Error: %s: Unable to setup metrics: %s\n",
+		    argv[0], f_metrics, strerror(errno));
+	    exit(1);
+	}
+	atexit(metrics_done);
+    }
+
+    /* With shards the threads are started in the shard processes instead */
+    if (output_start(f_threads > 1 && f_shards < 2, f_ordered, 0) < 0 ||
+	(f_threads > 1 && f_shards < 2 && pool_start(f_threads, process_entry) < 0) ||
+	(f_adaptive && f_shards < 2 && pool_adapt(2, f_adapt_interval, f_verbose ? argv[0] : NULL) < 0) ||
+	(f_prefetch && f_shards < 2 && prefetch_start(f_prefetch_threads, f_prefetch, DOSATTRIBNAME) < 0)) {
+	fprintf(stderr, "%s: Error: Unable to start threads: %s\n",
+		argv[0], strerror(errno));
+	exit(1);
+    }
+
+    if (f_format == FORMAT_CSV || f_format == FORMAT_BIN) {
+	if (f_format == FORMAT_CSV)
+	    format_csv_header(&w_buf);
+	else
+	    format_bin_header(&w_buf);
+	output_submit(output_seq(), &w_buf);
+    }
+
     for (; i < argc; i++)
-	if (f_recurse) {
-	    rc = nftw(argv[i], walker, 9999, FTW_PHYS);
+	if (f_sample) {
+	    rc = print_sample(argv[i]);
+	    if (rc < 0) {
+		fprintf(stderr, "%s: Error: %s: Unable to sample: %s\n",
+			argv[0], argv[i], strerror(errno));
+		goto Fail;
+	    }
+	} else if (f_recurse) {
+	    f_walk.state = f_rules ? rules_start(f_rules) : NULL;
+	    if (f_shards > 1)
+		rc = shards_walk(argv[i]);
+	    else
+		rc = walk_tree(argv[i], &f_walk, f_threads > 1 ? dispatcher : walker);
+	    if (f_verbose)
+		fprintf(stderr, "%s: Info: %s: %llu directories, %llu entries, %llu deferred (%llu spilled), peak %d fds, peak %llu KiB\n",
+			argv0, argv[i],
+			(long long unsigned int) f_walk.dirs,
+			(long long unsigned int) f_walk.entries,
+			(long long unsigned int) f_walk.deferred,
+			(long long unsigned int) f_walk.spilled,
+			f_walk.fds_peak,
+			(long long unsigned int) (f_walk.mem_peak+1023)/1024);
+	    metrics_gauge("walk_peak_fds", "Max number of directories open at once.",
+			  f_walk.fds_peak);
+	    metrics_gauge("walk_peak_bytes", "Max memory used for directory traversal.",
+			  f_walk.mem_peak);
 	    if (rc < 0)
 		goto Fail;
 	} else {
 	    struct stat sb;
 	    struct FTW ftw;
+	    uint64_t t0;
 
-	    rc = lstat(argv[i], &sb);
+	    METRICS_START(t0);
+	    do {
+		rc = FAULT(METRIC_LSTAT) ? -1 : lstat(argv[i], &sb);
+	    } while (rc < 0 && errno == EINTR);
+	    METRICS_STOP(METRIC_LSTAT, t0);
 	    if (rc < 0)
 		goto Fail;
 
 	    ftw.base = 0;
 	    ftw.level = 0;
-	    rc = walker(argv[i], &sb, S_ISDIR(sb.st_mode) ? FTW_D : FTW_F, &ftw);
+	    f_walk.state = f_rules ? rules_start(f_rules) : NULL;
+	    if (f_threads > 1)
+		rc = dispatcher(argv[i], &sb, S_ISDIR(sb.st_mode) ? FTW_D : FTW_F, &ftw);
+	    else
+		rc = walker(argv[i], &sb, S_ISDIR(sb.st_mode) ? FTW_D : FTW_F, &ftw);
 	    if (rc != 0)
 		goto Fail;
 	}
 
+
  Fail:
+    if (pool_stop() < 0)
+	rc = -1;
+    if (f_prefetch && f_shards < 2) {
+	uint64_t queued, dropped;
+
+	prefetch_stop(&queued, &dropped);
+	if (f_verbose)
+	    fprintf(stderr, "%s: Info: Prefetch of %llu entries, %llu dropped\n",
+		    argv[0], (long long unsigned int) queued, (long long unsigned int) dropped);
+    }
+    if (f_rules) {
+	int nstates, nrules = rules_count(f_rules, &nstates);
+
+	if (f_verbose)
+	    fprintf(stderr, "%s: Info: %s: %d rules, %d match states\n",
+		    argv[0], f_rules_file, nrules, nstates);
+	rules_free(f_rules);
+	f_rules = NULL;
+    }
+    if (f_sorter) {
+	uint64_t records, runs, spilled;
+
+	/* Whatever was collected, also after errors */
+	if (sort_finish(f_sorter, sorted_entry, NULL) < 0) {
+	    fprintf(stderr, "%s: Error: Unable to sort output: %s\n",
+		    argv[0], strerror(errno));
+	    rc = -1;
+	}
+	sort_stats(f_sorter, &records, &runs, &spilled);
+	if (f_verbose)
+	    fprintf(stderr, "%s: Info: Sorted %llu entries, %llu runs with %llu KiB spilled\n",
+		    argv[0], (long long unsigned int) records, (long long unsigned int) runs,
+		    (long long unsigned int) (spilled+1023)/1024);
+	sort_free(f_sorter);
+	f_sorter = NULL;
+    }
+    if (f_adaptive && f_shards < 2) {
+	i = pool_limit();
+	if (f_verbose)
+	    fprintf(stderr, "%s: Info: Final concurrency %d\n", argv[0], i);
+	metrics_gauge("pool_limit", "Concurrency chosen by the adaptive controller.", i);
+    }
+    if (backend_close() < 0) {
+	fprintf(stderr, "%s: Error: Closing %s backend: %s\n",
+		argv[0], backend->name, strerror(errno));
+	rc = -1;
+    }
+    if (output_stop() < 0) {
+	fprintf(stderr, "%s: Error: Writing output: %s\n",
+		argv[0], strerror(errno));
+	rc = -1;
+    }
+
+    if (f_verbose && f_recurse && !f_sample) {
+	double t = (metrics_now()-t_start)/1e9;
+
+	fprintf(stderr, "%s: Info: %llu entries in %.3f s (%.0f entries/s)\n",
+		argv[0], (long long unsigned int) stats[CAT_ENTRIES], t,
+		t > 0 ? stats[CAT_ENTRIES]/t : 0.0);
+#if defined(ENABLE_FAULT_INJECTION)
+	if (faults_enabled) {
+	    fprintf(stderr, "%s: Info: Injected faults:\n", argv[0]);
+	    faults_report(stderr);
+	}
+#endif
+    }
+
+    if (rc == 0 && f_digest) {
+	if (digest_finish(f_digest) < 0 ||
+	    (f_digest_file && digest_save(f_digest, f_digest_file) < 0)) {
+	    fprintf(stderr, "%s: Error: %s: Unable to write digest: %s\n",
+		    argv[0], f_digest_file ? f_digest_file : f_top, strerror(errno));
+	    rc = -1;
+	} else {
+	    if (f_verbose)
+		fprintf(stderr, "%s: Info: %s: Digest of %llu directories\n",
+			argv[0], f_top, (long long unsigned int) digest_dirs(f_digest));
+	    if (f_compare_file)
+		rc = compare_digest(f_compare_file, f_top, f_digest);
+	}
+	digest_free(f_digest);
+    }
+
+    if (f_index) {
+	if (rc == 0) {
+	    if (index_save(f_index, f_index_file) < 0) {
+		fprintf(stderr, "%s: Error: %s: Unable to write index: %s\n",
+			argv[0], f_index_file, strerror(errno));
+		rc = -1;
+	    } else if (f_verbose)
+		fprintf(stderr, "%s: Info: %s: Index of %llu entries\n",
+			argv[0], f_index_file, (long long unsigned int) stats[CAT_ENTRIES]);
+	}
+	index_free(f_index);
+    }
+
+    if (f_transcode_to && (f_verbose || !f_update)) {
+	long long d = (long long) tc_new_bytes - (long long) tc_old_bytes;
+
+	fprintf(stderr, "%s: Info: Transcode to version %d: %llu DOSATTRIBs %s (%llu -> %llu bytes, %+lld), %llu already version %d, %llu other versions\n",
+		argv[0], f_transcode_to, (long long unsigned int) tc_blobs,
+		f_update ? "converted" : "to convert",
+		(long long unsigned int) tc_old_bytes, (long long unsigned int) tc_new_bytes, d,
+		(long long unsigned int) tc_current, f_transcode_to,
+		(long long unsigned int) tc_other);
+    }
+
+    if (f_optimistic && (f_verbose || oc_skipped > 0))
+	fprintf(stderr, "%s: Info: Optimistic updates: %llu conflicts, %llu retried, %llu skipped\n",
+		argv[0], (long long unsigned int) oc_conflicts,
+		(long long unsigned int) oc_retries, (long long unsigned int) oc_skipped);
+
+    if (f_since) {
+	if (f_verbose)
+	    fprintf(stderr, "%s: Info: %s: %llu directories not read, %llu entries unchanged\n",
+		    argv[0], f_top, (long long unsigned int) f_walk.pruned,
+		    (long long unsigned int) since_skipped(f_since));
+	/* Only a completed run may move the stamp forward, even with -i */
+	if (rc == 0 && f_update && n_failed+n_ignored > 0)
+	    fprintf(stderr, "%s: Notice: %s: Not updated since %llu updates failed and %llu errors were ignored\n",
+		    argv[0], f_since_spec, (long long unsigned int) n_failed,
+		    (long long unsigned int) n_ignored);
+	else if (rc == 0 && f_update && since_save(f_since) < 0) {
+	    fprintf(stderr, "%s: Error: %s: Unable to write: %s\n",
+		    argv[0], f_since_spec, strerror(errno));
+	    rc = -1;
+	}
+	since_free(f_since);
+    }
+
+    if (rc == 0 && f_summary && !f_sample)
+	print_summary();
+
     return (rc == 0 ? 0 : 1);
 }
@@ -0,0 +1,396 @@
+/*
+ * faults.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "faults.h"
+
+#if defined(ENABLE_FAULT_INJECTION)
+
+/*
+ * The fault specification is a list of rules separated by ';':
+ *
+ *   OPS:ITEM[,ITEM]...
+ *   seed=N
+ *
+ * OPS is one or more of lstat, getxattr, setxattr, listxattr, traverse
+ * or "all", joined with '+'. An ITEM is either
+ *
+ *   delay=const:T
+ *   delay=uniform:T1:T2
+ *   delay=exp:MEAN
+ *   delay=lognormal:MEDIAN:SIGMA
+ *
+ * or an error and the probability of injecting it, eio=P, enospc=P,
+ * erange=P or eintr=P. Times take a ns, us, ms or s suffix (default
+ * us). For example, something like a busy NFS server:
+ *
+ *   lstat+getxattr:delay=lognormal:800us:0.6;setxattr:delay=lognormal:3ms:0.8,enospc=0.001
+ */
+
+#define DIST_NONE	0
+#define DIST_CONST	1
+#define DIST_UNIFORM	2
+#define DIST_EXP	3
+#define DIST_LOGNORMAL	4
+
+typedef struct {
+    int dist;
+    double a;			/* ns, or log(ns) for lognormal */
+    double b;
+} DELAY;
+
+static const struct {
+    const char *name;
+    int error;
+} f_errors[] = {
+    { "eio",	EIO },
+    { "enospc", ENOSPC },
+    { "erange", ERANGE },
+    { "eintr",	EINTR },
+};
+
+#define NERRORS (sizeof(f_errors)/sizeof(f_errors[0]))
+
+typedef struct {
+    DELAY delay;
+    double prob[NERRORS];
+    uint64_t calls;
+    uint64_t delay_ns;
+    uint64_t injected[NERRORS];
+} FAULT;
+
+static char *op_names[METRIC_MAX] = {
+    "lstat",
+    "getxattr",
+    "setxattr",
+    "traverse",
+    "listxattr",
+};
+
+int faults_enabled = 0;
+
+static FAULT faults[METRIC_MAX];
+static uint64_t f_seed = 0;
+static uint64_t f_threads = 0;
+
+static pthread_key_t f_rng_key;
+static pthread_once_t f_rng_once = PTHREAD_ONCE_INIT;
+static int f_rng_error = 0;
+static uint64_t f_rng_shared = 0x9E3779B97F4A7C15ULL;	/* Only if out of memory */
+
+static void
+f_rng_init(void) {
+    f_rng_error = pthread_key_create(&f_rng_key, free);
+}
+
+/* One stream per thread seeded with splitmix64, freed when it exits */
+static uint64_t *
+f_rng(void) {
+    uint64_t *rp, z;
+
+    pthread_once(&f_rng_once, f_rng_init);
+    if (f_rng_error)
+	return &f_rng_shared;
+
+    rp = pthread_getspecific(f_rng_key);
+    if (rp)
+	return rp;
+
+    z = f_seed + 0x9E3779B97F4A7C15ULL*(1+__atomic_fetch_add(&f_threads, 1, __ATOMIC_RELAXED));
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    rp = malloc(sizeof(*rp));
+    if (!rp)
+	return &f_rng_shared;
+    *rp = (z ^ (z >> 31)) | 1;
+    if (pthread_setspecific(f_rng_key, rp) != 0) {
+	free(rp);
+	return &f_rng_shared;
+    }
+    return rp;
+}
+
+/* xorshift64* */
+static double
+f_random(void) {
+    uint64_t *rp = f_rng();
+
+    *rp ^= *rp >> 12;
+    *rp ^= *rp << 25;
+    *rp ^= *rp >> 27;
+    return ((*rp * 0x2545F4914F6CDD1DULL) >> 11) * (1.0/9007199254740992.0);
+}
+
+static double
+f_normal(void) {
+    double u = f_random();
+
+    /* Box-Muller, one of the pair is enough */
+    while (u <= 0.0)
+	u = f_random();
+    return sqrt(-2.0*log(u)) * cos(2.0*M_PI*f_random());
+}
+
+static uint64_t
+f_delay(DELAY *dp) {
+    double ns = 0, u;
+
+    switch (dp->dist) {
+    case DIST_CONST:
+	ns = dp->a;
+	break;
+    case DIST_UNIFORM:
+	ns = dp->a + (dp->b-dp->a)*f_random();
+	break;
+    case DIST_EXP:
+	while ((u = f_random()) <= 0.0)
+	    ;
+	ns = -dp->a*log(u);
+	break;
+    case DIST_LOGNORMAL:
+	ns = exp(dp->a + dp->b*f_normal());
+	break;
+    }
+    return ns > 0 ? (uint64_t) ns : 0;
+}
+
+
+int
+faults_inject(METRIC_OP op) {
+    FAULT *fp = &faults[op];
+    struct timespec ts;
+    uint64_t ns;
+    double u;
+    size_t i;
+
+    __atomic_fetch_add(&fp->calls, 1, __ATOMIC_RELAXED);
+
+    if (fp->delay.dist != DIST_NONE && (ns = f_delay(&fp->delay)) > 0) {
+	ts.tv_sec = ns/1000000000;
+	ts.tv_nsec = ns%1000000000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+	    ;
+	__atomic_fetch_add(&fp->delay_ns, ns, __ATOMIC_RELAXED);
+    }
+
+    u = f_random();
+    for (i = 0; i < NERRORS; i++) {
+	if (u < fp->prob[i]) {
+	    __atomic_fetch_add(&fp->injected[i], 1, __ATOMIC_RELAXED);
+	    errno = f_errors[i].error;
+	    return -1;
+	}
+	u -= fp->prob[i];
+    }
+    return 0;
+}
+
+
+/* Time with an optional unit suffix, in ns */
+static int
+parse_time(const char *s,
+	   double *vp) {
+    char *end;
+    double v;
+
+    v = strtod(s, &end);
+    if (end == s || v < 0)
+	return -1;
+
+    if (!*end || strcmp(end, "us") == 0)
+	v *= 1000;
+    else if (strcmp(end, "ms") == 0)
+	v *= 1000000;
+    else if (strcmp(end, "s") == 0)
+	v *= 1000000000;
+    else if (strcmp(end, "ns") != 0)
+	return -1;
+
+    *vp = v;
+    return 0;
+}
+
+static int
+parse_delay(char *s,
+	    DELAY *dp) {
+    char *a, *b;
+
+    a = strchr(s, ':');
+    if (!a)
+	return -1;
+    *a++ = '\0';
+    b = strchr(a, ':');
+    if (b)
+	*b++ = '\0';
+
+    if (strcmp(s, "const") == 0 && !b) {
+	dp->dist = DIST_CONST;
+	return parse_time(a, &dp->a);
+    }
+    if (strcmp(s, "uniform") == 0 && b) {
+	dp->dist = DIST_UNIFORM;
+	if (parse_time(a, &dp->a) < 0 || parse_time(b, &dp->b) < 0 || dp->b < dp->a)
+	    return -1;
+	return 0;
+    }
+    if (strcmp(s, "exp") == 0 && !b) {
+	dp->dist = DIST_EXP;
+	return parse_time(a, &dp->a);
+    }
+    if (strcmp(s, "lognormal") == 0 && b) {
+	dp->dist = DIST_LOGNORMAL;
+	if (parse_time(a, &dp->a) < 0 || dp->a <= 0 ||
+	    sscanf(b, "%lf", &dp->b) != 1 || dp->b < 0)
+	    return -1;
+	dp->a = log(dp->a);
+	return 0;
+    }
+    return -1;
+}
+
+static int
+parse_rule(char *rule) {
+    char *items, *op, *item, *v, *sp1, *sp2;
+    unsigned int ops = 0;
+    FAULT f;
+    double p;
+    size_t i;
+    int o;
+
+    if (strncmp(rule, "seed=", 5) == 0) {
+	if (sscanf(rule+5, "%llu", (long long unsigned int *) &f_seed) != 1)
+	    return -1;
+	return 0;
+    }
+
+    items = strchr(rule, ':');
+    if (!items)
+	return -1;
+    *items++ = '\0';
+
+    for (op = strtok_r(rule, "+", &sp1); op; op = strtok_r(NULL, "+", &sp1)) {
+	if (strcmp(op, "all") == 0) {
+	    ops = (1U << METRIC_MAX)-1;
+	    continue;
+	}
+	for (o = 0; o < METRIC_MAX && strcmp(op, op_names[o]) != 0; o++)
+	    ;
+	if (o == METRIC_MAX)
+	    return -1;
+	ops |= 1U << o;
+    }
+
+    memset(&f, 0, sizeof(f));
+    for (item = strtok_r(items, ",", &sp2); item; item = strtok_r(NULL, ",", &sp2)) {
+	v = strchr(item, '=');
+	if (!v)
+	    return -1;
+	*v++ = '\0';
+
+	if (strcmp(item, "delay") == 0) {
+	    if (parse_delay(v, &f.delay) < 0)
+		return -1;
+	    continue;
+	}
+
+	for (i = 0; i < NERRORS && strcmp(item, f_errors[i].name) != 0; i++)
+	    ;
+	if (i == NERRORS || sscanf(v, "%lf", &p) != 1 || p < 0 || p > 1)
+	    return -1;
+	f.prob[i] = p;
+    }
+
+    for (o = 0; o < METRIC_MAX; o++)
+	if (ops & (1U << o))
+	    faults[o] = f;
+    return 0;
+}
+
+int
+faults_parse(const char *spec) {
+    char *buf, *rule, *sp;
+    int rc = 0;
+
+    buf = strdup(spec);
+    if (!buf)
+	return -1;
+
+    for (rule = strtok_r(buf, ";", &sp); rule && rc == 0; rule = strtok_r(NULL, ";", &sp))
+	rc = parse_rule(rule);
+    free(buf);
+
+    if (rc < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    faults_enabled = 1;
+    return 0;
+}
+
+void
+faults_report(FILE *fp) {
+    size_t i;
+    int o;
+
+    for (o = 0; o < METRIC_MAX; o++) {
+	if (!faults[o].calls)
+	    continue;
+	fprintf(fp, "  %-10s %10llu calls, %.3f s injected delay",
+		op_names[o],
+		(long long unsigned int) faults[o].calls,
+		faults[o].delay_ns/1e9);
+	for (i = 0; i < NERRORS; i++)
+	    if (faults[o].injected[i])
+		fprintf(fp, ", %llu %s", (long long unsigned int) faults[o].injected[i],
+			f_errors[i].name);
+	putc('\n', fp);
+    }
+}
+
+#endif
@@ -0,0 +1,868 @@
+/*
+ * index.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define _DEFAULT_SOURCE 1
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "index.h"
+#include "since.h"
+
+/*
+ * The index file is a header, the row blocks, a footer with the
+ * descriptors of all blocks and a trailer, all in native byte order
+ * so the file can be used as is when mapped.
+ *
+ * Rows are sorted by path and stored in blocks of IX_BLOCK_ROWS. Each
+ * column of a block is stored frame of reference - as the difference
+ * from the smallest value in the block, using 0, 1, 2, 4 or 8 bytes
+ * per row - followed by the front coded paths (u16 length of the prefix
+ * shared with the previous path, u16 length of the rest and the rest).
+ * The block descriptors hold the min and max of each column and the OR
+ * and AND of all attributes, so most blocks can be skipped (or taken
+ * whole) without looking at the rows.
+ *
+ * Queries run one simple loop per condition and column width over a
+ * selection vector, which compilers turn into SIMD code.
+ */
+
+#define IX_MAGIC	"DOSATTRIB-IX\n\0\0"
+#define IX_END		"IX-END\n"
+#define IX_VERSION	1
+#define IX_BOM		0x01020304
+
+#define IX_BLOCK_ROWS	4096
+
+/* Columns */
+#define C_ATTRIBS	0
+#define C_VERSION	1
+#define C_VALID		2
+#define C_CTIME		3
+#define C_TYPE		4
+#define C_MAX		5
+
+typedef struct {
+    char magic[16];
+    uint32_t version;
+    uint32_t bom;
+    uint32_t block_rows;
+    uint32_t rootlen;		/* Followed by the root path, padded to 8 */
+} IXHEADER;
+
+typedef struct {
+    uint64_t offset;		/* Of the column data */
+    uint64_t min[C_MAX];
+    uint64_t max[C_MAX];
+    uint32_t attribs_or;	/* Set in any row */
+    uint32_t attribs_and;	/* Set in all rows */
+    uint32_t rows;
+    uint32_t paths;		/* Offset of the paths from offset */
+    uint32_t pathsize;
+    uint8_t width[C_MAX];	/* Bytes per row */
+} IXBLOCK;
+
+typedef struct {
+    uint64_t footer;		/* Offset of the block descriptors */
+    uint64_t blocks;
+    uint64_t rows;
+    char magic[8];
+} IXTRAILER;
+
+/* A row being added */
+typedef struct {
+    const char *path;
+    IXROW r;
+} REC;
+
+#define ARENA_CHUNK	(1024*1024)
+
+typedef struct chunk {
+    struct chunk *next;
+    size_t used;
+    char data[ARENA_CHUNK];
+} CHUNK;
+
+struct index {
+    char *root;
+
+    /* Building */
+    pthread_mutex_t mtx;
+    REC *recs;
+    size_t nrecs;
+    size_t size;
+    CHUNK *chunks;
+
+    /* Loaded */
+    unsigned char *map;
+    size_t mapsize;
+    const IXBLOCK *blocks;
+    uint64_t nblocks;
+};
+
+/* A column of a loaded block */
+typedef struct {
+    const unsigned char *data;
+    uint64_t base;
+    int width;
+} COL;
+
+
+static size_t
+pad8(size_t n) {
+    return (n+7) & ~(size_t) 7;
+}
+
+
+INDEX *
+index_new(const char *root) {
+    INDEX *ip;
+
+    ip = calloc(1, sizeof(*ip));
+    if (!ip)
+	return NULL;
+    ip->root = strdup(root);
+    if (!ip->root) {
+	free(ip);
+	return NULL;
+    }
+    pthread_mutex_init(&ip->mtx, NULL);
+    return ip;
+}
+
+
+const char *
+index_root(INDEX *ip) {
+    return ip->root;
+}
+
+
+void
+index_free(INDEX *ip) {
+    CHUNK *cp;
+
+    if (!ip)
+	return;
+
+    while ((cp = ip->chunks) != NULL) {
+	ip->chunks = cp->next;
+	free(cp);
+    }
+    free(ip->recs);
+    if (ip->map)
+	munmap(ip->map, ip->mapsize);
+    pthread_mutex_destroy(&ip->mtx);
+    free(ip->root);
+    free(ip);
+}
+
+
+/* May be called from several threads */
+int
+index_add(INDEX *ip,
+	  const char *relpath,
+	  const IXROW *rp) {
+    size_t len = strlen(relpath)+1;
+    CHUNK *cp;
+    REC *nv;
+    int rc = -1;
+
+    if (len > 0x10000) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+
+    pthread_mutex_lock(&ip->mtx);
+    if (ip->nrecs == ip->size) {
+	size_t size = ip->size ? ip->size*2 : 4096;
+
+	nv = realloc(ip->recs, size*sizeof(*nv));
+	if (!nv)
+	    goto End;
+	ip->recs = nv;
+	ip->size = size;
+    }
+
+    cp = ip->chunks;
+    if (!cp || cp->used+len > ARENA_CHUNK) {
+	cp = malloc(sizeof(*cp));
+	if (!cp)
+	    goto End;
+	cp->used = 0;
+	cp->next = ip->chunks;
+	ip->chunks = cp;
+    }
+
+    memcpy(cp->data+cp->used, relpath, len);
+    ip->recs[ip->nrecs].path = cp->data+cp->used;
+    ip->recs[ip->nrecs].r = *rp;
+    ip->nrecs++;
+    cp->used += len;
+    rc = 0;
+
+ End:
+    pthread_mutex_unlock(&ip->mtx);
+    return rc;
+}
+
+
+static int
+rec_cmp(const void *a,
+	const void *b) {
+    return strcmp(((const REC *) a)->path, ((const REC *) b)->path);
+}
+
+
+static uint64_t
+rec_value(const REC *rp,
+	  int c) {
+    switch (c) {
+    case C_ATTRIBS:
+	return rp->r.attribs;
+    case C_VERSION:
+	return rp->r.version;
+    case C_VALID:
+	return rp->r.valid_flags;
+    case C_CTIME:
+	return rp->r.create_time;
+    case C_TYPE:
+	return rp->r.type;
+    }
+    return 0;
+}
+
+
+static int
+value_width(uint64_t range) {
+    if (range == 0)
+	return 0;
+    if (range <= 0xFF)
+	return 1;
+    if (range <= 0xFFFF)
+	return 2;
+    if (range <= 0xFFFFFFFF)
+	return 4;
+    return 8;
+}
+
+
+static int
+write_pad(FILE *fp,
+	  size_t n) {
+    static const char zero[8];
+
+    n = pad8(n)-n;
+    return fwrite(zero, 1, n, fp) == n ? 0 : -1;
+}
+
+
+static int
+write_block(FILE *fp,
+	    const REC *rv,
+	    size_t n,
+	    IXBLOCK *bp) {
+    unsigned char buf[8];
+    uint64_t v;
+    uint32_t v32;
+    uint16_t v16;
+    size_t i, k, plen, prev = 0, size = 0;
+    const char *last = "";
+    uint16_t h[2];
+    int c;
+
+
+    memset(bp, 0, sizeof(*bp));
+    bp->offset = ftello(fp);
+    bp->rows = n;
+    bp->attribs_and = 0xFFFFFFFF;
+
+    for (c = 0; c < C_MAX; c++) {
+	bp->min[c] = UINT64_MAX;
+	for (i = 0; i < n; i++) {
+	    v = rec_value(&rv[i], c);
+	    if (v < bp->min[c])
+		bp->min[c] = v;
+	    if (v > bp->max[c])
+		bp->max[c] = v;
+	}
+	bp->width[c] = value_width(bp->max[c]-bp->min[c]);
+    }
+    for (i = 0; i < n; i++) {
+	bp->attribs_or |= rv[i].r.attribs;
+	bp->attribs_and &= rv[i].r.attribs;
+    }
+
+    for (c = 0; c < C_MAX; c++) {
+	if (!bp->width[c])
+	    continue;
+	for (i = 0; i < n; i++) {
+	    v = rec_value(&rv[i], c)-bp->min[c];
+	    switch (bp->width[c]) {
+	    case 1:
+		buf[0] = v;
+		break;
+	    case 2:
+		v16 = v;
+		memcpy(buf, &v16, sizeof(v16));
+		break;
+	    case 4:
+		v32 = v;
+		memcpy(buf, &v32, sizeof(v32));
+		break;
+	    default:
+		memcpy(buf, &v, sizeof(v));
+	    }
+	    if (fwrite(buf, 1, bp->width[c], fp) != bp->width[c])
+		return -1;
+	}
+	size += pad8(n*bp->width[c]);
+	if (write_pad(fp, n*bp->width[c]) < 0)
+	    return -1;
+    }
+
+    bp->paths = size;
+    for (i = 0; i < n; i++) {
+	plen = strlen(rv[i].path);
+	for (k = 0; k < prev && k < plen && last[k] == rv[i].path[k]; k++)
+	    ;
+	h[0] = k;
+	h[1] = plen-k;
+	if (fwrite(h, 1, sizeof(h), fp) != sizeof(h) ||
+	    fwrite(rv[i].path+k, 1, plen-k, fp) != plen-k)
+	    return -1;
+	bp->pathsize += sizeof(h)+plen-k;
+	last = rv[i].path;
+	prev = plen;
+    }
+    return write_pad(fp, bp->pathsize);
+}
+
+
+/*
+ * Write the index, sorted by path, to a temporary file and rename it
+ * in place
+ */
+int
+index_save(INDEX *ip,
+	   const char *path) {
+    IXHEADER hdr;
+    IXTRAILER tr;
+    IXBLOCK *bv = NULL;
+    FILE *fp = NULL;
+    char *tmp;
+    size_t i, n, nb;
+    int e;
+
+
+    tmp = malloc(strlen(path)+5);
+    if (!tmp)
+	return -1;
+    sprintf(tmp, "%s.tmp", path);
+
+    qsort(ip->recs, ip->nrecs, sizeof(*ip->recs), rec_cmp);
+
+    nb = (ip->nrecs+IX_BLOCK_ROWS-1)/IX_BLOCK_ROWS;
+    bv = calloc(nb ? nb : 1, sizeof(*bv));
+    if (!bv)
+	goto Fail;
+
+    fp = fopen(tmp, "w");
+    if (!fp)
+	goto Fail;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IX_MAGIC, sizeof(hdr.magic));
+    hdr.version = IX_VERSION;
+    hdr.bom = IX_BOM;
+    hdr.block_rows = IX_BLOCK_ROWS;
+    hdr.rootlen = strlen(ip->root);
+    if (fwrite(&hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+	fwrite(ip->root, 1, hdr.rootlen, fp) != hdr.rootlen ||
+	write_pad(fp, hdr.rootlen) < 0)
+	goto Fail;
+
+    for (i = 0; i < nb; i++) {
+	n = ip->nrecs-i*IX_BLOCK_ROWS;
+	if (n > IX_BLOCK_ROWS)
+	    n = IX_BLOCK_ROWS;
+	if (write_block(fp, ip->recs+i*IX_BLOCK_ROWS, n, &bv[i]) < 0)
+	    goto Fail;
+    }
+
+    memset(&tr, 0, sizeof(tr));
+    tr.footer = ftello(fp);
+    tr.blocks = nb;
+    tr.rows = ip->nrecs;
+    memcpy(tr.magic, IX_END, sizeof(tr.magic));
+    if (fwrite(bv, sizeof(*bv), nb, fp) != nb ||
+	fwrite(&tr, 1, sizeof(tr), fp) != sizeof(tr))
+	goto Fail;
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+	goto Fail;
+    if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+	fp = NULL;
+	goto Fail;
+    }
+    free(bv);
+    free(tmp);
+    return 0;
+
+ Fail:
+    e = errno;
+    if (fp)
+	fclose(fp);
+    unlink(tmp);
+    free(tmp);
+    free(bv);
+    errno = e;
+    return -1;
+}
+
+
+INDEX *
+index_load(const char *path) {
+    INDEX *ip = NULL;
+    IXHEADER hdr;
+    IXTRAILER tr;
+    struct stat sb;
+    const IXBLOCK *bp;
+    uint64_t i, size;
+    int fd, c, e;
+
+
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+	return NULL;
+    if (fstat(fd, &sb) < 0)
+	goto Fail;
+    if ((size_t) sb.st_size < sizeof(hdr)+sizeof(tr)) {
+	errno = EINVAL;
+	goto Fail;
+    }
+
+    ip = index_new("");
+    if (!ip)
+	goto Fail;
+    ip->mapsize = sb.st_size;
+    ip->map = mmap(NULL, ip->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+    if (ip->map == MAP_FAILED) {
+	ip->map = NULL;
+	goto Fail;
+    }
+    close(fd);
+    fd = -1;
+
+    memcpy(&hdr, ip->map, sizeof(hdr));
+    memcpy(&tr, ip->map+ip->mapsize-sizeof(tr), sizeof(tr));
+    if (memcmp(hdr.magic, IX_MAGIC, sizeof(hdr.magic)) != 0 ||
+	hdr.version != IX_VERSION || hdr.bom != IX_BOM ||
+	hdr.block_rows != IX_BLOCK_ROWS ||
+	sizeof(hdr)+hdr.rootlen > ip->mapsize ||
+	memcmp(tr.magic, IX_END, sizeof(tr.magic)) != 0 ||
+	tr.footer % 8 != 0 || tr.footer > ip->mapsize-sizeof(tr) ||
+	tr.blocks > (ip->mapsize-sizeof(tr)-tr.footer)/sizeof(IXBLOCK)) {
+	errno = EINVAL;
+	goto Fail;
+    }
+
+    free(ip->root);
+    ip->root = strndup((char *) ip->map+sizeof(hdr), hdr.rootlen);
+    if (!ip->root)
+	goto Fail;
+
+    ip->blocks = (const IXBLOCK *) (ip->map+tr.footer);
+    ip->nblocks = tr.blocks;
+
+    /* So the queries need not check anything */
+    for (i = 0; i < ip->nblocks; i++) {
+	bp = &ip->blocks[i];
+	size = bp->paths;
+	for (c = 0; c < C_MAX; c++)
+	    if (bp->width[c] > 8 || (bp->width[c] & (bp->width[c]-1)) != 0)
+		break;
+	if (c < C_MAX || bp->rows > IX_BLOCK_ROWS || bp->offset % 8 != 0 ||
+	    bp->offset > tr.footer || size+bp->pathsize > tr.footer-bp->offset) {
+	    errno = EINVAL;
+	    goto Fail;
+	}
+	for (c = 0, size = 0; c < C_MAX; c++)
+	    size += pad8(bp->rows*bp->width[c]);
+	if (size != bp->paths) {
+	    errno = EINVAL;
+	    goto Fail;
+	}
+    }
+
+    return ip;
+
+ Fail:
+    e = errno;
+    if (fd >= 0)
+	close(fd);
+    index_free(ip);
+    errno = e;
+    return NULL;
+}
+
+
+/*
+ * Conditions are separated by spaces or commas:
+ *   +ATTRS -ATTRS =ATTRS -1..-5     As the flags (set, clear, exactly, version)
+ *   version=N missing invalid
+ *   type=fdl
+ *   created<T created<=T created>T created>=T
+ *   path=GLOB                       The name if without a '/'
+ * where T is YYYY-MM-DD[THH:MM[:SS]] (UTC) or @seconds since 1970.
+ */
+#define NT_EPOCH_DIFF	11644473600ULL
+
+static int
+parse_time(const char *s,
+	   uint64_t *tp) {
+    long long secs;
+
+    if (since_parse_time(s, &secs) < 0)
+	return -1;
+    if (secs < -(long long) NT_EPOCH_DIFF)
+	return -1;
+    *tp = (secs+NT_EPOCH_DIFF)*10000000ULL;
+    return 0;
+}
+
+
+int
+index_parse_query(IXQUERY *qp,
+		  char *expr,
+		  RULES_OPFN opfn) {
+    ATTROPS ops;
+    uint64_t t;
+    char *s, *v;
+
+    memset(qp, 0, sizeof(*qp));
+    qp->version = -1;
+    qp->ct_max = UINT64_MAX;
+    ops.andattribs = 0xFFFF;
+    ops.orattribs = 0;
+    ops.version = 0;
+    ops.repair = 0;
+
+    for (s = strtok(expr, " \t,"); s; s = strtok(NULL, " \t,")) {
+	if (strchr("+-=", *s)) {
+	    if (opfn(&ops, s) < 0 || ops.repair)
+		goto Invalid;
+	} else if (strcmp(s, "missing") == 0)
+	    qp->version = 0;
+	else if (strcmp(s, "invalid") == 0)
+	    qp->version = INDEX_INVALID;
+	else if (strncmp(s, "version=", 8) == 0) {
+	    if (sscanf(s+8, "%d", &qp->version) != 1 || qp->version < 0 || qp->version > 5)
+		goto Invalid;
+	} else if (strncmp(s, "type=", 5) == 0) {
+	    for (v = s+5; *v; v++)
+		switch (*v) {
+		case 'f':
+		    qp->types |= 1 << INDEX_FILE;
+		    break;
+		case 'd':
+		    qp->types |= 1 << INDEX_DIR;
+		    break;
+		case 'l':
+		    qp->types |= 1 << INDEX_LINK;
+		    break;
+		default:
+		    goto Invalid;
+		}
+	} else if (strncmp(s, "path=", 5) == 0) {
+	    qp->glob = s+5;
+	} else if (strncmp(s, "created", 7) == 0) {
+	    v = s+7;
+	    if (v[0] == '<' && v[1] == '=') {
+		if (parse_time(v+2, &t) < 0)
+		    goto Invalid;
+		if (t < qp->ct_max)
+		    qp->ct_max = t;
+	    } else if (v[0] == '<') {
+		if (parse_time(v+1, &t) < 0 || t == 0)
+		    goto Invalid;
+		if (t-1 < qp->ct_max)
+		    qp->ct_max = t-1;
+	    } else if (v[0] == '>' && v[1] == '=') {
+		if (parse_time(v+2, &t) < 0)
+		    goto Invalid;
+		if (t > qp->ct_min)
+		    qp->ct_min = t;
+	    } else if (v[0] == '>') {
+		if (parse_time(v+1, &t) < 0)
+		    goto Invalid;
+		if (t+1 > qp->ct_min)
+		    qp->ct_min = t+1;
+	    } else
+		goto Invalid;
+
+	    /* Entries without a create time are stored as 0 */
+	    if (qp->ct_min == 0)
+		qp->ct_min = 1;
+	} else
+	    goto Invalid;
+    }
+
+    qp->attr_set = ops.orattribs;
+    qp->attr_clear = ~ops.andattribs & ~ops.orattribs & 0xFFFF;
+    if (ops.version)
+	qp->version = ops.version;
+    return 0;
+
+ Invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+static uint64_t
+col_get(const COL *cp,
+	size_t i) {
+    switch (cp->width) {
+    case 1:
+	return cp->base+cp->data[i];
+    case 2:
+	return cp->base+((const uint16_t *) cp->data)[i];
+    case 4:
+	return cp->base+((const uint32_t *) cp->data)[i];
+    case 8:
+	return cp->base+((const uint64_t *) cp->data)[i];
+    }
+    return cp->base;
+}
+
+
+/* sel[i] &= cond, with v the value of the column in row i */
+#define FILTER_LOOP(T, cp, sel, n, v, cond)				\
+    do {								\
+	const T *p_ = (const T *) (cp)->data;				\
+	size_t i_;							\
+									\
+	for (i_ = 0; i_ < (n); i_++) {					\
+	    uint64_t v = (cp)->base+p_[i_];				\
+	    (sel)[i_] &= (cond);					\
+	}								\
+    } while (0)
+
+#define FILTER(cp, sel, n, v, cond)					\
+    do {								\
+	switch ((cp)->width) {						\
+	case 0: {							\
+	    uint64_t v = (cp)->base;					\
+	    if (!(cond))						\
+		memset((sel), 0, (n));					\
+	    break;							\
+	}								\
+	case 1:								\
+	    FILTER_LOOP(uint8_t, cp, sel, n, v, cond);			\
+	    break;							\
+	case 2:								\
+	    FILTER_LOOP(uint16_t, cp, sel, n, v, cond);			\
+	    break;							\
+	case 4:								\
+	    FILTER_LOOP(uint32_t, cp, sel, n, v, cond);			\
+	    break;							\
+	default:							\
+	    FILTER_LOOP(uint64_t, cp, sel, n, v, cond);			\
+	}								\
+    } while (0)
+
+
+static void
+filter_mask(uint8_t *sel,
+	    const COL *cp,
+	    size_t n,
+	    uint64_t set,
+	    uint64_t clear) {
+    FILTER(cp, sel, n, v, (v & set) == set && (v & clear) == 0);
+}
+
+static void
+filter_range(uint8_t *sel,
+	     const COL *cp,
+	     size_t n,
+	     uint64_t lo,
+	     uint64_t hi) {
+    FILTER(cp, sel, n, v, v >= lo && v <= hi);
+}
+
+static void
+filter_bits(uint8_t *sel,
+	    const COL *cp,
+	    size_t n,
+	    uint64_t bits) {
+    FILTER(cp, sel, n, v, v < 64 && ((bits >> v) & 1));
+}
+
+
+/* Types in [min,max] of the block matching the query */
+static int
+type_bits(const IXBLOCK *bp,
+	  int types) {
+    uint64_t t;
+    int bits = 0;
+
+    for (t = bp->min[C_TYPE]; t <= bp->max[C_TYPE] && t < 32; t++)
+	if (types & (1 << t))
+	    bits |= 1 << t;
+    return bits;
+}
+
+
+/*
+ * Call fn for all rows matching the query, in path order
+ */
+int
+index_query(INDEX *ip,
+	    const IXQUERY *qp,
+	    INDEX_FN fn,
+	    IXSTATS *sp) {
+    uint8_t sel[IX_BLOCK_ROWS];
+    char path[0x10000];
+    const IXBLOCK *bp;
+    const unsigned char *pp;
+    const char *name;
+    COL col[C_MAX];
+    IXROW r;
+    uint64_t b, version;
+    size_t i, n, last, off, plen;
+    uint16_t h[2];
+    int c, rc;
+
+
+    memset(sp, 0, sizeof(*sp));
+    version = qp->version < 0 ? 0 : qp->version;
+
+    for (b = 0; b < ip->nblocks; b++) {
+	bp = &ip->blocks[b];
+	n = bp->rows;
+	sp->blocks++;
+
+	/* Skip blocks where no row can match */
+	if ((bp->attribs_or & qp->attr_set) != qp->attr_set ||
+	    (bp->attribs_and & qp->attr_clear) != 0 ||
+	    (qp->version >= 0 &&
+	     (version < bp->min[C_VERSION] || version > bp->max[C_VERSION])) ||
+	    qp->ct_min > bp->max[C_CTIME] || qp->ct_max < bp->min[C_CTIME] ||
+	    (qp->types && !type_bits(bp, qp->types))) {
+	    sp->skipped++;
+	    continue;
+	}
+	sp->rows += n;
+
+	for (c = 0, off = 0; c < C_MAX; c++) {
+	    col[c].data = ip->map+bp->offset+off;
+	    col[c].base = bp->min[c];
+	    col[c].width = bp->width[c];
+	    off += pad8(n*bp->width[c]);
+	}
+
+	/* Only look at the rows when the summaries don't say they all match */
+	memset(sel, 1, n);
+	if ((bp->attribs_and & qp->attr_set) != qp->attr_set ||
+	    (bp->attribs_or & qp->attr_clear) != 0)
+	    filter_mask(sel, &col[C_ATTRIBS], n, qp->attr_set, qp->attr_clear);
+	if (qp->version >= 0 &&
+	    (bp->min[C_VERSION] != version || bp->max[C_VERSION] != version))
+	    filter_range(sel, &col[C_VERSION], n, version, version);
+	if (qp->ct_min > bp->min[C_CTIME] || qp->ct_max < bp->max[C_CTIME])
+	    filter_range(sel, &col[C_CTIME], n, qp->ct_min, qp->ct_max);
+	if (qp->types && type_bits(bp, 0xFFFFFFFF) != type_bits(bp, qp->types))
+	    filter_bits(sel, &col[C_TYPE], n, qp->types);
+
+	for (last = n; last > 0 && !sel[last-1]; last--)
+	    ;
+
+	/* The paths are front coded so decode them all up to the last match */
+	pp = ip->map+bp->offset+bp->paths;
+	off = plen = 0;
+	for (i = 0; i < last; i++) {
+	    if (off+sizeof(h) > bp->pathsize) {
+		errno = EINVAL;
+		return -1;
+	    }
+	    memcpy(h, pp+off, sizeof(h));
+	    off += sizeof(h);
+	    if (h[0] > plen || off+h[1] > bp->pathsize || (size_t) h[0]+h[1] >= sizeof(path)) {
+		errno = EINVAL;
+		return -1;
+	    }
+	    memcpy(path+h[0], pp+off, h[1]);
+	    plen = h[0]+h[1];
+	    path[plen] = '\0';
+	    off += h[1];
+
+	    if (!sel[i])
+		continue;
+
+	    if (qp->glob) {
+		name = strchr(qp->glob, '/') ? NULL : strrchr(path, '/');
+		name = name ? name+1 : path;
+		if (fnmatch(qp->glob, name, 0) != 0)
+		    continue;
+	    }
+
+	    r.attribs = col_get(&col[C_ATTRIBS], i);
+	    r.version = col_get(&col[C_VERSION], i);
+	    r.valid_flags = col_get(&col[C_VALID], i);
+	    r.create_time = col_get(&col[C_CTIME], i);
+	    r.type = col_get(&col[C_TYPE], i);
+	    sp->matches++;
+	    rc = fn(path, &r);
+	    if (rc != 0)
+		return rc;
+	}
+    }
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * index.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef INDEX_H
+#define INDEX_H 1
+
+#include <stdint.h>
+
+#include "rules.h"
+
+typedef struct index INDEX;
+
+/* Entry types */
+#define INDEX_FILE	0
+#define INDEX_DIR	1
+#define INDEX_LINK	2
+
+/* Version of entries with an invalid DOSATTRIB (0 = missing) */
+#define INDEX_INVALID	255
+
+/* What the query matches - all of it must be true */
+typedef struct {
+    uint32_t attr_set;		/* These attributes set */
+    uint32_t attr_clear;	/* and these clear */
+    int version;		/* -1 = any */
+    int types;			/* Mask of 1 << INDEX_*, 0 = any */
+    uint64_t ct_min;		/* Create time range (NT time) */
+    uint64_t ct_max;
+    const char *glob;		/* Path (or name) pattern, or NULL */
+} IXQUERY;
+
+typedef struct {
+    int type;
+    int version;
+    uint32_t attribs;
+    uint32_t valid_flags;
+    uint64_t create_time;	/* 0 if not valid */
+} IXROW;
+
+typedef struct {
+    uint64_t blocks;
+    uint64_t skipped;		/* Blocks skipped by their summaries */
+    uint64_t rows;		/* Rows in the blocks scanned */
+    uint64_t matches;
+} IXSTATS;
+
+typedef int (*INDEX_FN)(const char *relpath,
+			const IXROW *rp);
+
+extern INDEX *
+index_new(const char *root);
+
+extern int
+index_add(INDEX *ip,
+	  const char *relpath,
+	  const IXROW *rp);
+
+extern int
+index_save(INDEX *ip,
+	   const char *path);
+
+extern INDEX *
+index_load(const char *path);
+
+extern const char *
+index_root(INDEX *ip);
+
+extern int
+index_parse_query(IXQUERY *qp,
+		  char *expr,
+		  RULES_OPFN opfn);
+
+extern int
+index_query(INDEX *ip,
+	    const IXQUERY *qp,
+	    INDEX_FN fn,
+	    IXSTATS *sp);
+
+extern void
+index_free(INDEX *ip);
+
+#endif
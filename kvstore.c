@@ -0,0 +1,774 @@
+/*
+ * kvstore.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "backend.h"
+
+/*
+ * In-memory attribute store, used directly as the "memory" backend and
+ * as the cache of the "sidecar" backend. The sidecar file (much like
+ * Samba's xattr_tdb) is an append-only log of set and delete records,
+ * loaded into memory at start and compacted at close when more than half
+ * of it is dead records. Entries are keyed by the path as given, so use
+ * the same spelling of the paths on every run.
+ *
+ * File format, integers little endian:
+ *
+ *   "DOSATTRIB-KV\n" u32 version
+ *   records: u8 op ('S' or 'D'), u16 path length, u16 name length,
+ *            u32 value length, path, name, value
+ *
+ * A partial record at the end (a crash during an append) is dropped.
+ */
+
+#define KV_MAGIC	"DOSATTRIB-KV\n"
+#define KV_VERSION	1
+#define KV_RECHDR	9
+
+typedef struct kvattr {
+    struct kvattr *next;
+    char *name;
+    size_t len;
+    unsigned char val[];
+} KVATTR;
+
+typedef struct kvnode {
+    struct kvnode *next;
+    uint64_t hash;
+    KVATTR *attrs;
+    char path[];
+} KVNODE;
+
+static pthread_mutex_t kv_mtx = PTHREAD_MUTEX_INITIALIZER;
+static KVNODE **kv_tab = NULL;
+static size_t kv_size = 0;
+static size_t kv_nodes = 0;
+
+static FILE *kv_log = NULL;
+static char *kv_path = NULL;	/* Only for the sidecar backend */
+static int kv_broken = 0;	/* The log could not be repaired, errno */
+static uint64_t kv_records = 0;
+static uint64_t kv_dead = 0;	/* Overwritten, deleted and delete records */
+
+
+/* FNV-1a */
+static uint64_t
+kv_hash(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*s) {
+	h ^= (unsigned char) *s++;
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int
+kv_rehash(void) {
+    size_t nsize = kv_size ? kv_size*2 : 1024;
+    KVNODE **ntab, *np, *next;
+    size_t i;
+
+    ntab = calloc(nsize, sizeof(*ntab));
+    if (!ntab)
+	return -1;
+
+    for (i = 0; i < kv_size; i++) {
+	for (np = kv_tab[i]; np; np = next) {
+	    next = np->next;
+	    np->next = ntab[np->hash & (nsize-1)];
+	    ntab[np->hash & (nsize-1)] = np;
+	}
+    }
+
+    free(kv_tab);
+    kv_tab = ntab;
+    kv_size = nsize;
+    return 0;
+}
+
+static KVNODE *
+kv_node(const char *path,
+	int create) {
+    uint64_t h = kv_hash(path);
+    size_t plen;
+    KVNODE *np;
+
+    if (kv_size) {
+	for (np = kv_tab[h & (kv_size-1)]; np; np = np->next)
+	    if (np->hash == h && strcmp(np->path, path) == 0)
+		return np;
+    }
+    if (!create)
+	return NULL;
+
+    if (kv_nodes >= kv_size/2 && kv_rehash() < 0)
+	return NULL;
+
+    plen = strlen(path);
+    np = malloc(sizeof(*np)+plen+1);
+    if (!np)
+	return NULL;
+    np->hash = h;
+    np->attrs = NULL;
+    memcpy(np->path, path, plen+1);
+    np->next = kv_tab[h & (kv_size-1)];
+    kv_tab[h & (kv_size-1)] = np;
+    kv_nodes++;
+    return np;
+}
+
+static KVATTR **
+kv_attr(KVNODE *np,
+	const char *name) {
+    KVATTR **app;
+
+    for (app = &np->attrs; *app; app = &(*app)->next)
+	if (strcmp((*app)->name, name) == 0)
+	    break;
+    return app;
+}
+
+
+static ssize_t
+kv_get_locked(const char *path,
+	      const char *name,
+	      void *buf,
+	      size_t size) {
+    KVNODE *np = kv_node(path, 0);
+    KVATTR *ap;
+
+    if (!np || !(ap = *kv_attr(np, name))) {
+	errno = ENOATTR;
+	return -1;
+    }
+    if (!buf)
+	return ap->len;
+    if (ap->len > size) {
+	errno = ERANGE;
+	return -1;
+    }
+    memcpy(buf, ap->val, ap->len);
+    return ap->len;
+}
+
+/*
+ * Check the flags and make the new value without changing anything yet,
+ * so that it can be logged before it is visible
+ */
+static KVATTR *
+kv_new_locked(KVNODE **npp,
+	      const char *path,
+	      const char *name,
+	      const void *buf,
+	      size_t size,
+	      int flags) {
+    KVNODE *np;
+    KVATTR *ap, *op;
+
+    np = kv_node(path, 1);
+    if (!np)
+	return NULL;
+
+    op = *kv_attr(np, name);
+    if (op && (flags & BACKEND_CREATE)) {
+	errno = EEXIST;
+	return NULL;
+    }
+    if (!op && (flags & BACKEND_REPLACE)) {
+	errno = ENOATTR;
+	return NULL;
+    }
+
+    ap = malloc(sizeof(*ap)+size+strlen(name)+1);
+    if (!ap)
+	return NULL;
+    ap->next = NULL;
+    ap->len = size;
+    memcpy(ap->val, buf, size);
+    ap->name = (char *) ap->val+size;
+    strcpy(ap->name, name);
+    *npp = np;
+    return ap;
+}
+
+static void
+kv_put_locked(KVNODE *np,
+	      KVATTR *ap) {
+    KVATTR **app = kv_attr(np, ap->name);
+
+    if (*app) {
+	ap->next = (*app)->next;
+	free(*app);
+	kv_dead++;
+    }
+    *app = ap;
+}
+
+static int
+kv_set_locked(const char *path,
+	      const char *name,
+	      const void *buf,
+	      size_t size,
+	      int flags) {
+    KVNODE *np;
+    KVATTR *ap;
+
+    ap = kv_new_locked(&np, path, name, buf, size, flags);
+    if (!ap)
+	return -1;
+    kv_put_locked(np, ap);
+    return 0;
+}
+
+static int
+kv_del_locked(const char *path,
+	      const char *name) {
+    KVNODE *np = kv_node(path, 0);
+    KVATTR **app, *ap;
+
+    if (!np || !*(app = kv_attr(np, name))) {
+	errno = ENOATTR;
+	return -1;
+    }
+
+    ap = *app;
+    *app = ap->next;
+    free(ap);
+    kv_dead++;
+    return 0;
+}
+
+static ssize_t
+kv_list_locked(const char *path,
+	       char *buf,
+	       size_t size) {
+    KVNODE *np = kv_node(path, 0);
+    KVATTR *ap;
+    size_t len = 0, nlen;
+
+    if (!np)
+	return 0;
+
+    for (ap = np->attrs; ap; ap = ap->next) {
+	nlen = strlen(ap->name)+1;
+	if (buf) {
+	    if (len+nlen > size) {
+		errno = ERANGE;
+		return -1;
+	    }
+	    memcpy(buf+len, ap->name, nlen);
+	}
+	len += nlen;
+    }
+    return len;
+}
+
+
+static void
+put_le(unsigned char *p,
+       uint32_t v,
+       int n) {
+    while (n-- > 0) {
+	*p++ = v & 0xFF;
+	v >>= 8;
+    }
+}
+
+static uint32_t
+get_le(const unsigned char *p,
+       int n) {
+    uint32_t v = 0;
+
+    while (n-- > 0)
+	v = (v << 8) | p[n];
+    return v;
+}
+
+static int
+kv_append(FILE *fp,
+	  int op,
+	  const char *path,
+	  const char *name,
+	  const void *val,
+	  size_t len) {
+    unsigned char hdr[KV_RECHDR];
+    size_t plen = strlen(path), nlen = strlen(name);
+
+    if (plen > 0xFFFF || nlen > 0xFFFF || len > 0xFFFFFFFF) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+
+    hdr[0] = op;
+    put_le(hdr+1, plen, 2);
+    put_le(hdr+3, nlen, 2);
+    put_le(hdr+5, len, 4);
+    if (fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+	fwrite(path, 1, plen, fp) != plen ||
+	fwrite(name, 1, nlen, fp) != nlen ||
+	(len > 0 && fwrite(val, 1, len, fp) != len))
+	return -1;
+    return 0;
+}
+
+static int
+kv_load(const char *path,
+	int writable) {
+    FILE *fp;
+    unsigned char hdr[KV_RECHDR], *rec = NULL;
+    char magic[sizeof(KV_MAGIC)-1+4];
+    size_t plen, nlen, vlen, rsize = 0;
+    char *name;
+    unsigned char *val;
+    long good;
+
+    fp = fopen(path, writable ? "r+" : "r");
+    if (!fp) {
+	if (errno != ENOENT || !writable)
+	    return -1;
+
+	/* New file */
+	fp = fopen(path, "w+");
+	if (!fp)
+	    return -1;
+	put_le((unsigned char *) magic+sizeof(KV_MAGIC)-1, KV_VERSION, 4);
+	memcpy(magic, KV_MAGIC, sizeof(KV_MAGIC)-1);
+	if (fwrite(magic, 1, sizeof(magic), fp) != sizeof(magic) || fflush(fp) != 0) {
+	    fclose(fp);
+	    return -1;
+	}
+	kv_log = fp;
+	return 0;
+    }
+
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+	memcmp(magic, KV_MAGIC, sizeof(KV_MAGIC)-1) != 0 ||
+	get_le((unsigned char *) magic+sizeof(KV_MAGIC)-1, 4) != KV_VERSION) {
+	fclose(fp);
+	errno = EINVAL;
+	return -1;
+    }
+
+    good = ftell(fp);
+    while (fread(hdr, 1, sizeof(hdr), fp) == sizeof(hdr)) {
+	plen = get_le(hdr+1, 2);
+	nlen = get_le(hdr+3, 2);
+	vlen = get_le(hdr+5, 4);
+	if (plen+nlen+vlen+2 > rsize) {
+	    unsigned char *nrec = realloc(rec, plen+nlen+vlen+2);
+	    if (!nrec)
+		goto Fail;
+	    rec = nrec;
+	    rsize = plen+nlen+vlen+2;
+	}
+
+	/* Path and name are NUL terminated in rec, followed by the value */
+	name = (char *) rec+plen+1;
+	val = rec+plen+nlen+2;
+	if (fread(rec, 1, plen, fp) != plen ||
+	    fread(name, 1, nlen, fp) != nlen ||
+	    fread(val, 1, vlen, fp) != vlen)
+	    break;
+	rec[plen] = '\0';
+	name[nlen] = '\0';
+
+	if (hdr[0] == 'S') {
+	    if (kv_set_locked((char *) rec, name, val, vlen, 0) < 0)
+		goto Fail;
+	} else if (hdr[0] == 'D') {
+	    (void) kv_del_locked((char *) rec, name);
+	    kv_dead++;
+	} else
+	    break;
+	kv_records++;
+	good = ftell(fp);
+    }
+    free(rec);
+    rec = NULL;
+
+    if (!writable) {
+	fclose(fp);
+	return 0;
+    }
+
+    /* Drop any partial record at the end before appending */
+    if (fflush(fp) != 0 || ftruncate(fileno(fp), good) < 0 ||
+	fseek(fp, good, SEEK_SET) < 0)
+	goto Fail;
+
+    kv_log = fp;
+    return 0;
+
+ Fail:
+    free(rec);
+    fclose(fp);
+    return -1;
+}
+
+/*
+ * Cut the log off at pos again after a failed append. It is reopened
+ * to drop anything still in the stdio buffer, which could otherwise be
+ * written after a later record.
+ */
+static int
+kv_rewind(off_t pos) {
+    (void) fclose(kv_log);
+    kv_log = NULL;
+    if (truncate(kv_path, pos) < 0 ||
+	(kv_log = fopen(kv_path, "r+")) == NULL ||
+	fseeko(kv_log, pos, SEEK_SET) < 0)
+	return -1;
+    return 0;
+}
+
+/*
+ * Append a record to the log and flush it. A partial record would make
+ * the next load stop there and drop all later ones, so on failure it
+ * is cut off again, and if even that fails all further writes fail.
+ */
+static int
+kv_log_record(int op,
+	      const char *path,
+	      const char *name,
+	      const void *val,
+	      size_t len) {
+    off_t pos;
+    int err;
+
+    if (kv_broken) {
+	errno = kv_broken;
+	return -1;
+    }
+
+    pos = ftello(kv_log);
+    if (pos >= 0 &&
+	kv_append(kv_log, op, path, name, val, len) == 0 && fflush(kv_log) == 0) {
+	kv_records++;
+	return 0;
+    }
+
+    err = errno;
+    if (pos < 0 || kv_rewind(pos) < 0)
+	kv_broken = err;
+    errno = err;
+    return -1;
+}
+
+/* Write the live entries to a new file and rename it into place */
+static int
+kv_compact(void) {
+    char *tmp;
+    FILE *fp;
+    KVNODE *np;
+    KVATTR *ap;
+    size_t i;
+    char magic[sizeof(KV_MAGIC)-1+4];
+
+    tmp = malloc(strlen(kv_path)+5);
+    if (!tmp)
+	return -1;
+    sprintf(tmp, "%s.tmp", kv_path);
+
+    fp = fopen(tmp, "w");
+    if (!fp) {
+	free(tmp);
+	return -1;
+    }
+
+    memcpy(magic, KV_MAGIC, sizeof(KV_MAGIC)-1);
+    put_le((unsigned char *) magic+sizeof(KV_MAGIC)-1, KV_VERSION, 4);
+    if (fwrite(magic, 1, sizeof(magic), fp) != sizeof(magic))
+	goto Fail;
+
+    for (i = 0; i < kv_size; i++)
+	for (np = kv_tab[i]; np; np = np->next)
+	    for (ap = np->attrs; ap; ap = ap->next)
+		if (kv_append(fp, 'S', np->path, ap->name, ap->val, ap->len) < 0)
+		    goto Fail;
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+	goto Fail;
+    if (fclose(fp) != 0 || rename(tmp, kv_path) < 0) {
+	fp = NULL;
+	goto Fail;
+    }
+    free(tmp);
+    return 0;
+
+ Fail:
+    if (fp)
+	fclose(fp);
+    unlink(tmp);
+    free(tmp);
+    return -1;
+}
+
+static void
+kv_free(void) {
+    KVNODE *np, *nnext;
+    KVATTR *ap, *anext;
+    size_t i;
+
+    for (i = 0; i < kv_size; i++)
+	for (np = kv_tab[i]; np; np = nnext) {
+	    nnext = np->next;
+	    for (ap = np->attrs; ap; ap = anext) {
+		anext = ap->next;
+		free(ap);
+	    }
+	    free(np);
+	}
+    free(kv_tab);
+    kv_tab = NULL;
+    kv_size = kv_nodes = 0;
+    kv_records = kv_dead = 0;
+}
+
+
+static ssize_t
+kv_get(const char *path,
+       const char *name,
+       void *buf,
+       size_t size) {
+    ssize_t rc;
+
+    pthread_mutex_lock(&kv_mtx);
+    rc = kv_get_locked(path, name, buf, size);
+    pthread_mutex_unlock(&kv_mtx);
+    return rc;
+}
+
+/* Logged first, so a failed write changes nothing */
+static int
+kv_set(const char *path,
+       const char *name,
+       const void *buf,
+       size_t size,
+       int flags) {
+    KVNODE *np;
+    KVATTR *ap;
+    int rc = -1;
+
+    pthread_mutex_lock(&kv_mtx);
+    ap = kv_new_locked(&np, path, name, buf, size, flags);
+    if (ap && kv_path && kv_log_record('S', path, name, buf, size) < 0)
+	free(ap);
+    else if (ap) {
+	kv_put_locked(np, ap);
+	rc = 0;
+    }
+    pthread_mutex_unlock(&kv_mtx);
+    return rc;
+}
+
+static int
+kv_del(const char *path,
+       const char *name) {
+    KVNODE *np;
+    int rc = -1;
+
+    pthread_mutex_lock(&kv_mtx);
+    np = kv_node(path, 0);
+    if (!np || !*kv_attr(np, name))
+	errno = ENOATTR;
+    else if (!kv_path || kv_log_record('D', path, name, NULL, 0) == 0) {
+	if (kv_path)
+	    kv_dead++;
+	rc = kv_del_locked(path, name);
+    }
+    pthread_mutex_unlock(&kv_mtx);
+    return rc;
+}
+
+static ssize_t
+kv_list(const char *path,
+	char *buf,
+	size_t size) {
+    ssize_t rc;
+
+    pthread_mutex_lock(&kv_mtx);
+    rc = kv_list_locked(path, buf, size);
+    pthread_mutex_unlock(&kv_mtx);
+    return rc;
+}
+
+static int
+kv_get_batch(BACKEND_OP *ops,
+	     size_t n) {
+    size_t i;
+    int nf = 0;
+
+    pthread_mutex_lock(&kv_mtx);
+    for (i = 0; i < n; i++) {
+	ops[i].rc = kv_get_locked(ops[i].path, ops[i].name, ops[i].buf, ops[i].size);
+	ops[i].error = ops[i].rc < 0 ? errno : 0;
+	if (ops[i].rc < 0)
+	    nf++;
+    }
+    pthread_mutex_unlock(&kv_mtx);
+    return nf;
+}
+
+/*
+ * One lock for the whole batch. Each op is checked against what the
+ * ones before it left, logged and applied in order, like kv_set()
+ */
+static int
+kv_set_batch(BACKEND_OP *ops,
+	     size_t n) {
+    KVNODE *np;
+    KVATTR *ap;
+    size_t i;
+    int nf = 0;
+
+    pthread_mutex_lock(&kv_mtx);
+    for (i = 0; i < n; i++) {
+	ap = kv_new_locked(&np, ops[i].path, ops[i].name, ops[i].buf, ops[i].size, ops[i].flags);
+	if (ap && kv_path &&
+	    kv_log_record('S', ops[i].path, ops[i].name, ops[i].buf, ops[i].size) < 0) {
+	    free(ap);
+	    ap = NULL;
+	}
+	if (ap) {
+	    kv_put_locked(np, ap);
+	    ops[i].rc = 0;
+	    ops[i].error = 0;
+	} else {
+	    ops[i].rc = -1;
+	    ops[i].error = errno;
+	    nf++;
+	}
+    }
+    pthread_mutex_unlock(&kv_mtx);
+    return nf;
+}
+
+
+/* "memory" or "memory:FILE" to start from a copy of a sidecar file */
+static int
+memory_open(const char *arg) {
+    kv_free();
+    if (arg && kv_load(arg, 0) < 0) {
+	kv_free();
+	return -1;
+    }
+    return 0;
+}
+
+static int
+memory_close(void) {
+    kv_free();
+    return 0;
+}
+
+static int
+sidecar_open(const char *arg) {
+    if (!arg || !*arg) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    kv_free();
+    kv_path = strdup(arg);
+    if (!kv_path)
+	return -1;
+
+    if (kv_load(kv_path, 1) < 0) {
+	kv_free();
+	free(kv_path);
+	kv_path = NULL;
+	return -1;
+    }
+    return 0;
+}
+
+static int
+sidecar_close(void) {
+    int rc = kv_broken ? -1 : 0;
+
+    kv_broken = 0;
+    if (kv_log) {
+	if (fclose(kv_log) != 0)
+	    rc = -1;
+	kv_log = NULL;
+	if (rc == 0 && 2*kv_dead > kv_records)
+	    rc = kv_compact();
+    }
+
+    kv_free();
+    free(kv_path);
+    kv_path = NULL;
+    return rc;
+}
+
+
+BACKEND backend_memory = {
+    "memory",
+    0,
+    memory_open,
+    memory_close,
+    kv_get,
+    kv_set,
+    kv_del,
+    kv_list,
+    kv_get_batch,
+    kv_set_batch,
+};
+
+BACKEND backend_sidecar = {
+    "sidecar",
+    0,
+    sidecar_open,
+    sidecar_close,
+    kv_get,
+    kv_set,
+    kv_del,
+    kv_list,
+    kv_get_batch,
+    kv_set_batch,
+};
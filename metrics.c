@@ -0,0 +1,463 @@
+/*
+ * metrics.c - Latency histograms & metrics export
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "metrics.h"
+
+/*
+ * Log-bucketed (HDR style) histograms: values below 2*SUBBUCKETS are
+ * counted exactly, above that every power of two is split into
+ * SUBBUCKETS linear sub-buckets, giving about 3% relative precision
+ * over the whole 64 bit nanosecond range.
+ */
+#define SUBBITS		5
+#define SUBBUCKETS	(1<<SUBBITS)
+#define NBUCKETS	((64-SUBBITS+1)*SUBBUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[NBUCKETS];
+} HISTOGRAM;
+
+typedef struct {
+    char *path;
+    uint64_t ns;
+    uint64_t entries;
+} SLOWDIR;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    double value;
+} GAUGE;
+
+#define MAX_GAUGES 32
+
+
+int metrics_enabled = 0;
+
+static HISTOGRAM histograms[METRIC_MAX];
+
+static char *op_names[METRIC_MAX] = {
+    "lstat",
+    "getxattr",
+    "setxattr",
+    "traverse",
+    "listxattr",
+};
+
+static char *m_path = NULL;
+static int m_format = METRICS_FORMAT_PROM;
+static uint64_t m_interval = 0;
+static uint64_t m_next = 0;
+
+static SLOWDIR *slowdirs = NULL;
+static int slowdirs_max = 0;
+static int slowdirs_len = 0;
+
+static GAUGE gauges[MAX_GAUGES];
+static int gauges_len = 0;
+
+
+
+uint64_t
+metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int
+msb64(uint64_t v) {
+    int n = 0;
+
+#if defined(__GNUC__)
+    n = 63-__builtin_clzll(v);
+#else
+    while (v >>= 1)
+	n++;
+#endif
+    return n;
+}
+
+static int
+bucket_index(uint64_t v) {
+    int e;
+
+    if (v < 2*SUBBUCKETS)
+	return v;
+
+    e = msb64(v);
+    return ((e-SUBBITS+1) << SUBBITS) | ((v >> (e-SUBBITS)) & (SUBBUCKETS-1));
+}
+
+/* Midpoint of the value range a bucket covers */
+static uint64_t
+bucket_value(int i) {
+    int e;
+    uint64_t low;
+
+    if (i < 2*SUBBUCKETS)
+	return i;
+
+    e = (i >> SUBBITS)+SUBBITS-1;
+    low = (uint64_t) (SUBBUCKETS + (i & (SUBBUCKETS-1))) << (e-SUBBITS);
+    return low + ((1ULL << (e-SUBBITS)) >> 1);
+}
+
+
+/*
+ * Lock-free - may be called from any thread
+ */
+void
+metrics_record(METRIC_OP op,
+	       uint64_t ns) {
+    HISTOGRAM *h = &histograms[op];
+    uint64_t max;
+
+    __atomic_fetch_add(&h->buckets[bucket_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ns > max &&
+	   !__atomic_compare_exchange_n(&h->max, &max, ns, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+
+/*
+ * Keep the top-N slowest directories. The list is small so a simple
+ * insertion sort (slowest first) is good enough.
+ */
+void
+metrics_dir_add(const char *path,
+		uint64_t ns,
+		uint64_t entries) {
+    int i;
+
+    if (!metrics_enabled || slowdirs_max <= 0)
+	return;
+
+    if (slowdirs_len == slowdirs_max) {
+	if (ns <= slowdirs[slowdirs_len-1].ns)
+	    return;
+	free(slowdirs[--slowdirs_len].path);
+    }
+
+    for (i = slowdirs_len; i > 0 && slowdirs[i-1].ns < ns; i--)
+	slowdirs[i] = slowdirs[i-1];
+
+    slowdirs[i].path = strdup(path);
+    slowdirs[i].ns = ns;
+    slowdirs[i].entries = entries;
+    slowdirs_len++;
+}
+
+
+/*
+ * Set a named gauge, the name is appended to "dosattrib_" in the output
+ */
+void
+metrics_gauge(const char *name,
+	      const char *help,
+	      double value) {
+    int i;
+
+    if (!metrics_enabled)
+	return;
+
+    for (i = 0; i < gauges_len && strcmp(gauges[i].name, name) != 0; i++)
+	;
+    if (i == gauges_len) {
+	if (gauges_len == MAX_GAUGES)
+	    return;
+	gauges_len++;
+	gauges[i].name = name;
+	gauges[i].help = help;
+    }
+    gauges[i].value = value;
+}
+
+
+int
+metrics_open(const char *path,
+	     int format,
+	     int interval,
+	     int topn) {
+    m_path = strdup(path);
+    if (!m_path)
+	return -1;
+
+    m_format = format;
+    m_interval = (uint64_t) interval * 1000000000;
+
+    if (topn > 0) {
+	slowdirs = calloc(topn, sizeof(*slowdirs));
+	if (!slowdirs)
+	    return -1;
+	slowdirs_max = topn;
+    }
+
+    metrics_enabled = 1;
+    m_next = metrics_now() + m_interval;
+    return 0;
+}
+
+
+void
+metrics_poll(uint64_t now) {
+    if (!metrics_enabled || !m_interval || now < m_next)
+	return;
+
+    m_next = now + m_interval;
+    metrics_write();
+}
+
+
+static uint64_t
+percentile(uint64_t *buckets,
+	   uint64_t count,
+	   double q) {
+    uint64_t n, target;
+    int i;
+
+    if (!count)
+	return 0;
+
+    target = (uint64_t) (q*count + 0.5);
+    if (target < 1)
+	target = 1;
+
+    for (n = 0, i = 0; i < NBUCKETS; i++) {
+	n += buckets[i];
+	if (n >= target)
+	    return bucket_value(i);
+    }
+    return bucket_value(NBUCKETS-1);
+}
+
+
+/*
+ * Quote a path for a Prometheus label value or a JSON string. Labels
+ * only have the \\, \" and \n escapes, so other control characters
+ * are replaced by '?' there
+ */
+static void
+put_escaped(FILE *fp,
+	    const char *s,
+	    int json) {
+    for (; *s; s++) {
+	switch (*s) {
+	case '\\':
+	    fputs("\\\\", fp);
+	    break;
+	case '"':
+	    fputs("\\\"", fp);
+	    break;
+	case '\n':
+	    fputs("\\n", fp);
+	    break;
+	default:
+	    if ((unsigned char) *s >= ' ')
+		putc(*s, fp);
+	    else if (json)
+		fprintf(fp, "\\u%04x", (unsigned int) (unsigned char) *s);
+	    else
+		putc('?', fp);
+	    break;
+	}
+    }
+}
+
+
+static double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define NQUANTILES (sizeof(quantiles)/sizeof(quantiles[0]))
+
+
+static void
+write_prom(FILE *fp,
+	   HISTOGRAM *hv) {
+    int i, j;
+
+    fprintf(fp, "# HELP dosattrib_op_latency_seconds Latency of filesystem operations.\n");
+    fprintf(fp, "# TYPE dosattrib_op_latency_seconds summary\n");
+    for (i = 0; i < METRIC_MAX; i++) {
+	for (j = 0; j < NQUANTILES; j++)
+	    fprintf(fp, "dosattrib_op_latency_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n",
+		    op_names[i], quantiles[j],
+		    percentile(hv[i].buckets, hv[i].count, quantiles[j])/1e9);
+	fprintf(fp, "dosattrib_op_latency_seconds_sum{op=\"%s\"} %.9f\n",
+		op_names[i], hv[i].sum/1e9);
+	fprintf(fp, "dosattrib_op_latency_seconds_count{op=\"%s\"} %llu\n",
+		op_names[i], (long long unsigned int) hv[i].count);
+    }
+
+    fprintf(fp, "# HELP dosattrib_op_latency_max_seconds Slowest single operation.\n");
+    fprintf(fp, "# TYPE dosattrib_op_latency_max_seconds gauge\n");
+    for (i = 0; i < METRIC_MAX; i++)
+	fprintf(fp, "dosattrib_op_latency_max_seconds{op=\"%s\"} %.9f\n",
+		op_names[i], hv[i].max/1e9);
+
+    fprintf(fp, "# HELP dosattrib_slow_dir_seconds Time spent on the entries of the slowest directories.\n");
+    fprintf(fp, "# TYPE dosattrib_slow_dir_seconds gauge\n");
+    for (i = 0; i < slowdirs_len; i++) {
+	fprintf(fp, "dosattrib_slow_dir_seconds{rank=\"%d\",path=\"", i+1);
+	put_escaped(fp, slowdirs[i].path, 0);
+	fprintf(fp, "\"} %.9f\n", slowdirs[i].ns/1e9);
+    }
+
+    fprintf(fp, "# HELP dosattrib_slow_dir_entries Number of entries in the slowest directories.\n");
+    fprintf(fp, "# TYPE dosattrib_slow_dir_entries gauge\n");
+    for (i = 0; i < slowdirs_len; i++) {
+	fprintf(fp, "dosattrib_slow_dir_entries{rank=\"%d\",path=\"", i+1);
+	put_escaped(fp, slowdirs[i].path, 0);
+	fprintf(fp, "\"} %llu\n", (long long unsigned int) slowdirs[i].entries);
+    }
+
+    for (i = 0; i < gauges_len; i++) {
+	fprintf(fp, "# HELP dosattrib_%s %s\n", gauges[i].name, gauges[i].help);
+	fprintf(fp, "# TYPE dosattrib_%s gauge\n", gauges[i].name);
+	fprintf(fp, "dosattrib_%s %.17g\n", gauges[i].name, gauges[i].value);
+    }
+}
+
+static void
+write_json(FILE *fp,
+	   HISTOGRAM *hv) {
+    int i, j;
+
+    fprintf(fp, "{\n  \"ops\": {");
+    for (i = 0; i < METRIC_MAX; i++) {
+	fprintf(fp, "%s\n    \"%s\": { \"count\": %llu, \"sum_seconds\": %.9f, \"max_seconds\": %.9f",
+		i > 0 ? "," : "",
+		op_names[i],
+		(long long unsigned int) hv[i].count,
+		hv[i].sum/1e9,
+		hv[i].max/1e9);
+	for (j = 0; j < NQUANTILES; j++)
+	    fprintf(fp, ", \"p%g\": %.9f",
+		    quantiles[j]*100,
+		    percentile(hv[i].buckets, hv[i].count, quantiles[j])/1e9);
+	fprintf(fp, " }");
+    }
+    fprintf(fp, "\n  },\n  \"slow_dirs\": [");
+    for (i = 0; i < slowdirs_len; i++) {
+	fprintf(fp, "%s\n    { \"path\": \"", i > 0 ? "," : "");
+	put_escaped(fp, slowdirs[i].path, 1);
+	fprintf(fp, "\", \"seconds\": %.9f, \"entries\": %llu }",
+		slowdirs[i].ns/1e9,
+		(long long unsigned int) slowdirs[i].entries);
+    }
+    fprintf(fp, "\n  ],\n  \"gauges\": {");
+    for (i = 0; i < gauges_len; i++)
+	fprintf(fp, "%s\n    \"%s\": %.17g",
+		i > 0 ? "," : "",
+		gauges[i].name,
+		gauges[i].value);
+    fprintf(fp, "\n  }\n}\n");
+}
+
+
+/*
+ * Write the metrics to a temporary file and rename it into place so
+ * that collectors (node_exporter textfile etc) never see a partial file
+ */
+int
+metrics_write(void) {
+    HISTOGRAM *hv;
+    FILE *fp;
+    char *tmp;
+    int i, j, rc;
+
+
+    if (!metrics_enabled)
+	return 0;
+
+    /* Take a snapshot so percentiles are computed on consistent data */
+    hv = malloc(sizeof(histograms));
+    if (!hv)
+	return -1;
+    for (i = 0; i < METRIC_MAX; i++) {
+	hv[i].count = __atomic_load_n(&histograms[i].count, __ATOMIC_RELAXED);
+	hv[i].sum = __atomic_load_n(&histograms[i].sum, __ATOMIC_RELAXED);
+	hv[i].max = __atomic_load_n(&histograms[i].max, __ATOMIC_RELAXED);
+	for (j = 0; j < NBUCKETS; j++)
+	    hv[i].buckets[j] = __atomic_load_n(&histograms[i].buckets[j], __ATOMIC_RELAXED);
+    }
+
+    tmp = malloc(strlen(m_path)+5);
+    if (!tmp) {
+	free(hv);
+	return -1;
+    }
+    strcpy(tmp, m_path);
+    strcat(tmp, ".tmp");
+
+    fp = fopen(tmp, "w");
+    if (!fp) {
+	free(tmp);
+	free(hv);
+	return -1;
+    }
+
+    if (m_format == METRICS_FORMAT_JSON)
+	write_json(fp, hv);
+    else
+	write_prom(fp, hv);
+
+    rc = 0;
+    if (fclose(fp) != 0 || rename(tmp, m_path) < 0)
+	rc = -1;
+
+    free(tmp);
+    free(hv);
+    return rc;
+}
@@ -0,0 +1,94 @@
+/*
+ * metrics.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H 1
+
+#include <stdint.h>
+
+/* Operation classes we keep latency histograms for */
+typedef enum {
+    METRIC_LSTAT = 0,
+    METRIC_GETXATTR,
+    METRIC_SETXATTR,
+    METRIC_TRAVERSE,
+    METRIC_LISTXATTR,
+    METRIC_MAX
+} METRIC_OP;
+
+#define METRICS_FORMAT_PROM 0
+#define METRICS_FORMAT_JSON 1
+
+extern int metrics_enabled;
+
+
+extern uint64_t
+metrics_now(void);
+
+extern void
+metrics_record(METRIC_OP op,
+	       uint64_t ns);
+
+extern void
+metrics_dir_add(const char *path,
+		uint64_t ns,
+		uint64_t entries);
+
+extern void
+metrics_gauge(const char *name,
+	      const char *help,
+	      double value);
+
+extern int
+metrics_open(const char *path,
+	     int format,
+	     int interval,
+	     int topn);
+
+extern void
+metrics_poll(uint64_t now);
+
+extern int
+metrics_write(void);
+
+
+/* Cheap enough to leave in the hot path - a single branch when disabled */
+#define METRICS_START(t)	((t) = (metrics_enabled ? metrics_now() : 0))
+
+#define METRICS_STOP(op, t)					\
+    do {							\
+	if (metrics_enabled)					\
+	    metrics_record((op), metrics_now()-(t));		\
+    } while (0)
+
+#endif
@@ -0,0 +1,499 @@
+/*
+ * output.c - Record output stage with optional reordering writer thread
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "output.h"
+
+/*
+ * Every entry produces one (possibly empty) record, tagged with a
+ * sequence number in traversal order. Without threads the records are
+ * simply collected in a large buffer and written to stdout in big
+ * chunks.
+ *
+ * With threads a single writer thread owns stdout. Workers hand over
+ * their record buffers to a bounded reorder buffer (a ring indexed by
+ * sequence number) and the writer emits the consecutive records that
+ * are ready with writev(). Workers that get too far ahead block until
+ * there is room. In unordered mode records get their slot in arrival
+ * order instead.
+ */
+
+#define OUTBUF_FLUSH	(64*1024)
+
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+typedef struct {
+    int ready;
+    OBUF ob;
+} SLOT;
+
+
+static int o_threaded = 0;
+static int o_ordered = 1;
+static int o_tty = 0;
+static uint64_t o_seq = 0;
+static OBUF o_buf;
+
+static pthread_t o_tid;
+static pthread_mutex_t o_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t o_cv_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t o_cv_space = PTHREAD_COND_INITIALIZER;
+static SLOT *o_slots = NULL;
+static size_t o_nslots = 0;
+static uint64_t o_next = 0;
+static uint64_t o_arrival = 0;
+static int o_stop = 0;
+static int o_error = 0;
+
+
+
+int
+obuf_grow(OBUF *bp,
+	  size_t len) {
+    size_t nsize;
+    char *nbuf;
+
+    if (bp->len+len <= bp->size)
+	return 0;
+
+    nsize = bp->size ? bp->size : 256;
+    while (nsize < bp->len+len)
+	nsize *= 2;
+
+    nbuf = realloc(bp->buf, nsize);
+    if (!nbuf)
+	return -1;
+
+    bp->buf = nbuf;
+    bp->size = nsize;
+    return 0;
+}
+
+void
+obuf_write(OBUF *bp,
+	   const void *p,
+	   size_t len) {
+    if (obuf_grow(bp, len) < 0)
+	return;
+
+    memcpy(bp->buf+bp->len, p, len);
+    bp->len += len;
+}
+
+void
+obuf_putc(OBUF *bp,
+	  int c) {
+    if (bp->len < bp->size || obuf_grow(bp, 1) == 0)
+	bp->buf[bp->len++] = c;
+}
+
+void
+obuf_puts(OBUF *bp,
+	  const char *s) {
+    obuf_write(bp, s, strlen(s));
+}
+
+void
+obuf_printf(OBUF *bp,
+	    const char *fmt,
+	    ...) {
+    va_list ap;
+    int rc;
+
+    va_start(ap, fmt);
+    rc = vsnprintf(bp->buf ? bp->buf+bp->len : NULL, bp->size-bp->len, fmt, ap);
+    va_end(ap);
+
+    if (rc < 0)
+	return;
+
+    if (bp->len+rc >= bp->size) {
+	if (obuf_grow(bp, rc+1) < 0)
+	    return;
+
+	va_start(ap, fmt);
+	rc = vsnprintf(bp->buf+bp->len, bp->size-bp->len, fmt, ap);
+	va_end(ap);
+	if (rc < 0)
+	    return;
+    }
+
+    bp->len += rc;
+}
+
+/*
+ * Hand-rolled formatters for the machine readable output formats,
+ * printf() is far too slow to call a dozen times per entry.
+ */
+static const char hexdigits[] = "0123456789abcdef";
+
+void
+obuf_putu64(OBUF *bp,
+	    uint64_t v) {
+    char tmp[20], *p = tmp+sizeof(tmp);
+
+    do {
+	*--p = '0' + v%10;
+	v /= 10;
+    } while (v);
+
+    obuf_write(bp, p, tmp+sizeof(tmp)-p);
+}
+
+void
+obuf_puthex(OBUF *bp,
+	    uint64_t v,
+	    int width) {
+    char tmp[16], *p = tmp+sizeof(tmp);
+
+    do {
+	*--p = hexdigits[v&15];
+	v >>= 4;
+	width--;
+    } while ((v || width > 0) && p > tmp);
+
+    obuf_write(bp, p, tmp+sizeof(tmp)-p);
+}
+
+void
+obuf_puthexbytes(OBUF *bp,
+		 const void *p,
+		 size_t len) {
+    const unsigned char *cp = p;
+    char *op;
+
+    if (obuf_grow(bp, 2*len) < 0)
+	return;
+
+    op = bp->buf+bp->len;
+    while (len-- > 0) {
+	*op++ = hexdigits[*cp>>4];
+	*op++ = hexdigits[*cp&15];
+	cp++;
+    }
+    bp->len = op-bp->buf;
+}
+
+/* Quoted JSON string, bytes >= 0x80 are passed through as is */
+void
+obuf_putjson(OBUF *bp,
+	     const char *s) {
+    const unsigned char *cp = (const unsigned char *) s;
+
+    obuf_putc(bp, '"');
+    for (; *cp; cp++) {
+	switch (*cp) {
+	case '"':
+	case '\\':
+	    obuf_putc(bp, '\\');
+	    obuf_putc(bp, *cp);
+	    break;
+	case '\n':
+	    obuf_puts(bp, "\\n");
+	    break;
+	case '\t':
+	    obuf_puts(bp, "\\t");
+	    break;
+	case '\r':
+	    obuf_puts(bp, "\\r");
+	    break;
+	default:
+	    if (*cp < 0x20) {
+		obuf_puts(bp, "\\u00");
+		obuf_puthex(bp, *cp, 2);
+	    } else
+		obuf_putc(bp, *cp);
+	}
+    }
+    obuf_putc(bp, '"');
+}
+
+/* CSV field as per RFC 4180, quoted only when needed */
+void
+obuf_putcsv(OBUF *bp,
+	    const char *s) {
+    if (!s[strcspn(s, ",\"\r\n")]) {
+	obuf_puts(bp, s);
+	return;
+    }
+
+    obuf_putc(bp, '"');
+    for (; *s; s++) {
+	if (*s == '"')
+	    obuf_putc(bp, '"');
+	obuf_putc(bp, *s);
+    }
+    obuf_putc(bp, '"');
+}
+
+void
+obuf_free(OBUF *bp) {
+    free(bp->buf);
+    bp->buf = NULL;
+    bp->len = bp->size = 0;
+}
+
+
+static int
+write_all(int fd,
+	  const char *buf,
+	  size_t len) {
+    ssize_t rc;
+
+    while (len > 0) {
+	rc = write(fd, buf, len);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += rc;
+	len -= rc;
+    }
+    return 0;
+}
+
+static int
+writev_all(int fd,
+	   struct iovec *iov,
+	   int iovcnt) {
+    ssize_t rc;
+
+    while (iovcnt > 0) {
+	rc = writev(fd, iov, iovcnt);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	while (iovcnt > 0 && (size_t) rc >= iov->iov_len) {
+	    rc -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *) iov->iov_base + rc;
+	    iov->iov_len -= rc;
+	}
+    }
+    return 0;
+}
+
+
+static void *
+writer(void *arg) {
+    struct iovec iov[IOV_MAX];
+    size_t i, n, nv;
+    int rc;
+
+    (void) arg;
+
+    pthread_mutex_lock(&o_mtx);
+    while (1) {
+	while (!o_slots[o_next % o_nslots].ready && !o_stop)
+	    pthread_cond_wait(&o_cv_ready, &o_mtx);
+
+	if (!o_slots[o_next % o_nslots].ready)
+	    break;
+
+	/* Grab as many consecutive records as are ready */
+	for (n = nv = 0;
+	     n < o_nslots && nv < IOV_MAX && o_slots[(o_next+n) % o_nslots].ready;
+	     n++) {
+	    SLOT *sp = &o_slots[(o_next+n) % o_nslots];
+
+	    if (sp->ob.len > 0) {
+		iov[nv].iov_base = sp->ob.buf;
+		iov[nv].iov_len = sp->ob.len;
+		nv++;
+	    }
+	}
+	pthread_mutex_unlock(&o_mtx);
+
+	rc = nv > 0 ? writev_all(1, iov, nv) : 0;
+
+	pthread_mutex_lock(&o_mtx);
+	if (rc < 0)
+	    o_error = errno;
+	for (i = 0; i < n; i++) {
+	    SLOT *sp = &o_slots[(o_next+i) % o_nslots];
+
+	    sp->ob.len = 0;
+	    sp->ready = 0;
+	}
+	o_next += n;
+	pthread_cond_broadcast(&o_cv_space);
+    }
+    pthread_mutex_unlock(&o_mtx);
+    return NULL;
+}
+
+
+int
+output_start(int threaded,
+	     int ordered,
+	     size_t window) {
+    o_tty = isatty(1);
+    o_ordered = ordered;
+    o_seq = 0;
+
+    if (!threaded)
+	return 0;
+
+    o_nslots = window > 0 ? window : 4096;
+    o_slots = calloc(o_nslots, sizeof(*o_slots));
+    if (!o_slots)
+	return -1;
+
+    o_next = o_arrival = 0;
+    o_stop = 0;
+    if (pthread_create(&o_tid, NULL, writer, NULL) != 0) {
+	free(o_slots);
+	o_slots = NULL;
+	return -1;
+    }
+
+    o_threaded = 1;
+    return 0;
+}
+
+/* Called from the traversal thread only */
+uint64_t
+output_seq(void) {
+    return o_seq++;
+}
+
+
+/*
+ * Hand over a record. The buffer contents are taken over and the
+ * buffer is emptied (and may be replaced by a recycled one).
+ */
+int
+output_submit(uint64_t seq,
+	      OBUF *bp) {
+    SLOT *sp;
+    OBUF tmp;
+
+    if (!o_threaded) {
+	if (bp->len > 0) {
+	    obuf_write(&o_buf, bp->buf, bp->len);
+	    bp->len = 0;
+	}
+	if (o_tty || o_buf.len >= OUTBUF_FLUSH)
+	    return output_flush();
+	return 0;
+    }
+
+    pthread_mutex_lock(&o_mtx);
+    if (!o_ordered)
+	seq = o_arrival++;
+
+    while (seq >= o_next+o_nslots)
+	pthread_cond_wait(&o_cv_space, &o_mtx);
+
+    sp = &o_slots[seq % o_nslots];
+    tmp = sp->ob;
+    sp->ob = *bp;
+    *bp = tmp;
+    bp->len = 0;
+    sp->ready = 1;
+
+    if (seq == o_next)
+	pthread_cond_signal(&o_cv_ready);
+    pthread_mutex_unlock(&o_mtx);
+    return 0;
+}
+
+
+int
+output_flush(void) {
+    int rc = 0;
+
+    if (o_buf.len > 0) {
+	fflush(stdout);
+	rc = write_all(1, o_buf.buf, o_buf.len);
+	o_buf.len = 0;
+    }
+    return rc;
+}
+
+
+/*
+ * Wait for all submitted records to be written. No more records may be
+ * submitted after this.
+ */
+int
+output_stop(void) {
+    size_t i;
+
+    if (o_threaded) {
+	pthread_mutex_lock(&o_mtx);
+	o_stop = 1;
+	pthread_cond_signal(&o_cv_ready);
+	pthread_mutex_unlock(&o_mtx);
+
+	pthread_join(o_tid, NULL);
+
+	for (i = 0; i < o_nslots; i++)
+	    obuf_free(&o_slots[i].ob);
+	free(o_slots);
+	o_slots = NULL;
+	o_threaded = 0;
+
+	if (o_error) {
+	    errno = o_error;
+	    return -1;
+	}
+    }
+
+    return output_flush();
+}
@@ -0,0 +1,112 @@
+/*
+ * output.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+} OBUF;
+
+extern int
+obuf_grow(OBUF *bp,
+	  size_t len);
+
+extern void
+obuf_write(OBUF *bp,
+	   const void *p,
+	   size_t len);
+
+extern void
+obuf_putc(OBUF *bp,
+	  int c);
+
+extern void
+obuf_puts(OBUF *bp,
+	  const char *s);
+
+extern void
+obuf_printf(OBUF *bp,
+	    const char *fmt,
+	    ...);
+
+extern void
+obuf_putu64(OBUF *bp,
+	    uint64_t v);
+
+extern void
+obuf_puthex(OBUF *bp,
+	    uint64_t v,
+	    int width);
+
+extern void
+obuf_puthexbytes(OBUF *bp,
+		 const void *p,
+		 size_t len);
+
+extern void
+obuf_putjson(OBUF *bp,
+	     const char *s);
+
+extern void
+obuf_putcsv(OBUF *bp,
+	    const char *s);
+
+extern void
+obuf_free(OBUF *bp);
+
+
+extern int
+output_start(int threaded,
+	     int ordered,
+	     size_t window);
+
+extern uint64_t
+output_seq(void);
+
+extern int
+output_submit(uint64_t seq,
+	      OBUF *bp);
+
+extern int
+output_flush(void);
+
+extern int
+output_stop(void);
+
+#endif
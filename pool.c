@@ -0,0 +1,397 @@
+/*
+ * pool.c - Worker threads processing directory entries
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "pool.h"
+
+/*
+ * The traversal thread queues entries in a bounded FIFO and the
+ * workers process them and submit the output records (tagged with the
+ * sequence number the entry got at traversal time) to the output
+ * stage. If a job fails the remaining jobs are skipped, but they still
+ * submit their (empty) records so the output stage can complete.
+ */
+
+typedef struct {
+    uint64_t seq;
+    char *path;
+    struct stat sb;
+    int type;
+    struct FTW ftw;
+    const void *arg;		/* Passed on as is */
+} JOB;
+
+#define JOBS_PER_THREAD 256
+
+
+static POOL_FN p_fn = NULL;
+static pthread_t *p_tids = NULL;
+static int p_nthreads = 0;
+
+static pthread_mutex_t p_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t p_cv_jobs = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t p_cv_space = PTHREAD_COND_INITIALIZER;
+static JOB *p_jobs = NULL;
+static size_t p_size = 0;
+static size_t p_head = 0;
+static size_t p_len = 0;
+static int p_stop = 0;
+static int p_failed = 0;
+
+/*
+ * With the adaptive controller all threads are started, but only
+ * p_limit of them may work on a job at a time. The controller samples
+ * the completed jobs per second and the mean job latency and adjusts
+ * the limit (AIMD):
+ *
+ *  - No backlog: the traversal is the bottleneck, hold.
+ *  - Throughput dropped, or latency grew without more throughput:
+ *    multiplicative decrease.
+ *  - Otherwise additive increase (by sqrt(limit) to ramp up faster).
+ *
+ * The latency baseline is the lowest mean latency seen recently, it is
+ * reset now and then in case the storage got slower for good.
+ */
+#define ADAPT_DECREASE		0.75
+#define ADAPT_TOLERANCE		2.0	/* Latency vs baseline before we back off */
+#define ADAPT_GAIN		1.05	/* Throughput change that counts as real */
+#define ADAPT_RESET		30	/* Intervals between baseline resets */
+
+static int p_limit = 0;		/* 0 = unlimited */
+static int p_active = 0;
+static pthread_cond_t p_cv_limit = PTHREAD_COND_INITIALIZER;	/* Held back by p_limit */
+static uint64_t p_done = 0;
+static uint64_t p_busy_ns = 0;
+
+static pthread_t p_ctl_tid;
+static int p_ctl_running = 0;
+static pthread_cond_t p_cv_ctl = PTHREAD_COND_INITIALIZER;
+static int p_ctl_interval = 0;
+static const char *p_ctl_log = NULL;
+
+
+
+static void *
+worker(void *arg) {
+    OBUF ob;
+    JOB job;
+    int rc, timed;
+    uint64_t t0;
+
+    (void) arg;
+    memset(&ob, 0, sizeof(ob));
+
+    while (1) {
+	pthread_mutex_lock(&p_mtx);
+	while (p_len == 0 ? !p_stop : p_limit > 0 && p_active >= p_limit)
+	    pthread_cond_wait(p_len == 0 ? &p_cv_jobs : &p_cv_limit, &p_mtx);
+	if (p_len == 0) {
+	    pthread_mutex_unlock(&p_mtx);
+	    break;
+	}
+
+	job = p_jobs[p_head];
+	p_head = (p_head+1) % p_size;
+	p_len--;
+	p_active++;
+	pthread_cond_signal(&p_cv_space);
+	rc = p_failed;
+	timed = p_ctl_running;
+	pthread_mutex_unlock(&p_mtx);
+
+	t0 = timed ? metrics_now() : 0;
+	if (!rc)
+	    rc = p_fn(&ob, job.path, &job.sb, job.type, &job.ftw, job.arg);
+
+	pthread_mutex_lock(&p_mtx);
+	if (rc != 0)
+	    p_failed = 1;
+	p_active--;
+	p_done++;
+	if (timed)
+	    p_busy_ns += metrics_now()-t0;
+	if (p_limit > 0 && p_len > 0)
+	    pthread_cond_signal(&p_cv_limit);
+	else if (p_limit > 0 && p_stop)
+	    pthread_cond_broadcast(&p_cv_limit);
+	pthread_mutex_unlock(&p_mtx);
+
+	output_submit(job.seq, &ob);
+	free(job.path);
+    }
+
+    obuf_free(&ob);
+    return NULL;
+}
+
+
+int
+pool_start(int nthreads,
+	   POOL_FN fn) {
+    int i;
+
+    p_fn = fn;
+    p_size = nthreads*JOBS_PER_THREAD;
+    p_jobs = calloc(p_size, sizeof(*p_jobs));
+    p_tids = calloc(nthreads, sizeof(*p_tids));
+    if (!p_jobs || !p_tids)
+	return -1;
+
+    p_head = p_len = 0;
+    p_stop = p_failed = 0;
+    p_limit = p_active = 0;
+    p_done = p_busy_ns = 0;
+
+    for (i = 0; i < nthreads; i++) {
+	if (pthread_create(&p_tids[i], NULL, worker, NULL) != 0)
+	    break;
+	p_nthreads++;
+    }
+
+    return p_nthreads > 0 ? 0 : -1;
+}
+
+
+static void *
+controller(void *arg) {
+    struct timespec ts;
+    uint64_t now, last, done, last_done = 0, busy, last_busy = 0;
+    double x, r, x_prev = 0, r_min = 0;
+    int limit, nlimit, n = 0, backlog;
+    const char *why;
+
+    (void) arg;
+    last = metrics_now();
+
+    pthread_mutex_lock(&p_mtx);
+    while (p_ctl_running) {
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += p_ctl_interval/1000;
+	ts.tv_nsec += (p_ctl_interval%1000)*1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000L;
+	}
+	if (pthread_cond_timedwait(&p_cv_ctl, &p_mtx, &ts) == 0 || !p_ctl_running)
+	    continue;
+
+	now = metrics_now();
+	done = p_done-last_done;
+	busy = p_busy_ns-last_busy;
+	last_done = p_done;
+	last_busy = p_busy_ns;
+	backlog = p_len > 0;
+	limit = p_limit;
+
+	if (done == 0 || now <= last) {
+	    last = now;
+	    continue;
+	}
+	x = done*1e9/(now-last);
+	r = (double) busy/done;
+	last = now;
+
+	if (r_min == 0 || r < r_min || ++n % ADAPT_RESET == 0)
+	    r_min = r;
+
+	nlimit = limit;
+	if (!backlog)
+	    why = "no backlog";
+	else if (x_prev > 0 && x*ADAPT_GAIN < x_prev) {
+	    nlimit = limit*ADAPT_DECREASE;
+	    why = "throughput dropped";
+	} else if (r > ADAPT_TOLERANCE*r_min && x < x_prev*ADAPT_GAIN) {
+	    nlimit = limit*ADAPT_DECREASE;
+	    why = "latency up";
+	} else {
+	    nlimit = limit+(int) sqrt((double) limit);
+	    why = "throughput up";
+	}
+
+	if (nlimit < 1)
+	    nlimit = 1;
+	if (nlimit > p_nthreads)
+	    nlimit = p_nthreads;
+
+	if (p_ctl_log && nlimit != limit)
+	    fprintf(stderr, "%s: Info: Concurrency %d -> %d: %s (%.0f entries/s, latency %.3f ms, baseline %.3f ms)\n",
+		    p_ctl_log, limit, nlimit, why, x, r/1e6, r_min/1e6);
+
+	if (nlimit > limit)
+	    pthread_cond_broadcast(&p_cv_limit);
+	p_limit = nlimit;
+	x_prev = x;
+    }
+    pthread_mutex_unlock(&p_mtx);
+    return NULL;
+}
+
+/*
+ * Let a controller adjust the number of concurrently working threads
+ * (between 1 and the number started) every interval ms, starting at
+ * initial. Decisions are logged to stderr, prefixed by logname, unless
+ * it is NULL.
+ */
+int
+pool_adapt(int initial,
+	   int interval,
+	   const char *logname) {
+    if (!p_nthreads) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    pthread_mutex_lock(&p_mtx);
+    p_limit = initial < 1 ? 1 : initial > p_nthreads ? p_nthreads : initial;
+    p_ctl_interval = interval;
+    p_ctl_log = logname;
+    p_ctl_running = 1;
+    if (pthread_create(&p_ctl_tid, NULL, controller, NULL) != 0) {
+	p_ctl_running = 0;
+	p_limit = 0;
+	pthread_mutex_unlock(&p_mtx);
+	return -1;
+    }
+    pthread_mutex_unlock(&p_mtx);
+    return 0;
+}
+
+/* Current concurrency limit */
+int
+pool_limit(void) {
+    int limit;
+
+    pthread_mutex_lock(&p_mtx);
+    limit = p_limit ? p_limit : p_nthreads;
+    pthread_mutex_unlock(&p_mtx);
+    return limit;
+}
+
+
+/*
+ * Queue an entry, blocks while the queue is full. Returns -1 if a
+ * previous job has failed (and the traversal should be stopped).
+ */
+int
+pool_submit(uint64_t seq,
+	    const char *path,
+	    const struct stat *sp,
+	    int type,
+	    struct FTW *fp,
+	    const void *arg) {
+    JOB *jp;
+    char *p;
+    int rc;
+
+    p = strdup(path);
+    if (!p) {
+	OBUF ob;
+
+	/* The output stage still needs a record for this entry */
+	memset(&ob, 0, sizeof(ob));
+	output_submit(seq, &ob);
+	return -1;
+    }
+
+    pthread_mutex_lock(&p_mtx);
+    while (p_len == p_size)
+	pthread_cond_wait(&p_cv_space, &p_mtx);
+
+    jp = &p_jobs[(p_head+p_len) % p_size];
+    jp->seq = seq;
+    jp->path = p;
+    jp->sb = *sp;
+    jp->type = type;
+    jp->ftw = *fp;
+    jp->arg = arg;
+    p_len++;
+
+    pthread_cond_signal(&p_cv_jobs);
+    rc = p_failed ? -1 : 0;
+    pthread_mutex_unlock(&p_mtx);
+
+    return rc;
+}
+
+
+/*
+ * Wait for all queued jobs to complete and stop the workers
+ */
+int
+pool_stop(void) {
+    int i;
+
+    if (!p_nthreads)
+	return 0;
+
+    pthread_mutex_lock(&p_mtx);
+    p_stop = 1;
+    pthread_cond_broadcast(&p_cv_jobs);
+    pthread_cond_broadcast(&p_cv_limit);
+    pthread_mutex_unlock(&p_mtx);
+
+    for (i = 0; i < p_nthreads; i++)
+	pthread_join(p_tids[i], NULL);
+
+    /* Keeps adapting while the queue drains */
+    if (p_ctl_running) {
+	pthread_mutex_lock(&p_mtx);
+	p_ctl_running = 0;
+	pthread_cond_signal(&p_cv_ctl);
+	pthread_mutex_unlock(&p_mtx);
+	pthread_join(p_ctl_tid, NULL);
+    }
+
+    free(p_tids);
+    p_tids = NULL;
+    free(p_jobs);
+    p_jobs = NULL;
+    p_nthreads = 0;
+
+    return p_failed ? -1 : 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * pool.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef POOL_H
+#define POOL_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ftw.h>
+
+#include "output.h"
+
+/* Process one entry, writing the output record to bp */
+typedef int (*POOL_FN)(OBUF *bp,
+		       const char *path,
+		       const struct stat *sp,
+		       int type,
+		       struct FTW *fp,
+		       const void *arg);
+
+extern int
+pool_start(int nthreads,
+	   POOL_FN fn);
+
+extern int
+pool_adapt(int initial,
+	   int interval,
+	   const char *logname);
+
+extern int
+pool_limit(void);
+
+extern int
+pool_submit(uint64_t seq,
+	    const char *path,
+	    const struct stat *sp,
+	    int type,
+	    struct FTW *fp,
+	    const void *arg);
+
+extern int
+pool_stop(void);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * prefetch.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "backend.h"
+#include "prefetch.h"
+
+/*
+ * Metadata prefetch, for --prefetch. The traversal queues the entries
+ * after the one it is at, and the helper threads lstat() them, read
+ * their attribute and the start of any subdirectories only to get the
+ * metadata into the kernel caches before the walker (or the workers)
+ * get to them. The calls bypass the metrics and fault injection of the
+ * backend.
+ *
+ * The queue is bounded. When it is full the traversal does not wait
+ * but queues the following entries as it advances, so the helpers
+ * always work on the next ones.
+ */
+
+static pthread_t *pf_tids = NULL;
+static int pf_nthreads = 0;
+static const char *pf_xattr = NULL;
+
+static pthread_mutex_t pf_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_cv = PTHREAD_COND_INITIALIZER;
+static char **pf_queue = NULL;
+static size_t pf_size = 0;
+static size_t pf_head = 0;
+static size_t pf_count = 0;
+static int pf_stop = 0;
+
+static uint64_t pf_queued = 0;
+static uint64_t pf_dropped = 0;
+
+
+static void *
+pf_worker(void *arg) {
+    unsigned char buf[256];
+    struct stat sb;
+    char *path;
+    DIR *dp;
+
+    (void) arg;
+    for (;;) {
+	pthread_mutex_lock(&pf_mtx);
+	while (pf_count == 0 && !pf_stop)
+	    pthread_cond_wait(&pf_cv, &pf_mtx);
+	if (pf_stop) {
+	    pthread_mutex_unlock(&pf_mtx);
+	    break;
+	}
+	path = pf_queue[pf_head];
+	pf_head = (pf_head+1) % pf_size;
+	pf_count--;
+	pthread_mutex_unlock(&pf_mtx);
+
+	if (lstat(path, &sb) == 0) {
+	    (void) backend->get(path, pf_xattr, buf, sizeof(buf));
+	    if (S_ISDIR(sb.st_mode) && (dp = opendir(path)) != NULL) {
+		(void) readdir(dp);
+		closedir(dp);
+	    }
+	}
+	free(path);
+    }
+    return NULL;
+}
+
+
+/* Queue an entry, returns -1 if the queue is full (try again later) */
+int
+prefetch_add(const char *dir,
+	     const char *name) {
+    size_t dlen = strlen(dir);
+    char *path;
+
+    pthread_mutex_lock(&pf_mtx);
+    if (pf_count >= pf_size) {
+	pthread_mutex_unlock(&pf_mtx);
+	return -1;
+    }
+
+    path = malloc(dlen+strlen(name)+2);
+    if (!path) {
+	pf_dropped++;
+	pthread_mutex_unlock(&pf_mtx);
+	return 0;
+    }
+    sprintf(path, "%s%s%s", dir, dlen > 0 && dir[dlen-1] == '/' ? "" : "/", name);
+    pf_queue[(pf_head+pf_count) % pf_size] = path;
+    pf_count++;
+    pf_queued++;
+    pthread_cond_signal(&pf_cv);
+    pthread_mutex_unlock(&pf_mtx);
+    return 0;
+}
+
+
+int
+prefetch_start(int nthreads,
+	       int depth,
+	       const char *xattr) {
+    int i;
+
+    pf_queue = calloc(depth, sizeof(char *));
+    pf_tids = calloc(nthreads, sizeof(pthread_t));
+    if (!pf_queue || !pf_tids)
+	return -1;
+    pf_size = depth;
+    pf_xattr = xattr;
+
+    for (i = 0; i < nthreads; i++) {
+	errno = pthread_create(&pf_tids[i], NULL, pf_worker, NULL);
+	if (errno != 0) {
+	    prefetch_stop(NULL, NULL);
+	    return -1;
+	}
+	pf_nthreads++;
+    }
+    return 0;
+}
+
+/* Stop the helpers, what is still queued is of no use any more */
+int
+prefetch_stop(uint64_t *queued,
+	      uint64_t *dropped) {
+    int i;
+
+    pthread_mutex_lock(&pf_mtx);
+    pf_stop = 1;
+    pthread_cond_broadcast(&pf_cv);
+    pthread_mutex_unlock(&pf_mtx);
+
+    for (i = 0; i < pf_nthreads; i++)
+	pthread_join(pf_tids[i], NULL);
+    pf_nthreads = 0;
+
+    for (; pf_count > 0; pf_count--) {
+	free(pf_queue[pf_head]);
+	pf_head = (pf_head+1) % pf_size;
+    }
+
+    free(pf_tids);
+    pf_tids = NULL;
+    free(pf_queue);
+    pf_queue = NULL;
+    pf_size = 0;
+
+    if (queued)
+	*queued = pf_queued;
+    if (dropped)
+	*dropped = pf_dropped;
+    return 0;
+}
@@ -0,0 +1,681 @@
+/*
+ * rules.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <ftw.h>
+
+#include "rules.h"
+
+/*
+ * A rule file maps path patterns to attribute operations, one rule
+ * per line:
+ *
+ *   # Comment
+ *   <pattern> [type=<fdl>] <op>...
+ *
+ * Patterns are relative to the path given on the command line and
+ * split into '/' separated components, each a literal name, an
+ * fnmatch() glob or "**" (zero or more components). A pattern without
+ * a '/' (except at the end) matches at any depth, a leading '/'
+ * anchors it at the top and a trailing '/' only matches directories.
+ * "/" alone matches the top itself. The operations are parsed by the
+ * caller.
+ *
+ * All patterns are compiled into one trie of components (an NFA where
+ * the "**" nodes loop on any name). The sets of trie nodes reached are
+ * interned as states (a DFA built lazily) with the combined operations
+ * of the rules ending there, in rule file order, precomputed for each
+ * file type. The walker keeps the state of each directory and steps it
+ * by one name per entry, so matching costs the same at any depth and
+ * nothing is matched below a dead state.
+ *
+ * Stepping is not thread safe, but the states are never changed or
+ * freed until rules_free() so their operations may be used anywhere.
+ */
+
+#define RULES_FILE	0
+#define RULES_DIR	1
+#define RULES_LINK	2
+#define RULES_NTYPES	3
+
+#define TYPES_ALL	((1<<RULES_NTYPES)-1)
+
+#define FNV_OFFSET	2166136261U
+#define FNV_PRIME	16777619U
+
+typedef struct {
+    char *name;			/* Component (NULL at the top) */
+    int star;			/* Is a "**" node */
+    int star_child;		/* The "**" child, or -1 */
+    int *globs;			/* Children with glob components */
+    int nglobs;
+    unsigned int mark;
+} RNODE;
+
+/* Children with literal components, hashed by parent and name */
+typedef struct ledge {
+    struct ledge *next;
+    int parent;
+    int child;
+    char name[];
+} LEDGE;
+
+typedef struct {
+    int node;
+    int types;
+    ATTROPS ops;
+} RULE;
+
+struct rstate {
+    RULES *rules;
+    struct rstate *next;
+    uint32_t hash;
+    ATTROPS ops[RULES_NTYPES];
+    int n;
+    int nodes[];		/* Sorted, none for the dead state */
+};
+
+struct rules {
+    ATTROPS base;
+    RNODE *nodes;
+    int nnodes;
+    int nodes_size;
+    LEDGE **edges;
+    size_t edges_size;
+    size_t nedges;
+    RULE *rules;
+    int nrules;
+    int rules_size;
+    RSTATE **states;
+    size_t states_size;
+    size_t nstates;
+    unsigned int stamp;
+    int *set;			/* Nodes reached, for rules_step() */
+    int nset;
+    const RSTATE *start;
+};
+
+
+
+/* Apply sp after dp, giving the combined operations in dp */
+void
+attrops_apply(ATTROPS *dp,
+	      const ATTROPS *sp) {
+    dp->andattribs &= sp->andattribs;
+    dp->orattribs = (dp->orattribs & sp->andattribs) | sp->orattribs;
+    if (sp->version)
+	dp->version = sp->version;
+    if (sp->repair)
+	dp->repair = sp->repair;
+}
+
+
+static uint32_t
+edge_hash(int parent,
+	  const char *name) {
+    uint32_t h = FNV_OFFSET;
+
+    h = (h ^ (uint32_t) parent) * FNV_PRIME;
+    while (*name)
+	h = (h ^ (unsigned char) *name++) * FNV_PRIME;
+    return h;
+}
+
+static int
+edge_find(RULES *rp,
+	  int parent,
+	  const char *name) {
+    LEDGE *ep;
+
+    if (!rp->edges_size)
+	return -1;
+
+    for (ep = rp->edges[edge_hash(parent, name) % rp->edges_size]; ep; ep = ep->next)
+	if (ep->parent == parent && strcmp(ep->name, name) == 0)
+	    return ep->child;
+    return -1;
+}
+
+static int
+edge_add(RULES *rp,
+	 int parent,
+	 const char *name,
+	 int child) {
+    LEDGE *ep, **nv;
+    size_t i, nsize, h;
+
+    if (rp->nedges >= rp->edges_size) {
+	nsize = rp->edges_size ? rp->edges_size*2 : 64;
+	nv = calloc(nsize, sizeof(*nv));
+	if (!nv)
+	    return -1;
+	for (i = 0; i < rp->edges_size; i++)
+	    while ((ep = rp->edges[i]) != NULL) {
+		rp->edges[i] = ep->next;
+		h = edge_hash(ep->parent, ep->name) % nsize;
+		ep->next = nv[h];
+		nv[h] = ep;
+	    }
+	free(rp->edges);
+	rp->edges = nv;
+	rp->edges_size = nsize;
+    }
+
+    ep = malloc(sizeof(*ep)+strlen(name)+1);
+    if (!ep)
+	return -1;
+    ep->parent = parent;
+    ep->child = child;
+    strcpy(ep->name, name);
+    h = edge_hash(parent, name) % rp->edges_size;
+    ep->next = rp->edges[h];
+    rp->edges[h] = ep;
+    rp->nedges++;
+    return 0;
+}
+
+
+static int
+node_new(RULES *rp,
+	 const char *name) {
+    RNODE *np;
+
+    if (rp->nnodes >= rp->nodes_size) {
+	np = realloc(rp->nodes, (rp->nodes_size+64)*sizeof(*np));
+	if (!np)
+	    return -1;
+	rp->nodes = np;
+	rp->nodes_size += 64;
+    }
+
+    np = &rp->nodes[rp->nnodes];
+    memset(np, 0, sizeof(*np));
+    np->star_child = -1;
+    if (name) {
+	np->name = strdup(name);
+	if (!np->name)
+	    return -1;
+	np->star = (strcmp(name, "**") == 0);
+    }
+    return rp->nnodes++;
+}
+
+/* Find or add the child of a node for a pattern component */
+static int
+node_child(RULES *rp,
+	   int parent,
+	   const char *name) {
+    int i, c, *gv;
+    RNODE *np;
+
+    if (strcmp(name, "**") == 0) {
+	if ((c = rp->nodes[parent].star_child) >= 0)
+	    return c;
+	if ((c = node_new(rp, name)) >= 0)
+	    rp->nodes[parent].star_child = c;
+	return c;
+    }
+
+    if (strpbrk(name, "*?[\\")) {
+	np = &rp->nodes[parent];
+	for (i = 0; i < np->nglobs; i++)
+	    if (strcmp(rp->nodes[np->globs[i]].name, name) == 0)
+		return np->globs[i];
+
+	if ((c = node_new(rp, name)) < 0)
+	    return -1;
+	np = &rp->nodes[parent];
+	gv = realloc(np->globs, (np->nglobs+1)*sizeof(*gv));
+	if (!gv)
+	    return -1;
+	gv[np->nglobs++] = c;
+	np->globs = gv;
+	return c;
+    }
+
+    if ((c = edge_find(rp, parent, name)) >= 0)
+	return c;
+    if ((c = node_new(rp, name)) < 0 || edge_add(rp, parent, name, c) < 0)
+	return -1;
+    return c;
+}
+
+
+static int
+rule_add(RULES *rp,
+	 char *pattern,
+	 int types,
+	 const ATTROPS *op) {
+    RULE *rv;
+    char *s, *e;
+    size_t len;
+    int node = 0;
+
+    len = strlen(pattern);
+    if (len > 1 && pattern[len-1] == '/') {
+	pattern[--len] = '\0';
+	types &= 1<<RULES_DIR;
+    }
+
+    if (*pattern == '/')
+	++pattern;
+    else if (!strchr(pattern, '/') && (node = node_child(rp, 0, "**")) < 0)
+	return -1;
+
+    for (s = pattern; *s; s = e) {
+	e = strchr(s, '/');
+	if (e)
+	    *e++ = '\0';
+	else
+	    e = s+strlen(s);
+
+	if (!*s || strcmp(s, ".") == 0)
+	    continue;
+	if ((node = node_child(rp, node, s)) < 0)
+	    return -1;
+    }
+
+    if (rp->nrules >= rp->rules_size) {
+	rv = realloc(rp->rules, (rp->rules_size+64)*sizeof(*rv));
+	if (!rv)
+	    return -1;
+	rp->rules = rv;
+	rp->rules_size += 64;
+    }
+    rv = &rp->rules[rp->nrules++];
+    rv->node = node;
+    rv->types = types;
+    rv->ops = *op;
+    return 0;
+}
+
+
+/* Add a node to the set being built, with the "**" nodes reachable without a name */
+static void
+set_add(RULES *rp,
+	int node) {
+    while (node >= 0 && rp->nodes[node].mark != rp->stamp) {
+	rp->nodes[node].mark = rp->stamp;
+	rp->set[rp->nset++] = node;
+	node = rp->nodes[node].star_child;
+    }
+}
+
+static int
+int_cmp(const void *a,
+	const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+/* Find or create the state for the set built (the nodes in it are marked) */
+static const RSTATE *
+set_intern(RULES *rp) {
+    RSTATE *sp, **nv;
+    uint32_t h = FNV_OFFSET;
+    size_t i, nsize;
+    int t;
+
+    qsort(rp->set, rp->nset, sizeof(int), int_cmp);
+    for (i = 0; i < (size_t) rp->nset; i++)
+	h = (h ^ (uint32_t) rp->set[i]) * FNV_PRIME;
+
+    if (rp->states_size)
+	for (sp = rp->states[h % rp->states_size]; sp; sp = sp->next)
+	    if (sp->hash == h && sp->n == rp->nset &&
+		memcmp(sp->nodes, rp->set, rp->nset*sizeof(int)) == 0)
+		return sp;
+
+    if (rp->nstates >= rp->states_size) {
+	nsize = rp->states_size ? rp->states_size*2 : 64;
+	nv = calloc(nsize, sizeof(*nv));
+	if (!nv)
+	    return NULL;
+	for (i = 0; i < rp->states_size; i++)
+	    while ((sp = rp->states[i]) != NULL) {
+		rp->states[i] = sp->next;
+		sp->next = nv[sp->hash % nsize];
+		nv[sp->hash % nsize] = sp;
+	    }
+	free(rp->states);
+	rp->states = nv;
+	rp->states_size = nsize;
+    }
+
+    sp = malloc(sizeof(*sp)+rp->nset*sizeof(int));
+    if (!sp)
+	return NULL;
+    sp->rules = rp;
+    sp->hash = h;
+    sp->n = rp->nset;
+    memcpy(sp->nodes, rp->set, rp->nset*sizeof(int));
+
+    for (t = 0; t < RULES_NTYPES; t++)
+	sp->ops[t] = rp->base;
+    for (i = 0; i < (size_t) rp->nrules; i++)
+	if (rp->nodes[rp->rules[i].node].mark == rp->stamp)
+	    for (t = 0; t < RULES_NTYPES; t++)
+		if (rp->rules[i].types & (1<<t))
+		    attrops_apply(&sp->ops[t], &rp->rules[i].ops);
+
+    sp->next = rp->states[h % rp->states_size];
+    rp->states[h % rp->states_size] = sp;
+    rp->nstates++;
+    return sp;
+}
+
+
+/* The state of the top (the path given) */
+const RSTATE *
+rules_start(RULES *rp) {
+    return rp->start;
+}
+
+/*
+ * The state of an entry, from the state of the directory it is in.
+ * Returns NULL (ENOMEM) if we run out of memory.
+ */
+const RSTATE *
+rules_step(const RSTATE *sp,
+	   const char *name) {
+    RULES *rp;
+    RNODE *np;
+    int i, j, c;
+
+    if (!sp) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    /* Nothing can match below a dead state */
+    if (sp->n == 0)
+	return sp;
+
+    rp = sp->rules;
+    rp->stamp++;
+    rp->nset = 0;
+    for (i = 0; i < sp->n; i++) {
+	np = &rp->nodes[sp->nodes[i]];
+	if (np->star)
+	    set_add(rp, sp->nodes[i]);
+	if ((c = edge_find(rp, sp->nodes[i], name)) >= 0)
+	    set_add(rp, c);
+	for (j = 0; j < np->nglobs; j++)
+	    if (fnmatch(rp->nodes[np->globs[j]].name, name, 0) == 0)
+		set_add(rp, np->globs[j]);
+    }
+
+    return set_intern(rp);
+}
+
+/* The state of a path relative to the top, one component at a time */
+const RSTATE *
+rules_match(RULES *rp,
+	    const char *relpath) {
+    const RSTATE *sp = rp->start;
+    char *buf, *s, *e;
+
+    buf = strdup(relpath);
+    if (!buf)
+	return NULL;
+
+    for (s = buf; sp && *s; s = e) {
+	e = strchr(s, '/');
+	if (e)
+	    *e++ = '\0';
+	else
+	    e = s+strlen(s);
+	if (*s)
+	    sp = rules_step(sp, s);
+    }
+
+    free(buf);
+    return sp;
+}
+
+/* The combined operations for an entry of some type (FTW_*) */
+const ATTROPS *
+rules_ops(const RSTATE *sp,
+	  int type) {
+    if (!sp)
+	return NULL;
+
+    switch (type) {
+    case FTW_D:
+    case FTW_DP:
+    case FTW_DNR:
+	return &sp->ops[RULES_DIR];
+    case FTW_SL:
+    case FTW_SLN:
+	return &sp->ops[RULES_LINK];
+    default:
+	return &sp->ops[RULES_FILE];
+    }
+}
+
+/* Number of rules, and of states created so far */
+int
+rules_count(RULES *rp,
+	    int *states) {
+    if (states)
+	*states = rp->nstates;
+    return rp->nrules;
+}
+
+
+/* Next whitespace separated (or double quoted) token */
+static char *
+token(char **bpp) {
+    char *s, *bp = *bpp;
+
+    while (isspace((unsigned char) *bp))
+	++bp;
+    if (!*bp)
+	return NULL;
+
+    if (*bp == '"') {
+	s = ++bp;
+	while (*bp && *bp != '"')
+	    ++bp;
+    } else {
+	s = bp;
+	while (*bp && !isspace((unsigned char) *bp))
+	    ++bp;
+    }
+    if (*bp)
+	*bp++ = '\0';
+
+    *bpp = bp;
+    return s;
+}
+
+/*
+ * Load and compile a rule file. The operations of all matching rules
+ * are applied after base. On syntax errors NULL is returned with errno
+ * EINVAL and *line set to the line number, else *line is 0.
+ */
+RULES *
+rules_load(const char *path,
+	   const ATTROPS *base,
+	   RULES_OPFN opfn,
+	   int *line) {
+    FILE *fp;
+    RULES *rp = NULL;
+    ATTROPS op;
+    char buf[4096], *bp, *pattern, *tok, *s;
+    size_t len;
+    int types, nops, e;
+
+
+    *line = 0;
+    fp = fopen(path, "r");
+    if (!fp)
+	return NULL;
+
+    rp = calloc(1, sizeof(*rp));
+    if (!rp)
+	goto Fail;
+    rp->base = *base;
+    if (node_new(rp, NULL) < 0)
+	goto Fail;
+
+    while (fgets(buf, sizeof(buf), fp)) {
+	++*line;
+	len = strlen(buf);
+	if (len == sizeof(buf)-1 && buf[len-1] != '\n' && !feof(fp))
+	    goto Invalid;
+
+	bp = buf;
+	pattern = token(&bp);
+	if (!pattern || *pattern == '#')
+	    continue;
+
+	types = TYPES_ALL;
+	op.andattribs = 0xFFFF;
+	op.orattribs = 0;
+	op.version = 0;
+	op.repair = 0;
+	nops = 0;
+
+	while ((tok = token(&bp)) != NULL && *tok != '#') {
+	    if (strncmp(tok, "type=", 5) == 0) {
+		types = 0;
+		for (s = tok+5; *s; s++)
+		    switch (*s) {
+		    case 'f':
+			types |= 1<<RULES_FILE;
+			break;
+		    case 'd':
+			types |= 1<<RULES_DIR;
+			break;
+		    case 'l':
+			types |= 1<<RULES_LINK;
+			break;
+		    case ',':
+			break;
+		    default:
+			goto Invalid;
+		    }
+		if (!types)
+		    goto Invalid;
+	    } else if (opfn(&op, tok) < 0)
+		goto Invalid;
+	    else
+		nops++;
+	}
+	if (!*pattern || !nops)
+	    goto Invalid;
+
+	if (rule_add(rp, pattern, types, &op) < 0)
+	    goto Fail;
+    }
+    if (ferror(fp))
+	goto Fail;
+    fclose(fp);
+    fp = NULL;
+    *line = 0;
+
+    rp->set = malloc(rp->nnodes*sizeof(int));
+    if (!rp->set)
+	goto Fail;
+    rp->stamp++;
+    rp->nset = 0;
+    set_add(rp, 0);
+    rp->start = set_intern(rp);
+    if (!rp->start)
+	goto Fail;
+    return rp;
+
+ Invalid:
+    fclose(fp);
+    rules_free(rp);
+    errno = EINVAL;
+    return NULL;
+
+ Fail:
+    e = errno;
+    if (fp)
+	fclose(fp);
+    rules_free(rp);
+    *line = 0;
+    errno = e;
+    return NULL;
+}
+
+
+void
+rules_free(RULES *rp) {
+    LEDGE *ep;
+    RSTATE *sp;
+    size_t i;
+    int n;
+
+    if (!rp)
+	return;
+
+    for (n = 0; n < rp->nnodes; n++) {
+	free(rp->nodes[n].name);
+	free(rp->nodes[n].globs);
+    }
+    free(rp->nodes);
+
+    for (i = 0; i < rp->edges_size; i++)
+	while ((ep = rp->edges[i]) != NULL) {
+	    rp->edges[i] = ep->next;
+	    free(ep);
+	}
+    free(rp->edges);
+
+    for (i = 0; i < rp->states_size; i++)
+	while ((sp = rp->states[i]) != NULL) {
+	    rp->states[i] = sp->next;
+	    free(sp);
+	}
+    free(rp->states);
+
+    free(rp->rules);
+    free(rp->set);
+    free(rp);
+}
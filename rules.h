@@ -0,0 +1,87 @@
+/*
+ * rules.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef RULES_H
+#define RULES_H 1
+
+#include <stdint.h>
+
+/* Attribute operations: attribs = (attribs & andattribs) | orattribs */
+typedef struct {
+    uint16_t andattribs;
+    uint16_t orattribs;
+    int version;		/* 0 = keep */
+    int repair;
+} ATTROPS;
+
+typedef struct rules RULES;
+typedef struct rstate RSTATE;
+
+/* Parse one operation token from a rule into op, -1 if invalid */
+typedef int (*RULES_OPFN)(ATTROPS *op,
+			  char *token);
+
+extern void
+attrops_apply(ATTROPS *dp,
+	      const ATTROPS *sp);
+
+extern RULES *
+rules_load(const char *path,
+	   const ATTROPS *base,
+	   RULES_OPFN opfn,
+	   int *line);
+
+extern const RSTATE *
+rules_start(RULES *rp);
+
+extern const RSTATE *
+rules_step(const RSTATE *sp,
+	   const char *name);
+
+extern const RSTATE *
+rules_match(RULES *rp,
+	    const char *relpath);
+
+extern const ATTROPS *
+rules_ops(const RSTATE *sp,
+	  int type);
+
+extern int
+rules_count(RULES *rp,
+	    int *states);
+
+extern void
+rules_free(RULES *rp);
+
+#endif
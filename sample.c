@@ -0,0 +1,415 @@
+/*
+ * sample.c - Statistical sampling of directory trees
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define _DEFAULT_SOURCE 1
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "sample.h"
+
+/*
+ * Random probes (Knuth's estimator): start at the root and descend into
+ * a randomly selected subdirectory until reaching a leaf. In each
+ * directory on the way a random subset of the entries is examined.
+ *
+ * Subdirectories are selected with a probability proportional to their
+ * size (st_size is a rough entry count on most filesystems) and every
+ * examined entry is weighted by the inverse probability of having been
+ * selected, so each probe is an unbiased estimate of the category
+ * totals of the whole tree. The probes are independent so the spread
+ * between them gives us the confidence intervals.
+ */
+
+typedef struct {
+    char *name;
+    int isdir;
+    double weight;
+} SENTRY;
+
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t
+rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+/* Uniform in [0,1) */
+static double
+rng_double(void) {
+    return (rng_next() >> 11) * (1.0/9007199254740992.0);
+}
+
+static int
+stat2type(const struct stat *sp) {
+    if (S_ISDIR(sp->st_mode))
+	return FTW_D;
+    if (S_ISLNK(sp->st_mode))
+	return FTW_SL;
+    return FTW_F;
+}
+
+static char *
+path_join(const char *dir,
+	  const char *name) {
+    size_t dlen = strlen(dir);
+    char *p = malloc(dlen+strlen(name)+2);
+
+    if (!p)
+	return NULL;
+    strcpy(p, dir);
+    if (dlen > 0 && dir[dlen-1] != '/')
+	p[dlen++] = '/';
+    strcpy(p+dlen, name);
+    return p;
+}
+
+static void
+free_entries(SENTRY *ev,
+	     size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	free(ev[i].name);
+    free(ev);
+}
+
+static int
+read_entries(const char *path,
+	     SENTRY **evp,
+	     size_t *np) {
+    DIR *dp;
+    struct dirent *dep;
+    SENTRY *ev = NULL, *nev;
+    size_t n = 0, size = 0;
+
+
+    dp = opendir(path);
+    if (!dp)
+	return -1;
+
+    while ((dep = readdir(dp)) != NULL) {
+	if (strcmp(dep->d_name, ".") == 0 || strcmp(dep->d_name, "..") == 0)
+	    continue;
+
+	if (n == size) {
+	    size = size ? size*2 : 256;
+	    nev = realloc(ev, size*sizeof(*ev));
+	    if (!nev)
+		goto Fail;
+	    ev = nev;
+	}
+
+	ev[n].name = strdup(dep->d_name);
+	if (!ev[n].name)
+	    goto Fail;
+#if defined(DT_DIR)
+	ev[n].isdir = (dep->d_type == DT_DIR ? 1 : dep->d_type == DT_UNKNOWN ? -1 : 0);
+#else
+	ev[n].isdir = -1;
+#endif
+	ev[n].weight = 0;
+	n++;
+    }
+
+    closedir(dp);
+    *evp = ev;
+    *np = n;
+    return 0;
+
+ Fail:
+    closedir(dp);
+    free_entries(ev, n);
+    return -1;
+}
+
+
+/*
+ * Run one probe, adding the weighted category counts to yv. If limited
+ * the descent stops once the budget is used up and 1 is returned.
+ */
+static int
+probe(const char *root,
+      SAMPLE *sp,
+      int ncat,
+      SAMPLE_FN fn,
+      double *yv,
+      uint64_t *ev,
+      int limited) {
+    char *path, *npath;
+    SENTRY *entv;
+    size_t *idx = NULL, *nidx;
+    size_t i, j, n, k, idx_size = 0;
+    double w = 1.0, tw, r;
+    struct stat sb;
+    int c, rc = 0;
+
+
+    path = strdup(root);
+    if (!path)
+	return -1;
+
+    while (1) {
+	if (limited && sp->examined >= sp->budget) {
+	    rc = 1;
+	    break;
+	}
+	if (read_entries(path, &entv, &n) < 0)
+	    break;
+
+	sp->dirs++;
+	if (n == 0) {
+	    free(entv);
+	    break;
+	}
+
+	if (n > idx_size) {
+	    nidx = realloc(idx, n*sizeof(*idx));
+	    if (!nidx) {
+		free_entries(entv, n);
+		break;
+	    }
+	    idx = nidx;
+	    idx_size = n;
+	}
+	for (i = 0; i < n; i++)
+	    idx[i] = i;
+
+	k = (size_t) (sp->rate*n + 0.5);
+	if (k < 1)
+	    k = 1;
+	if (k > n)
+	    k = n;
+	if (sp->examined+k > sp->budget && sp->examined < sp->budget)
+	    k = sp->budget - sp->examined;
+
+	/* Partial Fisher-Yates shuffle gives us k distinct entries */
+	for (i = 0; i < k; i++) {
+	    size_t t;
+
+	    j = i + (size_t) (rng_double()*(n-i));
+	    t = idx[i];
+	    idx[i] = idx[j];
+	    idx[j] = t;
+
+	    npath = path_join(path, entv[idx[i]].name);
+	    if (!npath)
+		continue;
+	    if (lstat(npath, &sb) == 0) {
+		entv[idx[i]].isdir = S_ISDIR(sb.st_mode);
+		memset(ev, 0, ncat*sizeof(*ev));
+		fn(npath, &sb, stat2type(&sb), ev);
+		for (c = 0; c < ncat; c++)
+		    yv[c] += w * n / k * ev[c];
+		sp->examined++;
+	    }
+	    free(npath);
+	}
+
+	/* Select a subdirectory to descend into, weighted by size */
+	tw = 0;
+	for (i = 0; i < n; i++) {
+	    if (entv[i].isdir == 0)
+		continue;
+
+	    npath = path_join(path, entv[i].name);
+	    if (npath && lstat(npath, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+		entv[i].isdir = 1;
+		entv[i].weight = sb.st_size > 0 ? (double) sb.st_size : 1.0;
+		tw += entv[i].weight;
+	    } else
+		entv[i].isdir = 0;
+	    free(npath);
+	}
+
+	if (tw <= 0) {
+	    free_entries(entv, n);
+	    break;
+	}
+
+	r = rng_double()*tw;
+	for (j = n, i = 0; i < n; i++) {
+	    if (entv[i].isdir != 1)
+		continue;
+	    j = i;
+	    if (r < entv[i].weight)
+		break;
+	    r -= entv[i].weight;
+	}
+
+	/* j is the selected (or, due to rounding, the last) subdirectory */
+	w *= tw / entv[j].weight;
+	npath = path_join(path, entv[j].name);
+	free_entries(entv, n);
+	if (!npath)
+	    break;
+	free(path);
+	path = npath;
+    }
+
+    free(idx);
+    free(path);
+    return rc;
+}
+
+
+int
+sample_tree(const char *root,
+	    SAMPLE *sp,
+	    int ncat,
+	    SAMPLE_FN fn,
+	    double *est,
+	    double *est_ci,
+	    double *frac,
+	    double *frac_ci) {
+    struct stat sb;
+    uint64_t *ev;
+    double *yroot, *pv = NULL, *npv, s, d;
+    size_t p, pv_size = 0;
+    int c, prc, rc = 0;
+
+
+    if (sp->seed)
+	rng_state = sp->seed;
+    if (sp->rate <= 0 || sp->rate > 1)
+	sp->rate = 1;
+    sp->probes = sp->dirs = sp->examined = 0;
+
+    if (lstat(root, &sb) < 0)
+	return -1;
+
+    ev = calloc(ncat, sizeof(*ev));
+    yroot = calloc(ncat, sizeof(*yroot));
+    if (!ev || !yroot) {
+	rc = -1;
+	goto End;
+    }
+
+    /* The root is always part of the tree, count it exactly */
+    fn(root, &sb, stat2type(&sb), ev);
+    for (c = 0; c < ncat; c++)
+	yroot[c] = ev[c];
+
+    while (S_ISDIR(sb.st_mode) && (sp->probes < 2 || sp->examined < sp->budget)) {
+	uint64_t examined = sp->examined;
+
+	if (sp->probes == pv_size) {
+	    pv_size = pv_size ? pv_size*2 : 64;
+	    npv = realloc(pv, pv_size*ncat*sizeof(*pv));
+	    if (!npv) {
+		rc = -1;
+		goto End;
+	    }
+	    pv = npv;
+	}
+
+	memcpy(pv+sp->probes*ncat, yroot, ncat*sizeof(*pv));
+	/* The first two always run to the end, for a confidence interval */
+	prc = probe(root, sp, ncat, fn, pv+sp->probes*ncat, ev, sp->probes >= 2);
+	if (prc < 0) {
+	    rc = -1;
+	    goto End;
+	}
+
+	/* Out of budget part way down, it would underestimate what is below */
+	if (prc > 0)
+	    break;
+	sp->probes++;
+
+	/* Empty (or unreadable) root directory */
+	if (sp->examined == examined)
+	    break;
+    }
+
+    if (sp->probes == 0) {
+	for (c = 0; c < ncat; c++) {
+	    est[c] = yroot[c];
+	    est_ci[c] = 0;
+	    frac[c] = yroot[0] ? yroot[c]/yroot[0] : 0;
+	    frac_ci[c] = 0;
+	}
+	goto End;
+    }
+
+    for (c = 0; c < ncat; c++) {
+	for (s = 0, p = 0; p < sp->probes; p++)
+	    s += pv[p*ncat+c];
+	est[c] = s/sp->probes;
+    }
+
+    /* 95% confidence intervals, and the delta method for the ratios */
+    for (c = 0; c < ncat; c++) {
+	est_ci[c] = frac_ci[c] = 0;
+	frac[c] = est[0] > 0 ? est[c]/est[0] : 0;
+
+	if (sp->probes < 2)
+	    continue;
+
+	for (s = 0, p = 0; p < sp->probes; p++) {
+	    d = pv[p*ncat+c]-est[c];
+	    s += d*d;
+	}
+	est_ci[c] = 1.96*sqrt(s/(sp->probes-1)/sp->probes);
+
+	if (est[0] > 0) {
+	    for (s = 0, p = 0; p < sp->probes; p++) {
+		d = pv[p*ncat+c]-frac[c]*pv[p*ncat];
+		s += d*d;
+	    }
+	    frac_ci[c] = 1.96*sqrt(s/(sp->probes-1)/sp->probes)/est[0];
+	}
+    }
+
+ End:
+    free(pv);
+    free(yroot);
+    free(ev);
+    return rc;
+}
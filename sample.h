@@ -0,0 +1,70 @@
+/*
+ * sample.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SAMPLE_H
+#define SAMPLE_H 1
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Called for every sampled entry, should set yv[0..ncat-1] to the
+ * category counts (usually 0 or 1) for the entry
+ */
+typedef int (*SAMPLE_FN)(const char *path,
+			 const struct stat *sp,
+			 int type,
+			 uint64_t *yv);
+
+typedef struct {
+    double rate;		/* Fraction of entries to examine per directory */
+    uint64_t budget;		/* Max number of entries to examine */
+    uint64_t seed;
+
+    /* Results */
+    uint64_t probes;
+    uint64_t dirs;
+    uint64_t examined;
+} SAMPLE;
+
+extern int
+sample_tree(const char *root,
+	    SAMPLE *sp,
+	    int ncat,
+	    SAMPLE_FN fn,
+	    double *est,
+	    double *est_ci,
+	    double *frac,
+	    double *frac_ci);
+
+#endif
@@ -0,0 +1,606 @@
+/*
+ * server.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define _DEFAULT_SOURCE 1
+#define _GNU_SOURCE 1		/* struct ucred */
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "output.h"
+#include "server.h"
+
+/*
+ * Requests are read from a UNIX domain socket by one thread per
+ * connection, at most MAX_CONNS of them at once (more are closed
+ * right away). A connection may pipeline any number of requests and
+ * mix the two forms, told apart by the first byte:
+ *
+ * Paths must be absolute, the client adds its cwd to relative ones.
+ *
+ * Text - one line, the path last (and may contain spaces):
+ *   get <path>
+ *   set [-n] [+ATTRS|-ATTRS|=ATTRS|-1..-5|-c]... [--] <path>
+ *   repair [-n] <path>
+ * answered by
+ *   ok <old-attribs> <old-version> <new-attribs> <new-version> <status>
+ *   error <errno> <message>
+ *
+ * Binary - little endian, a 10 byte header followed by the path:
+ *   u8 op (1-3), u8 flags, u8 version, u8 repair,
+ *   u16 andattribs, u16 orattribs, u16 pathlen
+ * answered by 10 bytes:
+ *   u8 op, u8 status, u16 errno, u16 old attribs, u16 new attribs,
+ *   u8 old version, u8 new version
+ *
+ * All requests in what has been read so far are handled before the
+ * replies are written in one go.
+ */
+
+#define REQ_HEADER	10
+#define REP_SIZE	10
+
+#define CONN_BUFSIZE	(65536+REQ_HEADER)
+
+/* Requests in flight per client batch */
+#define CLIENT_WINDOW	256
+
+/* Connections (threads) served at once, more are refused */
+#define MAX_CONNS	64
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    char path[65536];
+    OBUF out;
+} CONN;
+
+static const char *status_names[] = {
+    "unchanged",
+    "updated",
+    "failed",
+    "dryrun",
+    "conflict",
+};
+
+static SERVER_FN s_fn = NULL;
+static RULES_OPFN s_opfn = NULL;
+static const char *s_path = NULL;
+static mode_t s_mode = 0600;
+static gid_t s_gid = 0;
+static unsigned int s_conns = 0;
+
+
+static uint16_t
+get_u16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static void
+put_u16(unsigned char *p,
+	uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+
+static int
+write_all(int fd,
+	  const char *buf,
+	  size_t len) {
+    ssize_t rc;
+
+    while (len > 0) {
+	rc = write(fd, buf, len);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += rc;
+	len -= rc;
+    }
+    return 0;
+}
+
+
+static void
+format_reply(OBUF *bp,
+	     const SREPLY *rp) {
+    if (rp->error)
+	obuf_printf(bp, "error %d %s\n", rp->error, strerror(rp->error));
+    else
+	obuf_printf(bp, "ok 0x%04x %d 0x%04x %d %s\n",
+		    rp->oattribs, rp->oversion, rp->nattribs, rp->nversion,
+		    status_names[rp->status]);
+}
+
+
+/* Returns the number of bytes used, 0 if incomplete */
+static size_t
+binary_request(CONN *cp,
+	       unsigned char *p,
+	       size_t len) {
+    SREQUEST rq;
+    SREPLY r;
+    unsigned char rb[REP_SIZE];
+    size_t plen;
+
+    if (len < REQ_HEADER)
+	return 0;
+    plen = get_u16(p+8);
+    if (len < REQ_HEADER+plen)
+	return 0;
+
+    memcpy(cp->path, p+REQ_HEADER, plen);
+    cp->path[plen] = '\0';
+
+    rq.op = p[0];
+    rq.flags = p[1];
+    rq.ops.version = p[2];
+    rq.ops.repair = p[3] || rq.op == SERVER_REPAIR;
+    rq.ops.andattribs = get_u16(p+4);
+    rq.ops.orattribs = get_u16(p+6);
+    rq.path = cp->path;
+
+    memset(&r, 0, sizeof(r));
+    if (plen == 0 || cp->path[0] != '/' || rq.ops.version > 5)
+	r.error = EINVAL;
+    else
+	s_fn(&rq, &r);
+
+    rb[0] = rq.op;
+    rb[1] = r.status;
+    put_u16(rb+2, r.error);
+    put_u16(rb+4, r.oattribs);
+    put_u16(rb+6, r.nattribs);
+    rb[8] = r.oversion;
+    rb[9] = r.nversion;
+    obuf_write(&cp->out, rb, sizeof(rb));
+    return REQ_HEADER+plen;
+}
+
+
+static size_t
+text_request(CONN *cp,
+	     char *p,
+	     size_t len) {
+    SREQUEST rq;
+    SREPLY r;
+    char *end, *s, *t, c;
+    size_t used;
+
+    end = memchr(p, '\n', len);
+    if (!end)
+	return 0;
+    used = end-p+1;
+    if (end > p && end[-1] == '\r')
+	--end;
+    *end = '\0';
+
+    memset(&rq, 0, sizeof(rq));
+    memset(&r, 0, sizeof(r));
+    rq.ops.andattribs = 0xFFFF;
+
+    s = p+strcspn(p, " \t");
+    if (*s)
+	*s++ = '\0';
+    if (strcmp(p, "get") == 0)
+	rq.op = SERVER_GET;
+    else if (strcmp(p, "set") == 0)
+	rq.op = SERVER_SET;
+    else if (strcmp(p, "repair") == 0) {
+	rq.op = SERVER_REPAIR;
+	rq.ops.repair = 1;
+    }
+
+    /* Operations up to the path */
+    for (;;) {
+	s += strspn(s, " \t");
+	if (!*s || !strchr("+-=", *s))
+	    break;
+	t = s+strcspn(s, " \t");
+	if (!*t)
+	    break;
+	c = *t;
+	*t = '\0';
+	if (strcmp(s, "--") == 0) {
+	    s = t+1;
+	    break;
+	}
+	if (strcmp(s, "-n") == 0)
+	    rq.flags |= SERVER_NOUPDATE;
+	else if (rq.op == SERVER_GET || s_opfn(&rq.ops, s) < 0) {
+	    *t = c;
+	    break;
+	}
+	s = t+1;
+    }
+    rq.path = s;
+
+    if (!rq.op || *s != '/')
+	r.error = EINVAL;
+    else
+	s_fn(&rq, &r);
+
+    format_reply(&cp->out, &r);
+    return used;
+}
+
+
+static void *
+connection(void *vp) {
+    CONN *cp = vp;
+    size_t used, pos;
+    ssize_t n;
+
+
+    for (;;) {
+	n = read(cp->fd, cp->buf+cp->len, CONN_BUFSIZE-cp->len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	cp->len += n;
+
+	for (pos = 0; pos < cp->len; pos += used) {
+	    if (cp->buf[pos] >= SERVER_GET && cp->buf[pos] <= SERVER_REPAIR)
+		used = binary_request(cp, (unsigned char *) cp->buf+pos, cp->len-pos);
+	    else
+		used = text_request(cp, cp->buf+pos, cp->len-pos);
+	    if (!used)
+		break;
+	}
+
+	if (cp->out.len > 0) {
+	    if (write_all(cp->fd, cp->out.buf, cp->out.len) < 0)
+		break;
+	    cp->out.len = 0;
+	}
+
+	memmove(cp->buf, cp->buf+pos, cp->len-pos);
+	cp->len -= pos;
+
+	/* A request larger than the buffer */
+	if (cp->len == CONN_BUFSIZE)
+	    break;
+    }
+
+    close(cp->fd);
+    obuf_free(&cp->out);
+    free(cp->buf);
+    free(cp);
+    __atomic_sub_fetch(&s_conns, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+
+static void
+terminate(int sig) {
+    (void) sig;
+
+    unlink(s_path);
+    _exit(0);
+}
+
+
+static int
+socket_addr(struct sockaddr_un *sap,
+	    const char *path) {
+    memset(sap, 0, sizeof(*sap));
+    sap->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sap->sun_path)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    strcpy(sap->sun_path, path);
+    return 0;
+}
+
+
+/*
+ * Check the credentials of a client against the socket mode, since
+ * some systems ignore the permissions of sockets. Root and our own
+ * user are always let in, the group of the socket (the primary group
+ * of the client only) with group access and anyone with other access.
+ */
+static int
+peer_allowed(int fd,
+	     uid_t *uidp) {
+    uid_t uid;
+    gid_t gid;
+#if defined(SO_PEERCRED)
+    struct ucred uc;
+    socklen_t len = sizeof(uc);
+#endif
+
+    *uidp = (uid_t) -1;
+#if defined(SO_PEERCRED)
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &uc, &len) < 0)
+	return 0;
+    uid = uc.uid;
+    gid = uc.gid;
+#else
+    if (getpeereid(fd, &uid, &gid) < 0)
+	return 0;
+#endif
+
+    *uidp = uid;
+    return uid == 0 || uid == geteuid() ||
+	((s_mode & 0070) && gid == s_gid) || (s_mode & 0007);
+}
+
+
+/*
+ * Listen on path, a socket created with mode, and serve requests
+ * until killed. Returns -1 if unable to start.
+ */
+int
+server_run(const char *path,
+	   mode_t mode,
+	   SERVER_FN fn,
+	   RULES_OPFN opfn,
+	   const char *progname,
+	   int verbose) {
+    struct sockaddr_un sa;
+    struct stat sb;
+    pthread_attr_t attr;
+    pthread_t tid;
+    CONN *cp;
+    mode_t omask;
+    uid_t uid;
+    int fd, cfd, rc;
+
+
+    s_fn = fn;
+    s_opfn = opfn;
+    s_path = path;
+    s_mode = mode;
+
+    if (socket_addr(&sa, path) < 0)
+	return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+	return -1;
+
+    /* Remove a socket left behind, unless someone is still listening */
+    if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) == 0) {
+	    close(fd);
+	    errno = EADDRINUSE;
+	    return -1;
+	}
+	unlink(path);
+    }
+
+    /* Not whatever the umask happens to give */
+    omask = umask(~mode & 0777);
+    rc = bind(fd, (struct sockaddr *) &sa, sizeof(sa));
+    umask(omask);
+    if (rc < 0 || stat(path, &sb) < 0 || listen(fd, 128) < 0) {
+	close(fd);
+	return -1;
+    }
+    s_gid = sb.st_gid;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, terminate);
+    signal(SIGTERM, terminate);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (verbose)
+	fprintf(stderr, "%s: Info: Listening on %s\n", progname, path);
+
+    for (;;) {
+	cfd = accept(fd, NULL, NULL);
+	if (cfd < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    fprintf(stderr, "%s: Error: %s: Accepting connection: %s\n",
+		    progname, path, strerror(errno));
+	    sleep(1);
+	    continue;
+	}
+
+	if (!peer_allowed(cfd, &uid)) {
+	    if (verbose)
+		fprintf(stderr, "%s: Notice: %s: Refused connection from uid %ld\n",
+			progname, path, (long) uid);
+	    close(cfd);
+	    continue;
+	}
+
+	/* Only the accept loop adds, so no race with the check */
+	if (__atomic_load_n(&s_conns, __ATOMIC_RELAXED) >= MAX_CONNS) {
+	    if (verbose)
+		fprintf(stderr, "%s: Notice: %s: Refused connection from uid %ld: Too many connections\n",
+			progname, path, (long) uid);
+	    close(cfd);
+	    continue;
+	}
+
+	cp = calloc(1, sizeof(*cp));
+	if (cp)
+	    cp->buf = malloc(CONN_BUFSIZE);
+	if (!cp || !cp->buf) {
+	    free(cp);
+	    close(cfd);
+	    continue;
+	}
+	cp->fd = cfd;
+
+	__atomic_add_fetch(&s_conns, 1, __ATOMIC_RELAXED);
+	if (pthread_create(&tid, &attr, connection, cp) != 0) {
+	    fprintf(stderr, "%s: Error: %s: Unable to start connection thread: %s\n",
+		    progname, path, strerror(errno));
+	    __atomic_sub_fetch(&s_conns, 1, __ATOMIC_RELAXED);
+	    close(cfd);
+	    free(cp->buf);
+	    free(cp);
+	}
+    }
+
+    return 0;
+}
+
+
+/*
+ * Send the same request for all the paths, a window at a time, and
+ * print the replies. Returns 1 if any of them (or the connection) failed.
+ */
+int
+client_run(const char *path,
+	   const SREQUEST *rq,
+	   char **paths,
+	   int npaths,
+	   const char *progname) {
+    struct sockaddr_un sa;
+    unsigned char hdr[REQ_HEADER], rb[REP_SIZE*CLIENT_WINDOW];
+    OBUF ob;
+    SREPLY r;
+    char cwd[PATH_MAX];
+    size_t plen, clen, got;
+    ssize_t n;
+    int fd = -1, i, j, w, rc = 0;
+
+
+    /* Report a refused connection instead of dying on the write */
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&ob, 0, sizeof(ob));
+    cwd[0] = '\0';
+    if (socket_addr(&sa, path) < 0)
+	goto Fail;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+	goto Fail;
+
+    for (i = 0; i < npaths; i += w) {
+	w = npaths-i < CLIENT_WINDOW ? npaths-i : CLIENT_WINDOW;
+
+	ob.len = 0;
+	for (j = i; j < i+w; j++) {
+	    /* The server has another cwd, so send relative paths with ours */
+	    clen = 0;
+	    if (paths[j][0] != '/') {
+		if (!cwd[0] && !getcwd(cwd, sizeof(cwd)))
+		    goto Fail;
+		clen = strlen(cwd);
+	    }
+	    plen = (clen ? clen+1 : 0)+strlen(paths[j]);
+	    if (plen > 65535)
+		plen = clen = 0;
+	    hdr[0] = rq->op;
+	    hdr[1] = rq->flags;
+	    hdr[2] = rq->ops.version;
+	    hdr[3] = rq->ops.repair;
+	    put_u16(hdr+4, rq->ops.andattribs);
+	    put_u16(hdr+6, rq->ops.orattribs);
+	    put_u16(hdr+8, plen);
+	    obuf_write(&ob, hdr, sizeof(hdr));
+	    if (clen) {
+		obuf_write(&ob, cwd, clen);
+		obuf_write(&ob, "/", 1);
+		plen -= clen+1;
+	    }
+	    obuf_write(&ob, paths[j], plen);
+	}
+	if (write_all(fd, ob.buf, ob.len) < 0)
+	    goto Fail;
+
+	for (got = 0; got < (size_t) w*REP_SIZE; got += n) {
+	    n = read(fd, rb+got, w*REP_SIZE-got);
+	    if (n < 0 && errno == EINTR)
+		n = 0;
+	    else if (n < 0)
+		goto Fail;
+	    else if (n == 0) {
+		errno = ECONNRESET;
+		goto Fail;
+	    }
+	}
+
+	ob.len = 0;
+	for (j = 0; j < w; j++) {
+	    unsigned char *p = rb+j*REP_SIZE;
+
+	    r.status = p[1];
+	    r.error = get_u16(p+2);
+	    r.oattribs = get_u16(p+4);
+	    r.nattribs = get_u16(p+6);
+	    r.oversion = p[8];
+	    r.nversion = p[9];
+	    if (r.error || r.status == SERVER_FAILED || r.status >= SERVER_CONFLICT)
+		rc = 1;
+	    if (r.status > SERVER_CONFLICT)
+		r.error = EPROTO;
+	    obuf_printf(&ob, "%s: ", paths[i+j]);
+	    format_reply(&ob, &r);
+	}
+	if (write_all(1, ob.buf, ob.len) < 0)
+	    goto Fail;
+    }
+
+    obuf_free(&ob);
+    close(fd);
+    return rc;
+
+ Fail:
+    fprintf(stderr, "%s: Error: %s: Talking to server: %s\n",
+	    progname, path, strerror(errno));
+    obuf_free(&ob);
+    if (fd >= 0)
+	close(fd);
+    return 1;
+}
@@ -0,0 +1,92 @@
+/*
+ * server.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SERVER_H
+#define SERVER_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "rules.h"
+
+#define SERVER_GET		1
+#define SERVER_SET		2
+#define SERVER_REPAIR		3
+
+/* Request flags */
+#define SERVER_NOUPDATE		0x01
+
+/* Reply status, as RESULT_* */
+#define SERVER_UNCHANGED	0
+#define SERVER_UPDATED		1
+#define SERVER_FAILED		2
+#define SERVER_DRYRUN		3
+#define SERVER_CONFLICT		4	/* --optimistic */
+
+typedef struct {
+    int op;
+    int flags;
+    ATTROPS ops;
+    const char *path;
+} SREQUEST;
+
+typedef struct {
+    int status;
+    int error;			/* Or 0 */
+    uint16_t oattribs;
+    uint16_t nattribs;
+    int oversion;		/* 0 = missing */
+    int nversion;
+} SREPLY;
+
+/* Called from several connection threads at once */
+typedef void (*SERVER_FN)(const SREQUEST *rq,
+			  SREPLY *rp);
+
+extern int
+server_run(const char *path,
+	   mode_t mode,
+	   SERVER_FN fn,
+	   RULES_OPFN opfn,
+	   const char *progname,
+	   int verbose);
+
+extern int
+client_run(const char *path,
+	   const SREQUEST *rq,
+	   char **paths,
+	   int npaths,
+	   const char *progname);
+
+#endif
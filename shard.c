@@ -0,0 +1,395 @@
+/*
+ * shard.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define _DEFAULT_SOURCE 1
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "shard.h"
+
+/*
+ * The top level entries of a tree are split between a number of
+ * shard processes by a hash of their names, so the same entry always
+ * ends up in the same shard. Each shard writes its output to a spool
+ * file and its results (and progress) to its own slot in a shared
+ * memory area. A shard that is killed, or exits with a status other
+ * than 0 (ok) or 1 (errors), is restarted from scratch with an empty
+ * spool. The spools are copied to stdout in shard order at the end.
+ */
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Slots are cache line aligned so the shards do not share lines */
+#define SLOT_ALIGN 64
+
+/* Seconds between progress reports */
+#define REPORT_INTERVAL 10
+
+
+static uint64_t
+name_hash(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*s) {
+	h ^= (unsigned char) *s++;
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+static int
+shard_add(SHARD *sp,
+	  const char *name) {
+    char **nv;
+
+    if (sp->nnames == sp->size) {
+	sp->size = sp->size ? sp->size*2 : 64;
+	nv = realloc(sp->names, sp->size*sizeof(*nv));
+	if (!nv)
+	    return -1;
+	sp->names = nv;
+    }
+    sp->names[sp->nnames] = strdup(name);
+    if (!sp->names[sp->nnames])
+	return -1;
+    sp->nnames++;
+    return 0;
+}
+
+
+void
+shards_free(SHARDS *shp) {
+    int i;
+    size_t j;
+
+    if (!shp)
+	return;
+
+    if (shp->v) {
+	for (i = 0; i < shp->n; i++) {
+	    SHARD *sp = &shp->v[i];
+
+	    for (j = 0; j < sp->nnames; j++)
+		free(sp->names[j]);
+	    free(sp->names);
+	    if (sp->spool)
+		fclose(sp->spool);
+	}
+	free(shp->v);
+    }
+    if (shp->shm)
+	munmap(shp->shm, shp->shm_size);
+    free(shp);
+}
+
+
+/*
+ * Read the top level of root and assign the entries to n shards, each
+ * with datasize bytes of shared memory for its results
+ */
+SHARDS *
+shards_split(const char *root,
+	     int n,
+	     size_t datasize) {
+    SHARDS *shp;
+    DIR *dp;
+    struct dirent *dep;
+    size_t slot;
+    int i, rc = 0, saved;
+
+
+    shp = calloc(1, sizeof(*shp));
+    if (!shp)
+	return NULL;
+
+    shp->n = n;
+    shp->datasize = datasize;
+    shp->v = calloc(n, sizeof(*shp->v));
+    if (!shp->v)
+	goto Fail;
+
+    slot = (sizeof(uint64_t)+datasize+SLOT_ALIGN-1) & ~(size_t) (SLOT_ALIGN-1);
+    shp->shm_size = slot*n;
+    shp->shm = mmap(NULL, shp->shm_size, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (shp->shm == MAP_FAILED) {
+	shp->shm = NULL;
+	goto Fail;
+    }
+
+    for (i = 0; i < n; i++) {
+	SHARD *sp = &shp->v[i];
+
+	sp->id = i;
+	sp->pid = -1;
+	sp->progress = (uint64_t *) ((char *) shp->shm+i*slot);
+	sp->data = sp->progress+1;
+    }
+
+    dp = opendir(root);
+    if (!dp)
+	goto Fail;
+
+    while (rc == 0 && (errno = 0, dep = readdir(dp)) != NULL) {
+	if (strcmp(dep->d_name, ".") == 0 || strcmp(dep->d_name, "..") == 0)
+	    continue;
+	rc = shard_add(&shp->v[name_hash(dep->d_name) % n], dep->d_name);
+    }
+    if (rc == 0 && errno)
+	rc = -1;
+    saved = errno;
+    closedir(dp);
+    errno = saved;
+    if (rc < 0)
+	goto Fail;
+
+    return shp;
+
+ Fail:
+    saved = errno;
+    shards_free(shp);
+    errno = saved;
+    return NULL;
+}
+
+
+static int
+shard_start(SHARD *sp,
+	    const char *root,
+	    SHARD_FN fn) {
+    int rc;
+
+    /* Or the buffered output would be written by each process */
+    fflush(stdout);
+    fflush(stderr);
+
+    sp->pid = fork();
+    if (sp->pid < 0)
+	return -1;
+
+    if (sp->pid == 0) {
+	if (dup2(fileno(sp->spool), 1) < 0)
+	    _exit(2);
+	rc = fn(sp, root);
+	fflush(stdout);
+	_exit(rc == 0 ? 0 : 1);
+    }
+
+    sp->attempts++;
+    return 0;
+}
+
+
+/* Start over with an empty spool and results */
+static int
+shard_reset(SHARD *sp,
+	    size_t datasize) {
+    fflush(sp->spool);
+    if (ftruncate(fileno(sp->spool), 0) < 0)
+	return -1;
+    rewind(sp->spool);
+    *sp->progress = 0;
+    memset(sp->data, 0, datasize);
+    return 0;
+}
+
+
+static int
+copy_spool(SHARD *sp) {
+    char buf[65536];
+    ssize_t len, rc;
+    char *p;
+    int fd = fileno(sp->spool);
+
+    if (lseek(fd, 0, SEEK_SET) < 0)
+	return -1;
+
+    while ((len = read(fd, buf, sizeof(buf))) != 0) {
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	for (p = buf; len > 0; p += rc, len -= rc) {
+	    rc = write(1, p, len);
+	    if (rc < 0) {
+		if (errno == EINTR) {
+		    rc = 0;
+		    continue;
+		}
+		return -1;
+	    }
+	}
+    }
+    return 0;
+}
+
+
+/*
+ * Run fn for all the shards in parallel processes and wait for them,
+ * restarting crashed ones up to retries times. Returns 0 if all of them
+ * succeeded and -1 otherwise. The output of all shards (including
+ * failed ones) is then written to stdout.
+ */
+int
+shards_run(SHARDS *shp,
+	   const char *root,
+	   SHARD_FN fn,
+	   int retries,
+	   const char *progname,
+	   int verbose) {
+    int i, status, running = 0, done = 0, rc = 0;
+    uint64_t entries;
+    time_t last, now;
+    struct timespec ts;
+    pid_t pid;
+    SHARD *sp;
+
+
+    for (i = 0; i < shp->n; i++) {
+	sp = &shp->v[i];
+	sp->spool = tmpfile();
+	if (!sp->spool) {
+	    fprintf(stderr, "%s: Error: Shard %d: Unable to create spool file: %s\n",
+		    progname, i, strerror(errno));
+	    return -1;
+	}
+    }
+
+    for (i = 0; i < shp->n; i++) {
+	sp = &shp->v[i];
+	if (shard_start(sp, root, fn) < 0) {
+	    fprintf(stderr, "%s: Error: Shard %d: Unable to start: %s\n",
+		    progname, i, strerror(errno));
+	    rc = -1;
+	} else
+	    running++;
+    }
+
+    time(&last);
+    while (running > 0) {
+	pid = waitpid(-1, &status, WNOHANG);
+	if (pid < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "%s: Error: Waiting for shards: %s\n",
+		    progname, strerror(errno));
+	    return -1;
+	}
+
+	if (pid == 0) {
+	    ts.tv_sec = 0;
+	    ts.tv_nsec = 100000000;
+	    nanosleep(&ts, NULL);
+
+	    time(&now);
+	    if (verbose && now-last >= REPORT_INTERVAL) {
+		entries = 0;
+		for (i = 0; i < shp->n; i++)
+		    entries += __atomic_load_n(shp->v[i].progress, __ATOMIC_RELAXED);
+		fprintf(stderr, "%s: Info: %s: %d shards running, %d done, %llu entries\n",
+			progname, root, running, done, (long long unsigned int) entries);
+		last = now;
+	    }
+	    continue;
+	}
+
+	for (i = 0; i < shp->n && shp->v[i].pid != pid; i++)
+	    ;
+	if (i == shp->n)
+	    continue;
+
+	sp = &shp->v[i];
+	sp->pid = -1;
+	running--;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) <= 1) {
+	    if (WEXITSTATUS(status) != 0)
+		rc = -1;
+	    done++;
+	    continue;
+	}
+
+	if (sp->attempts <= retries) {
+	    if (WIFSIGNALED(status))
+		fprintf(stderr, "%s: Notice: Shard %d: Killed by signal %d [retrying]\n",
+			progname, i, WTERMSIG(status));
+	    else
+		fprintf(stderr, "%s: Notice: Shard %d: Exit status %d [retrying]\n",
+			progname, i, WEXITSTATUS(status));
+
+	    if (shard_reset(sp, shp->datasize) == 0 && shard_start(sp, root, fn) == 0) {
+		running++;
+		continue;
+	    }
+	    fprintf(stderr, "%s: Error: Shard %d: Unable to restart: %s\n",
+		    progname, i, strerror(errno));
+	} else if (WIFSIGNALED(status))
+	    fprintf(stderr, "%s: Error: Shard %d: Killed by signal %d after %d attempts\n",
+		    progname, i, WTERMSIG(status), sp->attempts);
+	else
+	    fprintf(stderr, "%s: Error: Shard %d: Exit status %d after %d attempts\n",
+		    progname, i, WEXITSTATUS(status), sp->attempts);
+	rc = -1;
+	done++;
+    }
+
+    fflush(stdout);
+    for (i = 0; i < shp->n; i++)
+	if (copy_spool(&shp->v[i]) < 0) {
+	    fprintf(stderr, "%s: Error: Shard %d: Writing output: %s\n",
+		    progname, i, strerror(errno));
+	    rc = -1;
+	}
+
+    return rc;
+}
@@ -0,0 +1,82 @@
+/*
+ * shard.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SHARD_H
+#define SHARD_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct {
+    int id;
+    char **names;		/* Top level entries assigned to it */
+    size_t nnames;
+    size_t size;
+    FILE *spool;		/* Its output, copied out when all are done */
+    pid_t pid;
+    int attempts;
+    uint64_t *progress;		/* Entries so far, in shared memory */
+    void *data;			/* For the results, in shared memory */
+} SHARD;
+
+typedef struct {
+    SHARD *v;
+    int n;
+    size_t datasize;
+    void *shm;
+    size_t shm_size;
+} SHARDS;
+
+/* Runs in the shard process, the output goes to fd 1 */
+typedef int (*SHARD_FN)(SHARD *sp,
+			const char *root);
+
+extern SHARDS *
+shards_split(const char *root,
+	     int n,
+	     size_t datasize);
+
+extern int
+shards_run(SHARDS *shp,
+	   const char *root,
+	   SHARD_FN fn,
+	   int retries,
+	   const char *progname,
+	   int verbose);
+
+extern void
+shards_free(SHARDS *shp);
+
+#endif
@@ -0,0 +1,564 @@
+/*
+ * since.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define _DEFAULT_SOURCE 1
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "since.h"
+
+/*
+ * Pruning of what has not changed since the last run, for --since.
+ *
+ * Creating, removing or renaming an entry updates the mtime and ctime
+ * of the directory it is in, and changing an entry updates its own
+ * ctime. So a directory whose mtime and ctime are older than the start
+ * of the last completed run has the same entries as then, and none of
+ * them have changed unless their own ctime is newer. Such a directory
+ * need not be read at all if we know its subdirectories, which is what
+ * the summary file saved after each run records. Every directory is
+ * still stat()ed, since a change deep down only shows in the directory
+ * it is in.
+ *
+ * Given a time instead of a file, entries older than it are skipped but
+ * all directories are read.
+ *
+ * File format, integers little endian, records sorted by path:
+ *
+ *   "DOSATTRIB-SN\n" u32 version u64 seconds u32 nanoseconds
+ *   u16 root length, root, u64 directories
+ *   records: u16 path length, path (relative to the root, "" for it),
+ *            u32 length, names of its subdirectories (NUL terminated)
+ *            and an empty name
+ */
+
+#define SN_MAGIC	"DOSATTRIB-SN\n"
+#define SN_VERSION	1
+
+/* Seconds of slack, timestamps may come from a coarser clock than ours */
+#define SN_MARGIN	1
+
+#if defined(__APPLE__)
+#define ST_MTIM(st) ((st)->st_mtimespec)
+#define ST_CTIM(st) ((st)->st_ctimespec)
+#else
+#define ST_MTIM(st) ((st)->st_mtim)
+#define ST_CTIM(st) ((st)->st_ctim)
+#endif
+
+typedef struct {
+    char *path;
+    char *names;
+} SDIR;
+
+struct since {
+    char *file;			/* NULL if given a time */
+    char *root;
+    size_t rlen;
+    int have_cutoff;
+    struct timespec cutoff;	/* Older entries are unchanged */
+    struct timespec start;	/* Of this run, the cutoff of the next */
+
+    SDIR *dirs;			/* From the last run, sorted by path */
+    size_t ndirs;
+
+    char **seen;		/* Directories in this run */
+    size_t nseen;
+    size_t seen_size;
+    int error;
+
+    uint64_t skipped;
+};
+
+
+static void
+put_le(unsigned char *p,
+       uint64_t v,
+       int n) {
+    while (n-- > 0) {
+	*p++ = v & 0xFF;
+	v >>= 8;
+    }
+}
+
+static uint64_t
+get_le(const unsigned char *p,
+       int n) {
+    uint64_t v = 0;
+
+    while (n-- > 0)
+	v = (v << 8) | p[n];
+    return v;
+}
+
+
+static int
+ts_before(const struct timespec *a,
+	  const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * YYYY-MM-DD[THH:MM[:SS]] (UTC) or @seconds since 1970, with nothing
+ * after it. Shared with the index queries.
+ */
+int
+since_parse_time(const char *s,
+		 long long *secp) {
+    struct tm tm;
+    int n = -1;
+
+
+    if (*s == '@') {
+	if (sscanf(s+1, "%lld%n", secp, &n) != 1 || s[1+n] != '\0')
+	    return -1;
+	return 0;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    if (!(sscanf(s, "%d-%d-%d%n",
+		 &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) == 3 && s[n] == '\0') &&
+	!(sscanf(s, "%d-%d-%dT%d:%d%n",
+		 &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+		 &tm.tm_hour, &tm.tm_min, &n) == 5 && s[n] == '\0') &&
+	!(sscanf(s, "%d-%d-%dT%d:%d:%d%n",
+		 &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+		 &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 && s[n] == '\0'))
+	return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *secp = timegm(&tm);
+    return 0;
+}
+
+
+static const char *
+relpath(SINCE *sp,
+	const char *path) {
+    path += sp->rlen;
+    while (*path == '/')
+	++path;
+    return path;
+}
+
+static int
+seen_add(SINCE *sp,
+	 const char *rel) {
+    char **nv;
+
+    if (sp->nseen == sp->seen_size) {
+	nv = realloc(sp->seen, (sp->seen_size+4096)*sizeof(*nv));
+	if (!nv)
+	    return -1;
+	sp->seen = nv;
+	sp->seen_size += 4096;
+    }
+    if ((sp->seen[sp->nseen] = strdup(rel)) == NULL)
+	return -1;
+    sp->nseen++;
+    return 0;
+}
+
+
+static int
+sdir_cmp(const void *a,
+	 const void *b) {
+    return strcmp(((const SDIR *) a)->path, ((const SDIR *) b)->path);
+}
+
+static int
+str_cmp(const void *a,
+	const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Length of the parent's part of a relative path */
+static size_t
+parent_len(const char *p) {
+    const char *s = strrchr(p, '/');
+
+    return s ? (size_t) (s-p) : 0;
+}
+
+/* Compare a directory with the parent of a path */
+static int
+parent_cmp(const char *dir,
+	   size_t dlen,
+	   const char *p) {
+    size_t plen = parent_len(p);
+    int rc = memcmp(dir, p, dlen < plen ? dlen : plen);
+
+    if (rc != 0)
+	return rc;
+    return dlen < plen ? -1 : dlen > plen ? 1 : 0;
+}
+
+/* By parent first, so the subdirectories of each are next to each other */
+static int
+child_cmp(const void *a,
+	  const void *b) {
+    const char *pa = *(char * const *) a, *pb = *(char * const *) b;
+    int rc = parent_cmp(pa, parent_len(pa), pb);
+
+    return rc ? rc : strcmp(pa, pb);
+}
+
+
+static void
+sdirs_free(SINCE *sp) {
+    size_t i;
+
+    for (i = 0; i < sp->ndirs; i++) {
+	free(sp->dirs[i].path);
+	free(sp->dirs[i].names);
+    }
+    free(sp->dirs);
+    sp->dirs = NULL;
+    sp->ndirs = 0;
+}
+
+/* The summary of the last run, a missing file is fine */
+static int
+since_load(SINCE *sp) {
+    unsigned char hdr[sizeof(SN_MAGIC)-1+4+8+4+2], b[8];
+    char *root = NULL;
+    FILE *fp;
+    uint64_t n, i;
+    size_t len;
+    SDIR *dp;
+
+
+    fp = fopen(sp->file, "r");
+    if (!fp)
+	return errno == ENOENT ? 0 : -1;
+
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+	memcmp(hdr, SN_MAGIC, sizeof(SN_MAGIC)-1) != 0 ||
+	get_le(hdr+sizeof(SN_MAGIC)-1, 4) != SN_VERSION)
+	goto Invalid;
+    sp->cutoff.tv_sec = get_le(hdr+sizeof(SN_MAGIC)-1+4, 8);
+    sp->cutoff.tv_nsec = get_le(hdr+sizeof(SN_MAGIC)-1+4+8, 4);
+
+    /* Relative paths are only good for the same root */
+    len = get_le(hdr+sizeof(SN_MAGIC)-1+4+8+4, 2);
+    root = malloc(len+1);
+    if (!root)
+	goto Fail;
+    if (fread(root, 1, len, fp) != len)
+	goto Invalid;
+    root[len] = '\0';
+    if (len != sp->rlen || memcmp(root, sp->root, len) != 0)
+	goto Invalid;
+
+    if (fread(b, 1, 8, fp) != 8)
+	goto Invalid;
+    n = get_le(b, 8);
+    sp->dirs = calloc(n ? n : 1, sizeof(SDIR));
+    if (!sp->dirs)
+	goto Fail;
+
+    for (i = 0; i < n; i++) {
+	dp = &sp->dirs[i];
+	if (fread(b, 1, 2, fp) != 2)
+	    goto Invalid;
+	len = get_le(b, 2);
+	dp->path = malloc(len+1);
+	if (!dp->path)
+	    goto Fail;
+	sp->ndirs++;
+	if (fread(dp->path, 1, len, fp) != len)
+	    goto Invalid;
+	dp->path[len] = '\0';
+	if (strlen(dp->path) != len ||
+	    (i > 0 && strcmp(sp->dirs[i-1].path, dp->path) >= 0))
+	    goto Invalid;
+
+	if (fread(b, 1, 4, fp) != 4)
+	    goto Invalid;
+	len = get_le(b, 4);
+	if (len < 1)
+	    goto Invalid;
+	dp->names = malloc(len);
+	if (!dp->names)
+	    goto Fail;
+	if (fread(dp->names, 1, len, fp) != len ||
+	    dp->names[len-1] != '\0' || (len > 1 && dp->names[len-2] != '\0'))
+	    goto Invalid;
+    }
+
+    free(root);
+    fclose(fp);
+    sp->have_cutoff = 1;
+    return 0;
+
+ Invalid:
+    errno = EINVAL;
+ Fail:
+    free(root);
+    fclose(fp);
+    sdirs_free(sp);
+    return -1;
+}
+
+
+/*
+ * spec is either a time or a summary file. Returns NULL with errno
+ * EINVAL if the file is not a summary for root.
+ */
+SINCE *
+since_open(const char *spec,
+	   const char *root) {
+    SINCE *sp;
+    long long secs;
+
+
+    sp = calloc(1, sizeof(*sp));
+    if (!sp)
+	return NULL;
+
+    sp->rlen = strlen(root);
+    while (sp->rlen > 1 && root[sp->rlen-1] == '/')
+	sp->rlen--;
+    sp->root = strndup(root, sp->rlen);
+    if (!sp->root)
+	goto Fail;
+
+    clock_gettime(CLOCK_REALTIME, &sp->start);
+    sp->start.tv_sec -= SN_MARGIN;
+
+    if (since_parse_time(spec, &secs) == 0) {
+	sp->cutoff.tv_sec = secs;
+	sp->cutoff.tv_nsec = 0;
+	sp->have_cutoff = 1;
+	return sp;
+    }
+
+    sp->file = strdup(spec);
+    if (!sp->file || since_load(sp) < 0 || seen_add(sp, "") < 0)
+	goto Fail;
+    return sp;
+
+ Fail:
+    since_free(sp);
+    return NULL;
+}
+
+
+/*
+ * Walk skip function - entries not changed since the cutoff. Records
+ * the directories for the next summary.
+ */
+int
+since_skip(SINCE *sp,
+	   const char *path,
+	   const struct stat *st) {
+    if (sp->file && S_ISDIR(st->st_mode) && seen_add(sp, relpath(sp, path)) < 0)
+	sp->error = errno;
+
+    if (!sp->have_cutoff || !ts_before(&ST_CTIM(st), &sp->cutoff))
+	return 0;
+    sp->skipped++;
+    return 1;
+}
+
+/*
+ * Walk subdirs function - the subdirectories of a directory that has
+ * not changed since the last run
+ */
+const char *
+since_subdirs(SINCE *sp,
+	      const char *path,
+	      const struct stat *st) {
+    SDIR key, *dp;
+
+    if (!sp->ndirs ||
+	!ts_before(&ST_MTIM(st), &sp->cutoff) || !ts_before(&ST_CTIM(st), &sp->cutoff))
+	return NULL;
+
+    key.path = (char *) relpath(sp, path);
+    dp = bsearch(&key, sp->dirs, sp->ndirs, sizeof(SDIR), sdir_cmp);
+    return dp ? dp->names : NULL;
+}
+
+
+/* Write the summary of this (completed) run to a new file and rename it into place */
+int
+since_save(SINCE *sp) {
+    unsigned char hdr[sizeof(SN_MAGIC)-1+4+8+4+2], b[8];
+    char **children = NULL, *tmp = NULL;
+    FILE *fp = NULL;
+    size_t i, j, k, n, lo, hi, len, plen;
+
+
+    if (!sp->file)
+	return 0;
+    if (sp->error) {
+	errno = sp->error;
+	return -1;
+    }
+
+    /* Sorted by path, and by parent for finding the subdirectories */
+    qsort(sp->seen, sp->nseen, sizeof(char *), str_cmp);
+    for (i = j = 0; i < sp->nseen; i++)
+	if (j > 0 && strcmp(sp->seen[j-1], sp->seen[i]) == 0)
+	    free(sp->seen[i]);
+	else
+	    sp->seen[j++] = sp->seen[i];
+    sp->nseen = j;
+
+    children = malloc((sp->nseen ? sp->nseen : 1)*sizeof(char *));
+    tmp = malloc(strlen(sp->file)+5);
+    if (!children || !tmp)
+	goto Fail;
+    for (i = n = 0; i < sp->nseen; i++)
+	if (*sp->seen[i])
+	    children[n++] = sp->seen[i];
+    qsort(children, n, sizeof(char *), child_cmp);
+
+    sprintf(tmp, "%s.tmp", sp->file);
+    fp = fopen(tmp, "w");
+    if (!fp)
+	goto Fail;
+
+    memcpy(hdr, SN_MAGIC, sizeof(SN_MAGIC)-1);
+    put_le(hdr+sizeof(SN_MAGIC)-1, SN_VERSION, 4);
+    put_le(hdr+sizeof(SN_MAGIC)-1+4, sp->start.tv_sec, 8);
+    put_le(hdr+sizeof(SN_MAGIC)-1+4+8, sp->start.tv_nsec, 4);
+    put_le(hdr+sizeof(SN_MAGIC)-1+4+8+4, sp->rlen, 2);
+    put_le(b, sp->nseen, 8);
+    if (sp->rlen > 0xFFFF) {
+	errno = ENAMETOOLONG;
+	goto Fail;
+    }
+    if (fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+	fwrite(sp->root, 1, sp->rlen, fp) != sp->rlen ||
+	fwrite(b, 1, 8, fp) != 8)
+	goto Fail;
+
+    for (i = 0; i < sp->nseen; i++) {
+	const char *dir = sp->seen[i];
+	size_t dlen = strlen(dir);
+
+	if (dlen > 0xFFFF) {
+	    errno = ENAMETOOLONG;
+	    goto Fail;
+	}
+
+	/* The first of its subdirectories, if any */
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+	    k = (lo+hi)/2;
+	    if (parent_cmp(dir, dlen, children[k]) > 0)
+		lo = k+1;
+	    else
+		hi = k;
+	}
+
+	/* Its subdirectory names and an empty one */
+	len = 1;
+	for (k = lo; k < n && parent_cmp(dir, dlen, children[k]) == 0; k++) {
+	    plen = parent_len(children[k]);
+	    len += strlen(children[k]+plen+(plen > 0))+1;
+	}
+
+	put_le(b, dlen, 2);
+	put_le(b+2, len, 4);
+	if (fwrite(b, 1, 2, fp) != 2 ||
+	    fwrite(dir, 1, dlen, fp) != dlen ||
+	    fwrite(b+2, 1, 4, fp) != 4)
+	    goto Fail;
+	for (k = lo; k < n && parent_cmp(dir, dlen, children[k]) == 0; k++) {
+	    plen = parent_len(children[k]);
+	    fputs(children[k]+plen+(plen > 0), fp);
+	    putc('\0', fp);
+	}
+	if (putc('\0', fp) == EOF)
+	    goto Fail;
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+	goto Fail;
+    if (fclose(fp) != 0 || rename(tmp, sp->file) < 0) {
+	fp = NULL;
+	goto Fail;
+    }
+    free(tmp);
+    free(children);
+    return 0;
+
+ Fail:
+    if (fp)
+	fclose(fp);
+    if (tmp) {
+	unlink(tmp);
+	free(tmp);
+    }
+    free(children);
+    return -1;
+}
+
+
+uint64_t
+since_skipped(SINCE *sp) {
+    return sp->skipped;
+}
+
+void
+since_free(SINCE *sp) {
+    size_t i;
+
+    if (!sp)
+	return;
+    sdirs_free(sp);
+    for (i = 0; i < sp->nseen; i++)
+	free(sp->seen[i]);
+    free(sp->seen);
+    free(sp->root);
+    free(sp->file);
+    free(sp);
+}
@@ -0,0 +1,677 @@
+/*
+ * sort.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define _DEFAULT_SOURCE 1
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sort.h"
+
+/*
+ * External sort of the report, for --sort-by.
+ *
+ * Records are a 64 bit key, a path and some opaque data, ordered by the
+ * key and then the path. They are collected in one of two buffers of
+ * half the memory limit each, fixed size entries growing up from the
+ * start and the paths and data down from the end. When a buffer is full
+ * it is handed to a background thread that sorts it and writes it as a
+ * run to an unlinked temporary file, while the other buffer is filled.
+ * At the end the runs are merged, in several passes if there are too
+ * many of them to read at once with the memory we have. If nothing had
+ * to be spilled the buffer is just sorted in place.
+ *
+ * Runs are compressed: a path only stores what differs from the one
+ * before it (they are sorted, so that is mostly the last component),
+ * integers are varints and runs of zero bytes in the data (unset fields)
+ * are a zero and a count.
+ */
+
+#define SORT_IOBUF	(64*1024)	/* Per open run */
+#define SORT_MAXWAY	256
+
+typedef struct {
+    uint64_t key;
+    const char *path;		/* In the buffer, the data follows the NUL */
+    uint32_t plen;
+    uint32_t len;
+} SREC;
+
+typedef struct {
+    char *base;
+    size_t size;
+    size_t nrecs;		/* SREC:s from the start */
+    size_t top;			/* Paths and data from here to the end */
+} SBUF;
+
+typedef struct {
+    FILE *fp;
+    uint64_t nrecs;
+} SRUN;
+
+typedef struct {
+    FILE *fp;
+    char *prev;
+    size_t prev_len;
+    size_t prev_size;
+    uint64_t bytes;
+} SWRITER;
+
+typedef struct {
+    FILE *fp;
+    uint64_t left;
+    uint64_t key;
+    char *path;
+    size_t plen;
+    size_t psize;
+    unsigned char *data;
+    size_t len;
+    size_t dsize;
+} SREADER;
+
+struct sorter {
+    size_t mem;
+    char *tmpdir;
+
+    pthread_mutex_t mtx;
+    pthread_cond_t cv;
+    pthread_t tid;
+    int running;
+    int stop;
+
+    SBUF buf[2];
+    int cur;			/* Being filled */
+    int busy;			/* The other one is being spilled */
+    int error;			/* From the spill thread */
+
+    SRUN *runs;
+    size_t nruns;
+    size_t runs_size;
+
+    uint64_t records;
+    uint64_t nspilled;		/* Runs written, merge passes included */
+    uint64_t spilled;		/* Bytes */
+};
+
+
+static int
+rec_cmp(const void *a,
+	const void *b) {
+    const SREC *ra = a, *rb = b;
+
+    if (ra->key != rb->key)
+	return ra->key < rb->key ? -1 : 1;
+    return strcmp(ra->path, rb->path);
+}
+
+static int
+rd_cmp(const SREADER *a,
+       const SREADER *b) {
+    if (a->key != b->key)
+	return a->key < b->key ? -1 : 1;
+    return strcmp(a->path, b->path);
+}
+
+
+static int
+grow(void *pp,
+     size_t *sizep,
+     size_t need) {
+    void *np;
+    size_t size = *sizep ? *sizep : 256;
+
+    if (need <= *sizep)
+	return 0;
+    while (size < need)
+	size *= 2;
+    np = realloc(*(void **) pp, size);
+    if (!np)
+	return -1;
+    *(void **) pp = np;
+    *sizep = size;
+    return 0;
+}
+
+
+static void
+put_varint(SWRITER *wp,
+	   uint64_t v) {
+    while (v >= 0x80) {
+	putc_unlocked((v & 0x7F) | 0x80, wp->fp);
+	v >>= 7;
+	wp->bytes++;
+    }
+    putc_unlocked(v, wp->fp);
+    wp->bytes++;
+}
+
+static int
+get_varint(FILE *fp,
+	   uint64_t *vp) {
+    uint64_t v = 0;
+    int c, shift;
+
+    for (shift = 0; shift < 64; shift += 7) {
+	if ((c = getc_unlocked(fp)) == EOF)
+	    return -1;
+	v |= (uint64_t) (c & 0x7F) << shift;
+	if ((c & 0x80) == 0) {
+	    *vp = v;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+
+static int
+sw_put(SWRITER *wp,
+       uint64_t key,
+       const char *path,
+       size_t plen,
+       const unsigned char *data,
+       size_t len) {
+    size_t p, i, n;
+
+    for (p = 0; p < plen && p < wp->prev_len && path[p] == wp->prev[p]; p++)
+	;
+    put_varint(wp, key);
+    put_varint(wp, p);
+    put_varint(wp, plen-p);
+    fwrite(path+p, 1, plen-p, wp->fp);
+    wp->bytes += plen-p;
+
+    put_varint(wp, len);
+    for (i = 0; i < len; i += n) {
+	if (data[i] != 0) {
+	    putc_unlocked(data[i], wp->fp);
+	    wp->bytes++;
+	    n = 1;
+	    continue;
+	}
+	for (n = 1; n < 255 && i+n < len && data[i+n] == 0; n++)
+	    ;
+	putc_unlocked(0, wp->fp);
+	putc_unlocked(n, wp->fp);
+	wp->bytes += 2;
+    }
+
+    if (grow(&wp->prev, &wp->prev_size, plen) < 0)
+	return -1;
+    memcpy(wp->prev+p, path+p, plen-p);
+    wp->prev_len = plen;
+    return ferror(wp->fp) ? -1 : 0;
+}
+
+/* Returns 1 if a record was read, 0 at the end of the run */
+static int
+rd_next(SREADER *rp) {
+    uint64_t key, p, n, len;
+    size_t i;
+    int c;
+
+    if (rp->left == 0)
+	return 0;
+
+    if (get_varint(rp->fp, &key) < 0 ||
+	get_varint(rp->fp, &p) < 0 ||
+	get_varint(rp->fp, &n) < 0 ||
+	p > rp->plen)
+	goto Invalid;
+    if (grow(&rp->path, &rp->psize, p+n+1) < 0)
+	return -1;
+    if (fread(rp->path+p, 1, n, rp->fp) != n)
+	goto Invalid;
+    rp->path[p+n] = '\0';
+    rp->plen = p+n;
+    rp->key = key;
+
+    if (get_varint(rp->fp, &len) < 0)
+	goto Invalid;
+    if (grow(&rp->data, &rp->dsize, len) < 0)
+	return -1;
+    for (i = 0; i < len; ) {
+	if ((c = getc_unlocked(rp->fp)) == EOF)
+	    goto Invalid;
+	if (c != 0) {
+	    rp->data[i++] = c;
+	    continue;
+	}
+	if ((c = getc_unlocked(rp->fp)) == EOF || c == 0 || i+c > len)
+	    goto Invalid;
+	memset(rp->data+i, 0, c);
+	i += c;
+    }
+    rp->len = len;
+    rp->left--;
+    return 1;
+
+ Invalid:
+    errno = ferror(rp->fp) ? EIO : EINVAL;
+    return -1;
+}
+
+
+static FILE *
+run_create(SORTER *sp) {
+    char *tmp;
+    int fd;
+    FILE *fp;
+
+    tmp = malloc(strlen(sp->tmpdir)+32);
+    if (!tmp)
+	return NULL;
+    sprintf(tmp, "%s/dosattrib-sort.XXXXXX", sp->tmpdir);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+	free(tmp);
+	return NULL;
+    }
+    unlink(tmp);
+    free(tmp);
+
+    fp = fdopen(fd, "w+");
+    if (!fp) {
+	close(fd);
+	return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, SORT_IOBUF);
+    return fp;
+}
+
+static int
+run_push(SORTER *sp,
+	 FILE *fp,
+	 uint64_t nrecs,
+	 uint64_t bytes) {
+    int rc = 0;
+
+    pthread_mutex_lock(&sp->mtx);
+    if (grow(&sp->runs, &sp->runs_size, (sp->nruns+1)*sizeof(SRUN)) < 0) {
+	fclose(fp);
+	rc = -1;
+    } else {
+	sp->runs[sp->nruns].fp = fp;
+	sp->runs[sp->nruns].nrecs = nrecs;
+	sp->nruns++;
+	sp->nspilled++;
+	sp->spilled += bytes;
+    }
+    pthread_mutex_unlock(&sp->mtx);
+    return rc;
+}
+
+/* Sort a full buffer and write it out as a run */
+static int
+sort_spill(SORTER *sp,
+	   SBUF *bp) {
+    SWRITER w;
+    SREC *rp = (SREC *) bp->base;
+    size_t i;
+
+    qsort(rp, bp->nrecs, sizeof(SREC), rec_cmp);
+
+    memset(&w, 0, sizeof(w));
+    w.fp = run_create(sp);
+    if (!w.fp)
+	return -1;
+    for (i = 0; i < bp->nrecs; i++)
+	if (sw_put(&w, rp[i].key, rp[i].path, rp[i].plen,
+		   (unsigned char *) rp[i].path+rp[i].plen+1, rp[i].len) < 0)
+	    break;
+    free(w.prev);
+    if (i < bp->nrecs || fflush(w.fp) != 0) {
+	fclose(w.fp);
+	return -1;
+    }
+
+    bp->nrecs = 0;
+    bp->top = bp->size;
+    return run_push(sp, w.fp, i, w.bytes);
+}
+
+static void *
+sort_spiller(void *arg) {
+    SORTER *sp = arg;
+    int rc;
+
+    pthread_mutex_lock(&sp->mtx);
+    for (;;) {
+	while (!sp->busy && !sp->stop)
+	    pthread_cond_wait(&sp->cv, &sp->mtx);
+	if (!sp->busy)
+	    break;
+	pthread_mutex_unlock(&sp->mtx);
+
+	rc = sort_spill(sp, &sp->buf[!sp->cur]);
+
+	pthread_mutex_lock(&sp->mtx);
+	if (rc < 0 && !sp->error)
+	    sp->error = errno ? errno : EIO;
+	sp->busy = 0;
+	pthread_cond_broadcast(&sp->cv);
+    }
+    pthread_mutex_unlock(&sp->mtx);
+    return NULL;
+}
+
+/* Wait for the spill thread to finish what it has and stop it */
+static void
+sort_quiesce(SORTER *sp) {
+    pthread_mutex_lock(&sp->mtx);
+    while (sp->busy)
+	pthread_cond_wait(&sp->cv, &sp->mtx);
+    sp->stop = 1;
+    pthread_cond_broadcast(&sp->cv);
+    pthread_mutex_unlock(&sp->mtx);
+
+    if (sp->running) {
+	pthread_join(sp->tid, NULL);
+	sp->running = 0;
+    }
+}
+
+
+static void
+heap_down(SREADER **heap,
+	  size_t nh,
+	  size_t i) {
+    SREADER *tmp;
+    size_t c;
+
+    while ((c = 2*i+1) < nh) {
+	if (c+1 < nh && rd_cmp(heap[c+1], heap[c]) < 0)
+	    c++;
+	if (rd_cmp(heap[i], heap[c]) <= 0)
+	    break;
+	tmp = heap[i];
+	heap[i] = heap[c];
+	heap[c] = tmp;
+	i = c;
+    }
+}
+
+/* Merge runs in order, either into another run or to the callback */
+static int
+sort_merge(SRUN *runs,
+	   size_t nruns,
+	   SWRITER *wp,
+	   SORT_FN fn,
+	   void *arg) {
+    SREADER *rv, **heap, *tmp;
+    size_t i, nh = 0;
+    int rc = -1;
+
+    rv = calloc(nruns, sizeof(*rv));
+    heap = calloc(nruns, sizeof(*heap));
+    if (!rv || !heap)
+	goto End;
+
+    for (i = 0; i < nruns; i++) {
+	rv[i].fp = runs[i].fp;
+	rv[i].left = runs[i].nrecs;
+	rewind(rv[i].fp);
+	switch (rd_next(&rv[i])) {
+	case -1:
+	    goto End;
+	case 1:
+	    heap[nh++] = &rv[i];
+	}
+    }
+
+    for (i = nh/2; i > 0; i--)
+	heap_down(heap, nh, i-1);
+
+    while (nh > 0) {
+	tmp = heap[0];
+	if ((wp ? sw_put(wp, tmp->key, tmp->path, tmp->plen, tmp->data, tmp->len) :
+	     fn(tmp->path, tmp->data, tmp->len, arg)) < 0)
+	    goto End;
+	switch (rd_next(tmp)) {
+	case -1:
+	    goto End;
+	case 0:
+	    heap[0] = heap[--nh];
+	}
+	heap_down(heap, nh, 0);
+    }
+    rc = 0;
+
+ End:
+    if (rv)
+	for (i = 0; i < nruns; i++) {
+	    free(rv[i].path);
+	    free(rv[i].data);
+	}
+    free(rv);
+    free(heap);
+    return rc;
+}
+
+
+SORTER *
+sort_open(size_t mem,
+	  const char *tmpdir) {
+    SORTER *sp;
+
+    sp = calloc(1, sizeof(*sp));
+    if (!sp)
+	return NULL;
+    sp->mem = mem;
+    sp->tmpdir = strdup(tmpdir);
+    if (!sp->tmpdir) {
+	free(sp);
+	return NULL;
+    }
+    pthread_mutex_init(&sp->mtx, NULL);
+    pthread_cond_init(&sp->cv, NULL);
+    return sp;
+}
+
+static int
+sbuf_room(SORTER *sp,
+	  SBUF *bp,
+	  size_t need) {
+    if (!bp->base) {
+	bp->size = sp->mem/2;
+	bp->base = malloc(bp->size);
+	if (!bp->base)
+	    return -1;
+	bp->nrecs = 0;
+	bp->top = bp->size;
+    }
+    return (bp->nrecs+1)*sizeof(SREC)+need <= bp->top;
+}
+
+/* Safe to call from several threads */
+int
+sort_add(SORTER *sp,
+	 uint64_t key,
+	 const char *path,
+	 const void *data,
+	 size_t len) {
+    size_t plen = strlen(path), need = plen+1+len;
+    SBUF *bp;
+    SREC *rp;
+    int rc;
+
+    if (sizeof(SREC)+need > sp->mem/2 || plen > UINT32_MAX || len > UINT32_MAX) {
+	errno = E2BIG;
+	return -1;
+    }
+
+    pthread_mutex_lock(&sp->mtx);
+    bp = &sp->buf[sp->cur];
+    if ((rc = sbuf_room(sp, bp, need)) == 0) {
+	/* Hand it over to be spilled once the last one is done */
+	while (sp->busy)
+	    pthread_cond_wait(&sp->cv, &sp->mtx);
+	if (sp->error) {
+	    errno = sp->error;
+	    goto Fail;
+	}
+	if (!sp->running) {
+	    if ((errno = pthread_create(&sp->tid, NULL, sort_spiller, sp)) != 0)
+		goto Fail;
+	    sp->running = 1;
+	}
+	sp->busy = 1;
+	sp->cur = !sp->cur;
+	pthread_cond_broadcast(&sp->cv);
+
+	bp = &sp->buf[sp->cur];
+	rc = sbuf_room(sp, bp, need);
+    }
+    if (rc < 0)
+	goto Fail;
+
+    bp->top -= need;
+    memcpy(bp->base+bp->top, path, plen+1);
+    memcpy(bp->base+bp->top+plen+1, data, len);
+    rp = (SREC *) bp->base + bp->nrecs++;
+    rp->key = key;
+    rp->path = bp->base+bp->top;
+    rp->plen = plen;
+    rp->len = len;
+    sp->records++;
+    pthread_mutex_unlock(&sp->mtx);
+    return 0;
+
+ Fail:
+    pthread_mutex_unlock(&sp->mtx);
+    return -1;
+}
+
+int
+sort_finish(SORTER *sp,
+	    SORT_FN fn,
+	    void *arg) {
+    SBUF *bp = &sp->buf[sp->cur];
+    SREC *rp = (SREC *) bp->base;
+    size_t i, way;
+
+    sort_quiesce(sp);
+    if (sp->error) {
+	errno = sp->error;
+	return -1;
+    }
+
+    if (sp->nruns == 0) {
+	/* It all fit in memory */
+	if (rp)
+	    qsort(rp, bp->nrecs, sizeof(SREC), rec_cmp);
+	for (i = 0; i < bp->nrecs; i++)
+	    if (fn(rp[i].path, rp[i].path+rp[i].plen+1, rp[i].len, arg) < 0)
+		return -1;
+	return 0;
+    }
+
+    if (bp->nrecs > 0 && sort_spill(sp, bp) < 0)
+	return -1;
+    for (i = 0; i < 2; i++) {
+	free(sp->buf[i].base);
+	sp->buf[i].base = NULL;
+    }
+
+    /* Each open run needs its I/O buffer, merge in passes if needed */
+    way = sp->mem/SORT_IOBUF;
+    if (way > SORT_MAXWAY)
+	way = SORT_MAXWAY;
+    if (way < 2)
+	way = 2;
+
+    while (sp->nruns > way) {
+	SWRITER w;
+	uint64_t nrecs = 0;
+	int rc;
+
+	for (i = 0; i < way; i++)
+	    nrecs += sp->runs[i].nrecs;
+	memset(&w, 0, sizeof(w));
+	w.fp = run_create(sp);
+	if (!w.fp)
+	    return -1;
+	rc = sort_merge(sp->runs, way, &w, NULL, NULL);
+	free(w.prev);
+	if (rc < 0 || fflush(w.fp) != 0) {
+	    fclose(w.fp);
+	    return -1;
+	}
+
+	for (i = 0; i < way; i++)
+	    fclose(sp->runs[i].fp);
+	sp->nruns -= way;
+	memmove(sp->runs, sp->runs+way, sp->nruns*sizeof(SRUN));
+	if (run_push(sp, w.fp, nrecs, w.bytes) < 0)
+	    return -1;
+    }
+
+    return sort_merge(sp->runs, sp->nruns, NULL, fn, arg);
+}
+
+void
+sort_stats(SORTER *sp,
+	   uint64_t *records,
+	   uint64_t *runs,
+	   uint64_t *spilled) {
+    *records = sp->records;
+    *runs = sp->nspilled;
+    *spilled = sp->spilled;
+}
+
+void
+sort_free(SORTER *sp) {
+    size_t i;
+
+    sort_quiesce(sp);
+    for (i = 0; i < sp->nruns; i++)
+	fclose(sp->runs[i].fp);
+    free(sp->runs);
+    free(sp->buf[0].base);
+    free(sp->buf[1].base);
+    free(sp->tmpdir);
+    pthread_mutex_destroy(&sp->mtx);
+    pthread_cond_destroy(&sp->cv);
+    free(sp);
+}
@@ -0,0 +1,74 @@
+/*
+ * sort.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SORT_H
+#define SORT_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct sorter SORTER;
+
+/* Called for each record in order, a negative return stops the merge */
+typedef int (*SORT_FN)(const char *path,
+		       const void *data,
+		       size_t len,
+		       void *arg);
+
+extern SORTER *
+sort_open(size_t mem,
+	  const char *tmpdir);
+
+extern int
+sort_add(SORTER *sp,
+	 uint64_t key,
+	 const char *path,
+	 const void *data,
+	 size_t len);
+
+extern int
+sort_finish(SORTER *sp,
+	    SORT_FN fn,
+	    void *arg);
+
+extern void
+sort_stats(SORTER *sp,
+	   uint64_t *records,
+	   uint64_t *runs,
+	   uint64_t *spilled);
+
+extern void
+sort_free(SORTER *sp);
+
+#endif
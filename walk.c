@@ -0,0 +1,698 @@
+/*
+ * walk.c - Bounded memory & fd directory tree traversal
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define _DEFAULT_SOURCE 1
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#if defined(__linux__)
+#  include <sys/syscall.h>
+#  if defined(SYS_getdents64)
+#    define USE_GETDENTS64 1
+#  endif
+#endif
+
+#include "metrics.h"
+#include "faults.h"
+#include "walk.h"
+
+#ifndef O_CLOEXEC
+#  define O_CLOEXEC 0
+#endif
+
+/*
+ * Directories are read in fixed size chunks and every subdirectory
+ * found is descended into at once (depth first, like nftw()) as long
+ * as we are within the fd budget and memory limit. If not the
+ * subdirectory name is deferred and processed after the current
+ * directory has been read and closed (breadth first). Deferred names
+ * are kept in small chunks and spilled to a temporary file when the
+ * memory limit is reached, so huge directories use bounded memory.
+ *
+ * The callback is called pre-order with the same arguments as nftw()
+ * with FTW_PHYS would use. A directory that fails to read part way is
+ * reported again, as FTW_DNR, and the subdirectories found before that
+ * are still walked. With a state function the state of each
+ * entry is derived from its directory's and available to the callback
+ * in the WALK struct. Directories keep their state while being read and
+ * it is derived again for deferred subdirectories, so no states need to
+ * be saved.
+ *
+ * With a skip function entries may be left out of the callbacks (but
+ * directories are still walked), and with a subdirs function a
+ * directory known not to have changed is not read at all, only the
+ * subdirectories it returns are walked. With a lookahead function the
+ * names after the current one in the chunk are passed to it as we go,
+ * until it refuses one, so it stays a window ahead of the walk.
+ */
+
+#define DEFER_CHUNK	16384
+
+#if defined(USE_GETDENTS64)
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+typedef struct {
+    int fd;
+    const char *names;		/* Given instead of reading the directory */
+#if defined(USE_GETDENTS64)
+    char *buf;
+    size_t pos;
+    size_t len;
+    size_t ahead;		/* Passed to the lookahead function up to here */
+#else
+    DIR *dp;
+#endif
+} DSTREAM;
+
+typedef struct dchunk {
+    struct dchunk *next;
+    size_t len;
+    char data[DEFER_CHUNK];
+} DCHUNK;
+
+typedef struct {
+    DCHUNK *head;
+    DCHUNK *tail;
+    FILE *spill;
+} DEFER;
+
+typedef struct {
+    WALK *w;
+    WALK_FN fn;
+    char *path;
+    size_t path_size;
+    int fds;
+    size_t mem;
+} WCTX;
+
+
+
+void
+walk_init(WALK *wp) {
+    struct rlimit rl;
+
+    memset(wp, 0, sizeof(*wp));
+
+    wp->fd_budget = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+	rl.rlim_cur < (rlim_t) wp->fd_budget+32)
+	wp->fd_budget = rl.rlim_cur > 33 ? rl.rlim_cur-32 : 1;
+
+    wp->mem_limit = 64*1024*1024;
+    wp->bufsize = 32*1024;
+}
+
+
+static int
+mem_get(WCTX *cp,
+	size_t size,
+	int force) {
+    if (!force && cp->mem+size > cp->w->mem_limit)
+	return -1;
+
+    cp->mem += size;
+    if (cp->mem > cp->w->mem_peak)
+	cp->w->mem_peak = cp->mem;
+    return 0;
+}
+
+static void
+mem_put(WCTX *cp,
+	size_t size) {
+    cp->mem -= size;
+}
+
+static void
+fd_get(WCTX *cp) {
+    if (++cp->fds > cp->w->fds_peak)
+	cp->w->fds_peak = cp->fds;
+}
+
+static void
+fd_put(WCTX *cp,
+       int fd) {
+    close(fd);
+    cp->fds--;
+}
+
+
+static size_t
+path_push(WCTX *cp,
+	  const char *name) {
+    size_t len = strlen(cp->path);
+    size_t nlen = len+strlen(name)+2;
+    char *np;
+
+    if (nlen > cp->path_size) {
+	np = realloc(cp->path, nlen+256);
+	if (!np)
+	    return (size_t) -1;
+	cp->path = np;
+	cp->path_size = nlen+256;
+    }
+
+    if (len > 0 && cp->path[len-1] != '/')
+	strcpy(cp->path+len, "/");
+    strcat(cp->path, name);
+    return len;
+}
+
+static void
+path_pop(WCTX *cp,
+	 size_t len) {
+    cp->path[len] = '\0';
+}
+
+
+static int
+ds_open(WCTX *cp,
+	DSTREAM *dsp,
+	int fd) {
+    dsp->fd = fd;
+    dsp->names = NULL;
+#if defined(USE_GETDENTS64)
+    /* Always allow one buffer so we make progress */
+    mem_get(cp, cp->w->bufsize, 1);
+    dsp->buf = malloc(cp->w->bufsize);
+    if (!dsp->buf) {
+	mem_put(cp, cp->w->bufsize);
+	return -1;
+    }
+    dsp->pos = dsp->len = dsp->ahead = 0;
+#else
+    mem_get(cp, sizeof(DIR *), 1);
+    dsp->dp = fdopendir(fd);
+    if (!dsp->dp) {
+	mem_put(cp, sizeof(DIR *));
+	return -1;
+    }
+#endif
+    return 0;
+}
+
+/* A directory that is not to be read, with the names to use instead */
+static void
+ds_list(DSTREAM *dsp,
+	int fd,
+	const char *names) {
+    memset(dsp, 0, sizeof(*dsp));
+    dsp->fd = fd;
+    dsp->names = names;
+}
+
+/* Returns NULL at end of directory (errno set on errors) */
+static const char *
+ds_next(WCTX *cp,
+	DSTREAM *dsp) {
+#if defined(USE_GETDENTS64)
+    struct linux_dirent64 *dep;
+    long rc;
+    uint64_t t0;
+
+    if (dsp->names) {
+	const char *name = dsp->names;
+
+	errno = 0;
+	if (!*name)
+	    return NULL;
+	dsp->names += strlen(name)+1;
+	return name;
+    }
+
+    if (dsp->pos >= dsp->len) {
+	METRICS_START(t0);
+	do {
+	    rc = FAULT(METRIC_TRAVERSE) ? -1 : syscall(SYS_getdents64, dsp->fd, dsp->buf, cp->w->bufsize);
+	} while (rc < 0 && errno == EINTR);
+	METRICS_STOP(METRIC_TRAVERSE, t0);
+	if (rc <= 0) {
+	    if (rc == 0)
+		errno = 0;
+	    return NULL;
+	}
+	dsp->len = rc;
+	dsp->pos = 0;
+	dsp->ahead = 0;
+    }
+
+    /* Slide the lookahead along, as far as it takes names */
+    if (cp->w->ahead_fn) {
+	if (dsp->ahead < dsp->pos)
+	    dsp->ahead = dsp->pos;
+	for (; dsp->ahead < dsp->len; dsp->ahead += dep->d_reclen) {
+	    dep = (struct linux_dirent64 *) (dsp->buf+dsp->ahead);
+	    if ((dep->d_name[0] != '.' ||
+		 (dep->d_name[1] != '\0' && (dep->d_name[1] != '.' || dep->d_name[2] != '\0'))) &&
+		cp->w->ahead_fn(cp->path, dep->d_name) < 0)
+		break;
+	}
+    }
+
+    dep = (struct linux_dirent64 *) (dsp->buf+dsp->pos);
+    dsp->pos += dep->d_reclen;
+    return dep->d_name;
+#else
+    struct dirent *dep;
+    uint64_t t0;
+
+    if (dsp->names) {
+	const char *name = dsp->names;
+
+	errno = 0;
+	if (!*name)
+	    return NULL;
+	dsp->names += strlen(name)+1;
+	return name;
+    }
+
+    METRICS_START(t0);
+    do {
+	errno = 0;
+	dep = FAULT(METRIC_TRAVERSE) ? NULL : readdir(dsp->dp);
+    } while (!dep && errno == EINTR);
+    METRICS_STOP(METRIC_TRAVERSE, t0);
+    return dep ? dep->d_name : NULL;
+#endif
+}
+
+static void
+ds_close(WCTX *cp,
+	 DSTREAM *dsp) {
+    if (dsp->names) {
+	fd_put(cp, dsp->fd);
+	return;
+    }
+#if defined(USE_GETDENTS64)
+    free(dsp->buf);
+    mem_put(cp, cp->w->bufsize);
+    fd_put(cp, dsp->fd);
+#else
+    closedir(dsp->dp);
+    mem_put(cp, sizeof(DIR *));
+    cp->fds--;
+#endif
+}
+
+
+static int
+defer_add(WCTX *cp,
+	  DEFER *dp,
+	  const char *name) {
+    size_t len = strlen(name)+1;
+    DCHUNK *chp;
+
+    cp->w->deferred++;
+
+    if (!dp->spill) {
+	if (dp->tail && dp->tail->len+len <= DEFER_CHUNK) {
+	    memcpy(dp->tail->data+dp->tail->len, name, len);
+	    dp->tail->len += len;
+	    return 0;
+	}
+
+	if (mem_get(cp, sizeof(DCHUNK), 0) == 0) {
+	    chp = malloc(sizeof(DCHUNK));
+	    if (!chp) {
+		mem_put(cp, sizeof(DCHUNK));
+		return -1;
+	    }
+	    chp->next = NULL;
+	    memcpy(chp->data, name, len);
+	    chp->len = len;
+	    if (dp->tail)
+		dp->tail->next = chp;
+	    else
+		dp->head = chp;
+	    dp->tail = chp;
+	    return 0;
+	}
+
+	/* Out of memory budget - everything from now on goes to disk */
+	dp->spill = tmpfile();
+	if (!dp->spill)
+	    return -1;
+    }
+
+    cp->w->spilled++;
+    if (fwrite(name, 1, len, dp->spill) != len)
+	return -1;
+    return 0;
+}
+
+static void
+defer_free(WCTX *cp,
+	   DEFER *dp) {
+    DCHUNK *chp;
+
+    while ((chp = dp->head) != NULL) {
+	dp->head = chp->next;
+	free(chp);
+	mem_put(cp, sizeof(DCHUNK));
+    }
+    dp->tail = NULL;
+
+    if (dp->spill) {
+	fclose(dp->spill);
+	dp->spill = NULL;
+    }
+}
+
+
+static const void *
+state_next(WCTX *cp,
+	   const void *dstate,
+	   const char *name) {
+    return cp->w->state_fn ? cp->w->state_fn(dstate, name) : NULL;
+}
+
+
+static int
+walk_dir(WCTX *cp,
+	 int fd,
+	 int level,
+	 const void *dstate);
+
+/*
+ * Open and walk a subdirectory, by name relative to an open parent
+ * directory (pfd >= 0) or by the full path in the context. It has
+ * already been reported (as FTW_D) and was readable then, so if it
+ * can't be opened now it was changed or removed since and is skipped.
+ */
+static int
+walk_subdir(WCTX *cp,
+	    int pfd,
+	    const char *name,
+	    int level,
+	    const void *state) {
+    int fd;
+
+    cp->w->state = state;
+    if (pfd >= 0)
+	fd = openat(pfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    else
+	fd = open(cp->path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+
+    if (fd < 0)
+	return errno == EMFILE || errno == ENFILE ? -1 : 0;
+
+    fd_get(cp);
+    return walk_dir(cp, fd, level, state);
+}
+
+
+/*
+ * Walk an open directory (the fd is closed when done). The time spent
+ * on the directory's own entries, excluding subdirectories, is recorded
+ * for the slowest-directory metrics.
+ */
+static int
+walk_dir(WCTX *cp,
+	 int fd,
+	 int level,
+	 const void *dstate) {
+    DSTREAM ds;
+    DEFER def;
+    struct stat sb;
+    struct FTW ftw;
+    const char *name, *names = NULL;
+    char nbuf[4096];
+    const void *state;
+    size_t dlen, nlen;
+    uint64_t t0, t1, tsub = 0, nent = 0;
+    int rc = 0, type, c, skip;
+
+
+    memset(&def, 0, sizeof(def));
+    if (cp->w->subdirs_fn && fstat(fd, &sb) == 0)
+	names = cp->w->subdirs_fn(cp->path, &sb);
+    if (names) {
+	ds_list(&ds, fd, names);
+	cp->w->pruned++;
+    } else if (ds_open(cp, &ds, fd) < 0) {
+	fd_put(cp, fd);
+	return -1;
+    }
+
+    cp->w->dirs++;
+    dlen = strlen(cp->path);
+    t0 = metrics_enabled ? metrics_now() : 0;
+
+    while ((name = ds_next(cp, &ds)) != NULL) {
+	uint64_t t2;
+
+	if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+	    continue;
+
+	cp->w->entries++;
+	nent++;
+	if (path_push(cp, name) == (size_t) -1) {
+	    rc = -1;
+	    break;
+	}
+	ftw.base = strlen(cp->path)-strlen(name);
+	ftw.level = level+1;
+	cp->w->state = state = state_next(cp, dstate, name);
+
+	METRICS_START(t2);
+	do {
+	    rc = FAULT(METRIC_LSTAT) ? -1 : fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW);
+	} while (rc < 0 && errno == EINTR);
+	skip = 0;
+	if (rc == 0 && cp->w->skip_fn)
+	    skip = cp->w->skip_fn(cp->path, &sb);
+
+	if (rc < 0 && ds.names && errno == ENOENT) {
+	    /* Gone since it was listed */
+	    METRICS_STOP(METRIC_LSTAT, t2);
+	    rc = 0;
+	} else if (rc < 0) {
+	    METRICS_STOP(METRIC_LSTAT, t2);
+	    memset(&sb, 0, sizeof(sb));
+	    rc = cp->fn(cp->path, &sb, FTW_NS, &ftw);
+	} else if (S_ISDIR(sb.st_mode)) {
+	    METRICS_STOP(METRIC_LSTAT, t2);
+	    if (cp->fds < cp->w->fd_budget &&
+		cp->mem+cp->w->bufsize <= cp->w->mem_limit) {
+		int cfd;
+
+		/* Depth first - nftw() style */
+		cfd = openat(fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		if (cfd < 0)
+		    rc = cp->fn(cp->path, &sb, FTW_DNR, &ftw);
+		else {
+		    fd_get(cp);
+		    rc = skip ? 0 : cp->fn(cp->path, &sb, FTW_D, &ftw);
+		    if (rc == 0) {
+			t2 = metrics_enabled ? metrics_now() : 0;
+			rc = walk_dir(cp, cfd, level+1, state);
+			if (metrics_enabled)
+			    tsub += metrics_now()-t2;
+		    } else
+			fd_put(cp, cfd);
+		}
+	    } else {
+		int cfd;
+
+		/* Breadth first - come back to it later, if we can read it */
+		cfd = openat(fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		if (cfd < 0)
+		    rc = cp->fn(cp->path, &sb, FTW_DNR, &ftw);
+		else {
+		    close(cfd);
+		    rc = skip ? 0 : cp->fn(cp->path, &sb, FTW_D, &ftw);
+		    if (rc == 0 && defer_add(cp, &def, name) < 0)
+			rc = -1;
+		}
+	    }
+	} else {
+	    METRICS_STOP(METRIC_LSTAT, t2);
+	    type = S_ISLNK(sb.st_mode) ? FTW_SL : FTW_F;
+	    rc = skip ? 0 : cp->fn(cp->path, &sb, type, &ftw);
+	}
+
+	path_pop(cp, dlen);
+	if (rc != 0)
+	    break;
+
+	if (metrics_enabled)
+	    metrics_poll(metrics_now());
+    }
+
+    /* A read error part way, report the rest of the directory as unreadable */
+    if (rc == 0 && errno != 0) {
+	const char *base = strrchr(cp->path, '/');
+	int err = errno;
+
+	if (fstat(fd, &sb) < 0)
+	    memset(&sb, 0, sizeof(sb));
+	ftw.base = base && base[1] ? base+1-cp->path : 0;
+	ftw.level = level;
+	errno = err;
+	rc = cp->fn(cp->path, &sb, FTW_DNR, &ftw);
+    }
+
+    ds_close(cp, &ds);
+
+    if (metrics_enabled) {
+	t1 = metrics_now();
+	metrics_dir_add(cp->path, t1-t0-tsub, nent);
+    }
+
+    /* Now the deferred subdirectories, from memory first and then from disk */
+    if (rc == 0) {
+	DCHUNK *chp;
+	size_t pos;
+
+	for (chp = def.head; rc == 0 && chp; chp = chp->next)
+	    for (pos = 0; rc == 0 && pos < chp->len; pos += strlen(chp->data+pos)+1) {
+		if (path_push(cp, chp->data+pos) == (size_t) -1) {
+		    rc = -1;
+		    break;
+		}
+		rc = walk_subdir(cp, -1, chp->data+pos, level+1,
+				 state_next(cp, dstate, chp->data+pos));
+		path_pop(cp, dlen);
+	    }
+
+	if (rc == 0 && def.spill) {
+	    rewind(def.spill);
+	    nlen = 0;
+	    while (rc == 0 && (c = getc(def.spill)) != EOF) {
+		if (nlen < sizeof(nbuf))
+		    nbuf[nlen++] = c;
+		if (c != '\0')
+		    continue;
+
+		nbuf[sizeof(nbuf)-1] = '\0';
+		if (path_push(cp, nbuf) == (size_t) -1) {
+		    rc = -1;
+		    break;
+		}
+		rc = walk_subdir(cp, -1, nbuf, level+1,
+				 state_next(cp, dstate, nbuf));
+		path_pop(cp, dlen);
+		nlen = 0;
+	    }
+	}
+    }
+
+    defer_free(cp, &def);
+    return rc;
+}
+
+
+int
+walk_tree(const char *root,
+	  WALK *wp,
+	  WALK_FN fn) {
+    WCTX ctx;
+    struct stat sb;
+    struct FTW ftw;
+    const void *state = wp->state;
+    int rc, fd;
+    uint64_t t0;
+
+
+    wp->fds_peak = 0;
+    wp->mem_peak = 0;
+    wp->dirs = wp->entries = wp->deferred = wp->spilled = wp->pruned = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.w = wp;
+    ctx.fn = fn;
+    if (wp->fd_budget < 1)
+	wp->fd_budget = 1;
+    if (wp->bufsize < 1024)
+	wp->bufsize = 1024;
+
+    ctx.path_size = strlen(root)+256;
+    ctx.path = malloc(ctx.path_size);
+    if (!ctx.path)
+	return -1;
+    strcpy(ctx.path, root);
+
+    ftw.base = 0;
+    ftw.level = 0;
+
+    METRICS_START(t0);
+    do {
+	rc = FAULT(METRIC_LSTAT) ? -1 : lstat(root, &sb);
+    } while (rc < 0 && errno == EINTR);
+    METRICS_STOP(METRIC_LSTAT, t0);
+    if (rc < 0) {
+	free(ctx.path);
+	return -1;
+    }
+
+    wp->entries++;
+    if (!S_ISDIR(sb.st_mode))
+	rc = fn(root, &sb, S_ISLNK(sb.st_mode) ? FTW_SL : FTW_F, &ftw);
+    else {
+	fd = open(root, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd < 0)
+	    rc = fn(root, &sb, FTW_DNR, &ftw);
+	else {
+	    fd_get(&ctx);
+	    rc = fn(root, &sb, FTW_D, &ftw);
+	    if (rc == 0)
+		rc = walk_dir(&ctx, fd, 0, state);
+	    else
+		fd_put(&ctx, fd);
+	}
+    }
+
+    free(ctx.path);
+    return rc;
+}
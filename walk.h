@@ -0,0 +1,101 @@
+/*
+ * walk.h
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WALK_H
+#define WALK_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ftw.h>
+
+/* Same calling convention as nftw() callbacks */
+typedef int (*WALK_FN)(const char *path,
+		       const struct stat *sp,
+		       int type,
+		       struct FTW *fp);
+
+/* Derives the state of an entry from that of the directory it is in */
+typedef const void *(*WALK_STATE_FN)(const void *parent,
+				     const char *name);
+
+/* Returns 1 if an entry should not be passed to the callback */
+typedef int (*WALK_SKIP_FN)(const char *path,
+			    const struct stat *sp);
+
+/*
+ * Returns the subdirectories of a directory (each name NUL terminated,
+ * ending with an empty one) if it need not be read, else NULL
+ */
+typedef const char *(*WALK_SUBDIRS_FN)(const char *path,
+				       const struct stat *sp);
+
+/* Told about the next entries of a directory, returns -1 to be asked again later */
+typedef int (*WALK_AHEAD_FN)(const char *dir,
+			     const char *name);
+
+typedef struct {
+    int fd_budget;		/* Max number of directories open at once */
+    size_t mem_limit;		/* Max bytes for directory buffers & deferred names */
+    size_t bufsize;		/* Directory read buffer size */
+
+    /* Optional per-entry state, set to the top's before walk_tree() */
+    WALK_STATE_FN state_fn;
+    const void *state;		/* Of the entry passed to the callback */
+
+    /* Optional pruning, skipped directories are still walked */
+    WALK_SKIP_FN skip_fn;
+    WALK_SUBDIRS_FN subdirs_fn;
+
+    /* Optional lookahead, only with getdents() */
+    WALK_AHEAD_FN ahead_fn;
+
+    /* Statistics */
+    int fds_peak;
+    size_t mem_peak;
+    uint64_t dirs;
+    uint64_t entries;
+    uint64_t deferred;
+    uint64_t spilled;
+    uint64_t pruned;		/* Directories not read */
+} WALK;
+
+extern void
+walk_init(WALK *wp);
+
+extern int
+walk_tree(const char *root,
+	  WALK *wp,
+	  WALK_FN fn);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * xscan.c
+ *
+ * Copyright (c) 2025 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#define _XOPEN_SOURCE 800
+#define __BSD_VISIBLE 1
+#define _DARWIN_C_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "backend.h"
+#include "xscan.h"
+
+/*
+ * List the extended attributes of an entry once and pick out the ones
+ * Samba uses:
+ *
+ *   user.DOSATTRIB      DOS attributes (returned for parsing)
+ *   security.NTACL      NT ACL (read, version from the first 16 bits)
+ *   user.SAMBA_PAI      POSIX ACL inheritance flags (read)
+ *   user.DosStream.*    Alternate data streams (sizes only, they may be big)
+ *
+ * The list and value buffers are per thread and grow as needed, so
+ * nothing is allocated per entry. DOSATTRIB, NTACL and SAMBA_PAI are
+ * read with one batch request once the names are known.
+ */
+
+typedef struct {
+    unsigned char *buf;
+    size_t size;
+} XBUF;
+
+typedef struct {
+    XBUF names;
+    XBUF dosattrib;
+    XBUF ntacl;
+    XBUF pai;
+} XBUFS;
+
+static pthread_key_t x_key;
+static pthread_once_t x_once = PTHREAD_ONCE_INIT;
+static int x_key_error = 0;
+
+
+static void
+x_free(void *p) {
+    XBUFS *xp = p;
+
+    free(xp->names.buf);
+    free(xp->dosattrib.buf);
+    free(xp->ntacl.buf);
+    free(xp->pai.buf);
+    free(xp);
+}
+
+static void
+x_init(void) {
+    x_key_error = pthread_key_create(&x_key, x_free);
+}
+
+/* The buffers of the calling thread, freed when it exits */
+static XBUFS *
+x_bufs(void) {
+    XBUFS *xp;
+
+    pthread_once(&x_once, x_init);
+    if (x_key_error) {
+	errno = x_key_error;
+	return NULL;
+    }
+
+    xp = pthread_getspecific(x_key);
+    if (!xp) {
+	xp = calloc(1, sizeof(*xp));
+	if (!xp)
+	    return NULL;
+	if ((errno = pthread_setspecific(x_key, xp)) != 0) {
+	    free(xp);
+	    return NULL;
+	}
+    }
+    return xp;
+}
+
+
+static int
+xbuf_grow(XBUF *xb,
+	  size_t size) {
+    size_t nsize;
+    unsigned char *nbuf;
+
+    if (size <= xb->size)
+	return 0;
+
+    nsize = xb->size ? xb->size : 256;
+    while (nsize < size)
+	nsize *= 2;
+
+    nbuf = realloc(xb->buf, nsize);
+    if (!nbuf)
+	return -1;
+
+    xb->buf = nbuf;
+    xb->size = nsize;
+    return 0;
+}
+
+
+static ssize_t
+xscan_list(const char *path,
+	   XBUF *xb) {
+    ssize_t len;
+
+    if (xb->size == 0 && xbuf_grow(xb, 256) < 0)
+	return -1;
+
+    while ((len = backend_list(path, (char *) xb->buf, xb->size)) < 0 && errno == ERANGE) {
+	/* Ask for the size needed, it may change again before we retry */
+	len = backend_list(path, NULL, 0);
+	if (len < 0 || xbuf_grow(xb, len+1) < 0)
+	    return -1;
+    }
+    return len;
+}
+
+static ssize_t
+xscan_get(const char *path,
+	  const char *name,
+	  XBUF *xb) {
+    ssize_t len;
+
+    while ((len = backend_get(path, name, xb->buf, xb->size)) < 0 && errno == ERANGE) {
+	len = backend_get(path, name, NULL, 0);
+	if (len < 0 || xbuf_grow(xb, len+1) < 0)
+	    return -1;
+    }
+    return len;
+}
+
+
+int
+xscan_entry(const char *path,
+	    XSCAN *xp) {
+    BACKEND_OP ops[3];
+    XBUF *bufs[3];
+    XBUFS *xb;
+    ssize_t len, i;
+    size_t n = 0, k;
+    char *name;
+
+    memset(xp, 0, sizeof(*xp));
+    xp->dosattrib_len = -1;
+    xp->ntacl_len = -1;
+    xp->pai_len = -1;
+
+    if ((xb = x_bufs()) == NULL)
+	return -1;
+    len = xscan_list(path, &xb->names);
+    if (len < 0)
+	return -1;
+
+    for (i = 0; i < len; i += strlen(name)+1) {
+	name = (char *) xb->names.buf+i;
+	xp->nattrs++;
+
+	if (strcmp(name, "user.DOSATTRIB") == 0)
+	    bufs[n] = &xb->dosattrib;
+	else if (strcmp(name, "security.NTACL") == 0)
+	    bufs[n] = &xb->ntacl;
+	else if (strcmp(name, "user.SAMBA_PAI") == 0)
+	    bufs[n] = &xb->pai;
+	else {
+	    if (strncmp(name, "user.DosStream.", 15) == 0) {
+		ssize_t slen = backend_get(path, name, NULL, 0);
+
+		if (slen < 0)
+		    xp->errors++;
+		else {
+		    xp->streams++;
+		    xp->stream_bytes += slen;
+		}
+	    }
+	    continue;
+	}
+
+	if (n >= sizeof(ops)/sizeof(ops[0]) ||
+	    (bufs[n]->size == 0 && xbuf_grow(bufs[n], 256) < 0))
+	    continue;
+	ops[n].path = path;
+	ops[n].name = name;
+	ops[n].buf = bufs[n]->buf;
+	ops[n].size = bufs[n]->size;
+	ops[n].flags = 0;
+	n++;
+    }
+
+    (void) backend_get_batch(ops, n);
+
+    for (k = 0; k < n; k++) {
+	len = ops[k].rc;
+	if (len < 0 && ops[k].error == ERANGE)
+	    len = xscan_get(path, ops[k].name, bufs[k]);
+	if (len < 0) {
+	    xp->errors++;
+	    if (bufs[k] == &xb->dosattrib)
+		xp->dosattrib_error = ops[k].error != ERANGE ? ops[k].error : errno;
+	    continue;
+	}
+
+	if (bufs[k] == &xb->dosattrib) {
+	    xp->dosattrib = xb->dosattrib.buf;
+	    xp->dosattrib_len = len;
+	} else if (bufs[k] == &xb->ntacl) {
+	    xp->ntacl_len = len;
+	    if (len >= 2)
+		xp->ntacl_version = xb->ntacl.buf[0] | (xb->ntacl.buf[1] << 8);
+	} else
+	    xp->pai_len = len;
+    }
+    return 0;
+}